@@ -0,0 +1,1020 @@
+#if !defined(_WIN32) /* epoll is only supported on Linux */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifndef __TT_BUFFER_H__
+#include "tt_buffer.h"
+#endif
+#include "terminal_inner.h"
+#include "term_server.h"
+
+#ifdef WATCH_RAM
+#include "tt_malloc_debug.h"
+#define MY_MALLOC(x) my_malloc((x), __FILE__, __LINE__)
+#define MY_FREE(x) my_free((x), __FILE__, __LINE__)
+#define MY_STRDUP(x) my_strdup((x), __FILE__, __LINE__)
+#else
+#define MY_MALLOC(x) malloc((x))
+#define MY_FREE(x) free((x))
+#define MY_STRDUP(x) strdup((x))
+#endif
+
+#define SERVER_MAX_EVENTS  64
+#define SERVER_READ_SIZE   4096
+#define SERVER_SEND_WAIT   5000 /* ms, give up write if client not read for a long time */
+
+#define TELNET_SE          240
+#define TELNET_SB          250
+#define TELNET_WILL        251
+#define TELNET_WONT        252
+#define TELNET_DO          253
+#define TELNET_DONT        254
+#define TELNET_IAC         255
+#define TELOPT_ECHO        1
+#define TELOPT_SGA         3
+#define TELOPT_NAWS        31
+
+typedef enum TelnetState {
+	TN_DATA,
+	TN_CR, /* got CR, skip LF or NUL after it */
+	TN_IAC,
+	TN_OPT, /* got WILL/WONT/DO/DONT, skip option */
+	TN_SB,
+	TN_SB_IAC,
+} TelnetState;
+
+typedef struct TermSession {
+	int fd;
+	Terminal *term;
+	struct TermServer *server;
+	pthread_mutex_t lock; /* protect input, scheduled, closed and exiting */
+	pthread_cond_t cond; /* signal while input arrived or closed */
+	TTBuffer input; /* decoded input from client */
+	size_t input_off; /* read offset of input */
+	int scheduled; /* in ready queue or processing by worker */
+	int closed; /* removed from epoll by io thread */
+	int exiting; /* term_exit or Ctrl+D, waiting io thread close it */
+	int started; /* prompt printed */
+	int wake; /* term_printf from other thread, see session_wakeup */
+	uint64_t timer_due; /* time to wake up for deferred async frame, 0 if not in timer list */
+	struct TermSession *timer_next; /* protected by server->lock */
+	int cols;
+	int rows;
+	TelnetState tn_state;
+	unsigned char sb[16]; /* telnet sub negotiation */
+	int sb_len;
+	pthread_mutex_t write_lock; /* protect output, output_off and armed */
+	TTBuffer output; /* translated output */
+	size_t output_off; /* bytes of output sent, rest is sent by io thread once socket is writable */
+	int armed; /* EPOLLOUT is watched for output not sent */
+	unsigned char last_out; /* last byte sent, for translate '\n' to "\r\n" */
+	struct TermSession *prev;
+	struct TermSession *next;
+	struct TermSession *ready_next;
+} TermSession;
+
+struct TermServer {
+	int listen_fd;
+	int epoll_fd;
+	int wake_fd[2]; /* wake io thread for exit or new timer */
+	int is_tcp;
+	char *unix_path; /* unlink at destroy */
+	uint32_t flags;
+	char *prompt;
+	TermNode *root; /* shared by all sessions, only read while walking */
+	void *userdata;
+	pthread_mutex_t lock; /* protect sessions and ready queue */
+	pthread_cond_t cond;
+	TermSession *sessions;
+	int session_cnt;
+	TermSession *ready_head;
+	TermSession *ready_tail;
+	TermSession *timers; /* sessions waiting for deferred async frame, fired by io thread */
+	int stop_io;
+	int stop_workers;
+	int io_started;
+	pthread_t io_thread;
+	pthread_t *workers;
+	int worker_num;
+	int parked; /* workers blocked in session_read by handlers waiting for input */
+	int spare_num; /* detached workers started for parked ones, exit once there are more spares than parked */
+};
+
+static int set_nonblock(int fd) {
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int send_all(int fd, const unsigned char *buf, size_t len) {
+	ssize_t rc = 0;
+	struct pollfd pfd;
+
+	while (len > 0) {
+		rc = send(fd, buf, len, MSG_NOSIGNAL);
+		if (rc > 0) {
+			buf += rc;
+			len -= rc;
+			continue;
+		}
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			if (poll(&pfd, 1, SERVER_SEND_WAIT) > 0) {
+				continue;
+			}
+		}
+		return -1;
+	}
+	return 0;
+}
+
+static uint64_t server_time_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* caller must hold server->lock */
+static void server_ready_push_locked(TermServer *server, TermSession *s) {
+	s->ready_next = NULL;
+	if (server->ready_tail == NULL) {
+		server->ready_head = s;
+	} else {
+		server->ready_tail->ready_next = s;
+	}
+	server->ready_tail = s;
+	pthread_cond_signal(&(server->cond));
+}
+
+static void server_ready_push(TermServer *server, TermSession *s) {
+	pthread_mutex_lock(&(server->lock));
+	server_ready_push_locked(server, s);
+	pthread_mutex_unlock(&(server->lock));
+}
+
+/* remove session from server, caller must hold server->lock and call session_release after unlock */
+static void session_unlink_locked(TermServer *server, TermSession *s) {
+	TermSession **pp = NULL;
+
+	if (s->timer_due > 0) {
+		for (pp = &(server->timers); *pp != s; pp = &((*pp)->timer_next));
+		*pp = s->timer_next;
+	}
+	if (s->prev != NULL) {
+		s->prev->next = s->next;
+	} else {
+		server->sessions = s->next;
+	}
+	if (s->next != NULL) {
+		s->next->prev = s->prev;
+	}
+	server->session_cnt--;
+}
+
+/* free session removed from server, terminal is destroyed without server->lock as it may take job_lock of terminal */
+static void session_release(TermSession *s) {
+	if (s->term != NULL) {
+		term_destroy(s->term); /* jobs are cancelled but not waited */
+	}
+	close(s->fd);
+	tt_buffer_free(&(s->input));
+	tt_buffer_free(&(s->output));
+	pthread_cond_destroy(&(s->cond));
+	pthread_mutex_destroy(&(s->lock));
+	pthread_mutex_destroy(&(s->write_lock));
+	MY_FREE(s);
+}
+
+static void session_free(TermServer *server, TermSession *s) {
+	pthread_mutex_lock(&(server->lock));
+	session_unlink_locked(server, s);
+	pthread_mutex_unlock(&(server->lock));
+	session_release(s);
+}
+
+static void *server_spare_thread(void *arg);
+
+/* worker of a session whose handler waits for input (term_getline, fg, pager) leaves the pool while blocked,
+ * a spare worker is started if needed, so the ready queue is always served by worker_num threads */
+static void server_worker_park(TermServer *server, int park) {
+	pthread_t tid;
+
+	pthread_mutex_lock(&(server->lock));
+	if (park) {
+		server->parked++;
+		if (server->spare_num < server->parked && !server->stop_workers
+				&& 0 == pthread_create(&tid, NULL, server_spare_thread, server)) {
+			pthread_detach(tid);
+			server->spare_num++;
+		}
+	} else {
+		server->parked--;
+		pthread_cond_broadcast(&(server->cond)); /* surplus spare exits */
+	}
+	pthread_mutex_unlock(&(server->lock));
+}
+
+static ssize_t session_read(Terminal *term, void *buf, size_t count) {
+	size_t len = 0;
+	ssize_t rc = 0;
+	int parked = 0;
+	TermSession *s = (TermSession *)term_transport_data(term);
+
+	pthread_mutex_lock(&(s->lock));
+	if (s->input_off >= s->input.used && !s->closed && !s->wake) { /* lock order is server->lock then s->lock */
+		pthread_mutex_unlock(&(s->lock));
+		server_worker_park(s->server, 1);
+		parked = 1;
+		pthread_mutex_lock(&(s->lock));
+	}
+	while (s->input_off >= s->input.used && !s->closed && !s->wake) {
+		pthread_cond_wait(&(s->cond), &(s->lock));
+	}
+	if (s->input_off >= s->input.used) {
+		if (s->wake) { /* return 0 to print async messages */
+			s->wake = 0;
+			rc = 0;
+		} else { /* closed */
+			rc = -1;
+		}
+	} else {
+		len = s->input.used - s->input_off;
+		len = len < count ? len : count;
+		memcpy(buf, s->input.content + s->input_off, len);
+		s->input_off += len;
+		if (s->input_off >= s->input.used) {
+			tt_buffer_empty(&(s->input));
+			s->input_off = 0;
+		}
+		rc = len;
+	}
+	pthread_mutex_unlock(&(s->lock));
+	if (parked) {
+		server_worker_park(s->server, 0);
+	}
+	return rc;
+}
+
+/* client terminal is in raw mode, translate '\n' to "\r\n", and escape IAC for telnet */
+static void session_translate(TermSession *s, const unsigned char *data, size_t count) {
+	size_t i = 0, start = 0;
+
+	for (i = 0, start = 0; i < count; i++) {
+		if (data[i] == '\n' && (i > 0 ? data[i - 1] : s->last_out) != '\r') {
+			tt_buffer_write(&(s->output), data + start, i - start);
+			tt_buffer_write(&(s->output), "\r", 1);
+			start = i;
+		} else if (data[i] == TELNET_IAC && (s->server->flags & TERM_SERVER_TELNET)) {
+			tt_buffer_write(&(s->output), data + start, i + 1 - start);
+			start = i; /* IAC written twice */
+		}
+	}
+	if (count > 0) {
+		tt_buffer_write(&(s->output), data + start, count - start);
+		s->last_out = data[count - 1];
+	}
+}
+
+/* send output without blocking, caller must hold write_lock, return 0 if all sent, 1 if socket would block */
+static int session_send(TermSession *s) {
+	ssize_t rc = 0;
+
+	while (s->output_off < s->output.used) {
+		rc = send(s->fd, s->output.content + s->output_off, s->output.used - s->output_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return 1;
+		}
+		if (rc <= 0) { /* closed or error, io thread will close session by read */
+			break;
+		}
+		s->output_off += rc;
+	}
+	tt_buffer_empty(&(s->output));
+	s->output_off = 0;
+	return 0;
+}
+
+/* watch EPOLLOUT while output is not sent, caller must hold write_lock */
+static void session_arm(TermSession *s, int armed) {
+	struct epoll_event ev;
+
+	if (s->armed == armed) {
+		return;
+	}
+	memset(&ev, 0x00, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | (armed ? EPOLLOUT : 0);
+	ev.data.ptr = s;
+	epoll_ctl(s->server->epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+	s->armed = armed;
+}
+
+/* output not sent is never translated again, terminal queues the rest while socket would block */
+static ssize_t session_writev(Terminal *term, const TermIOVec *iov, int iovcnt) {
+	int i = 0;
+	size_t count = 0;
+	TermSession *s = (TermSession *)term_transport_data(term);
+
+	pthread_mutex_lock(&(s->write_lock));
+	if (session_send(s) != 0) {
+		pthread_mutex_unlock(&(s->write_lock));
+		errno = EAGAIN;
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++) { /* all segments are translated into one buffer, and sent by one syscall */
+		session_translate(s, (const unsigned char *)iov[i].base, iov[i].len);
+		count += iov[i].len;
+	}
+	session_arm(s, session_send(s) != 0);
+	pthread_mutex_unlock(&(s->write_lock));
+	return count;
+}
+
+static ssize_t session_write(Terminal *term, const void *buf, size_t count) {
+	TermIOVec iov;
+
+	iov.base = buf;
+	iov.len = count;
+	return session_writev(term, &iov, 1);
+}
+
+/* called by worker of session, wait until output not sent is sent */
+static int session_writable(Terminal *term, int ms) {
+	int rc = 0;
+	struct pollfd pfd;
+	TermSession *s = (TermSession *)term_transport_data(term);
+
+	pfd.fd = s->fd;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, ms) <= 0) {
+		return 0;
+	}
+	pthread_mutex_lock(&(s->write_lock));
+	rc = session_send(s) == 0;
+	session_arm(s, !rc);
+	pthread_mutex_unlock(&(s->write_lock));
+	return rc;
+}
+
+static void session_winsize(Terminal *term, int *cols, int *rows) {
+	TermSession *s = (TermSession *)term_transport_data(term);
+	*cols = s->cols;
+	*rows = s->rows;
+}
+
+/* set wake of session, return 1 if session should be pushed into ready queue */
+static int session_wake_set(TermSession *s) {
+	int need_schedule = 0;
+
+	pthread_mutex_lock(&(s->lock));
+	s->wake = 1;
+	pthread_cond_broadcast(&(s->cond));
+	need_schedule = !s->scheduled && !s->exiting && !s->closed;
+	if (need_schedule) {
+		s->scheduled = 1;
+	}
+	pthread_mutex_unlock(&(s->lock));
+	return need_schedule;
+}
+
+/* called by any thread, schedule session to print async messages */
+static void session_wakeup(Terminal *term) {
+	TermSession *s = (TermSession *)term_transport_data(term);
+
+	if (session_wake_set(s)) {
+		server_ready_push(s->server, s);
+	}
+}
+
+/* called in io thread once socket is writable, terminal sends its queue after woken up */
+static void session_flush(TermSession *s) {
+	pthread_mutex_lock(&(s->write_lock));
+	session_arm(s, session_send(s) != 0);
+	pthread_mutex_unlock(&(s->write_lock));
+	session_wakeup(s->term);
+}
+
+/* called by worker processing the session, io thread will call session_wakeup after ms */
+static void session_timer(Terminal *term, int ms) {
+	ssize_t rc = 0;
+	uint64_t due = server_time_ms() + ms;
+	TermSession *s = (TermSession *)term_transport_data(term);
+	TermServer *server = s->server;
+
+	pthread_mutex_lock(&(server->lock));
+	if (s->timer_due == 0) {
+		s->timer_next = server->timers;
+		server->timers = s;
+		s->timer_due = due;
+	} else if (due < s->timer_due) {
+		s->timer_due = due;
+	}
+	pthread_mutex_unlock(&(server->lock));
+	rc = write(server->wake_fd[1], "", 1); /* io thread recalculate timeout, pipe is non-blocking */
+	(void)rc;
+}
+
+/* called in io thread, return timeout of epoll_wait.
+ * fired sessions are woken up under server->lock, a closed session may be freed by its worker once lock is released */
+static int server_timers_fire(TermServer *server) {
+	int timeout = -1;
+	uint64_t now = server_time_ms();
+	TermSession **pp = NULL, *s = NULL;
+
+	pthread_mutex_lock(&(server->lock));
+	for (pp = &(server->timers); *pp != NULL;) {
+		s = *pp;
+		if (s->timer_due <= now) {
+			*pp = s->timer_next;
+			s->timer_due = 0;
+			s->timer_next = NULL;
+			if (session_wake_set(s)) { /* lock order is server->lock then s->lock */
+				server_ready_push_locked(server, s);
+			}
+		} else {
+			if (timeout < 0 || (int)(s->timer_due - now) < timeout) {
+				timeout = (int)(s->timer_due - now);
+			}
+			pp = &(s->timer_next);
+		}
+	}
+	pthread_mutex_unlock(&(server->lock));
+	return timeout;
+}
+
+static void session_subnegotiation(TermSession *s) {
+	if (s->sb_len >= 5 && s->sb[0] == TELOPT_NAWS) {
+		s->cols = (s->sb[1] << 8) | s->sb[2];
+		s->rows = (s->sb[3] << 8) | s->sb[4];
+	}
+}
+
+/* decode telnet NVT stream in io thread, return length of data in out */
+static size_t session_decode(TermSession *s, const unsigned char *in, size_t len, unsigned char *out) {
+	size_t i = 0, out_len = 0;
+	unsigned char c = 0;
+
+	if (!(s->server->flags & TERM_SERVER_TELNET)) {
+		memcpy(out, in, len);
+		return len;
+	}
+	for (i = 0; i < len; i++) {
+		c = in[i];
+		switch (s->tn_state) {
+			case TN_CR:
+				s->tn_state = TN_DATA;
+				if (c == '\n' || c == '\0') { /* "\r\n" and "\r\0" both mean enter */
+					break;
+				}
+				/* fall through */
+			case TN_DATA:
+				if (c == TELNET_IAC) {
+					s->tn_state = TN_IAC;
+				} else {
+					out[out_len++] = c;
+					if (c == '\r') {
+						s->tn_state = TN_CR;
+					}
+				}
+				break;
+			case TN_IAC:
+				if (c == TELNET_IAC) {
+					out[out_len++] = c;
+					s->tn_state = TN_DATA;
+				} else if (c >= TELNET_WILL && c <= TELNET_DONT) {
+					s->tn_state = TN_OPT;
+				} else if (c == TELNET_SB) {
+					s->sb_len = 0;
+					s->tn_state = TN_SB;
+				} else { /* NOP, GA, BREAK ... ignored */
+					s->tn_state = TN_DATA;
+				}
+				break;
+			case TN_OPT: /* replies of our WILL/DO, nothing to do */
+				s->tn_state = TN_DATA;
+				break;
+			case TN_SB:
+				if (c == TELNET_IAC) {
+					s->tn_state = TN_SB_IAC;
+				} else if (s->sb_len < (int)sizeof(s->sb)) {
+					s->sb[s->sb_len++] = c;
+				}
+				break;
+			case TN_SB_IAC:
+				if (c == TELNET_SE) {
+					session_subnegotiation(s);
+					s->tn_state = TN_DATA;
+				} else {
+					if (c == TELNET_IAC && s->sb_len < (int)sizeof(s->sb)) { /* escaped 255 in sub negotiation */
+						s->sb[s->sb_len++] = c;
+					}
+					s->tn_state = TN_SB;
+				}
+				break;
+		}
+	}
+	return out_len;
+}
+
+/* called in io thread, remove session from epoll and wake up worker */
+static void session_close(TermServer *server, TermSession *s) {
+	int need_free = 0;
+
+	epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+	shutdown(s->fd, SHUT_RDWR);
+	pthread_mutex_lock(&(s->lock));
+	s->closed = 1;
+	pthread_cond_broadcast(&(s->cond));
+	need_free = !s->scheduled;
+	pthread_mutex_unlock(&(s->lock));
+	if (need_free) {
+		session_free(server, s);
+	}
+}
+
+static void session_readable(TermServer *server, TermSession *s) {
+	ssize_t rc = 0;
+	size_t len = 0;
+	int need_schedule = 0;
+	unsigned char buf[SERVER_READ_SIZE], data[SERVER_READ_SIZE];
+
+	while (1) {
+		rc = recv(s->fd, buf, sizeof(buf), 0);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
+		if (rc <= 0) { /* closed by peer or error */
+			session_close(server, s);
+			break;
+		}
+		len = session_decode(s, buf, rc, data);
+		if (len == 0) {
+			continue;
+		}
+		pthread_mutex_lock(&(s->lock));
+		tt_buffer_write(&(s->input), data, len);
+		pthread_cond_broadcast(&(s->cond));
+		need_schedule = !s->scheduled && !s->exiting;
+		if (need_schedule) {
+			s->scheduled = 1;
+		}
+		pthread_mutex_unlock(&(s->lock));
+		if (need_schedule) {
+			server_ready_push(server, s);
+		}
+	}
+}
+
+static void session_accept(TermServer *server) {
+	int fd = -1, one = 1;
+	TermSession *s = NULL;
+	TermTransport tp;
+	struct epoll_event ev;
+	static const unsigned char negotiation[] = {
+		TELNET_IAC, TELNET_WILL, TELOPT_ECHO,
+		TELNET_IAC, TELNET_WILL, TELOPT_SGA,
+		TELNET_IAC, TELNET_DO, TELOPT_NAWS,
+	};
+
+	while (1) {
+		fd = accept(server->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break; /* EAGAIN or error */
+		}
+		set_nonblock(fd);
+		if (server->is_tcp) {
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		}
+		s = (TermSession *)MY_MALLOC(sizeof(TermSession));
+		if (s == NULL) {
+			close(fd);
+			continue;
+		}
+		memset(s, 0x00, sizeof(TermSession));
+		s->fd = fd;
+		s->server = server;
+		s->cols = 80;
+		s->rows = 24;
+		s->tn_state = TN_DATA;
+		pthread_mutex_init(&(s->lock), NULL);
+		pthread_mutex_init(&(s->write_lock), NULL);
+		pthread_cond_init(&(s->cond), NULL);
+		tt_buffer_init(&(s->input));
+		tt_buffer_init(&(s->output));
+		memset(&tp, 0x00, sizeof(tp));
+		tp.read = session_read;
+		tp.write = session_write;
+		tp.writev = session_writev;
+		tp.winsize = session_winsize;
+		tp.raw_mode = NULL; /* client is switched to character mode by telnet negotiation */
+		tp.wakeup = session_wakeup;
+		tp.timer = session_timer;
+		tp.writable = session_writable;
+
+		pthread_mutex_lock(&(server->lock));
+		s->next = server->sessions;
+		if (server->sessions != NULL) {
+			server->sessions->prev = s;
+		}
+		server->sessions = s;
+		server->session_cnt++;
+		if (0 != term_create_transport(&(s->term), server->prompt, server->root, &tp, s)) {
+			s->term = NULL;
+			session_unlink_locked(server, s);
+			pthread_mutex_unlock(&(server->lock));
+			session_release(s);
+			continue;
+		}
+		pthread_mutex_unlock(&(server->lock));
+		term_userdata_set(s->term, server->userdata);
+
+		if (server->flags & TERM_SERVER_TELNET) {
+			send_all(fd, negotiation, sizeof(negotiation));
+		}
+		memset(&ev, 0x00, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = s;
+		if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			session_free(server, s);
+			continue;
+		}
+		s->scheduled = 1; /* print prompt in worker */
+		server_ready_push(server, s);
+	}
+}
+
+static void *server_io_thread(void *arg) {
+	int i = 0, n = 0, running = 1, timeout = -1;
+	char drop[64];
+	TermServer *server = (TermServer *)arg;
+	TermSession *s = NULL, *next = NULL, *idle = NULL;
+	struct epoll_event events[SERVER_MAX_EVENTS];
+
+	while (running) {
+		n = epoll_wait(server->epoll_fd, events, SERVER_MAX_EVENTS, timeout);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			if (events[i].data.ptr == (void *)server) {
+				session_accept(server);
+			} else if (events[i].data.ptr == (void *)(server->wake_fd)) {
+				while (read(server->wake_fd[0], drop, sizeof(drop)) > 0);
+				pthread_mutex_lock(&(server->lock));
+				running = !server->stop_io;
+				pthread_mutex_unlock(&(server->lock));
+			} else {
+				if (events[i].events & EPOLLOUT) {
+					session_flush((TermSession *)events[i].data.ptr);
+				}
+				if (events[i].events & ~EPOLLOUT) { /* session may be freed */
+					session_readable(server, (TermSession *)events[i].data.ptr);
+				}
+			}
+		}
+		timeout = server_timers_fire(server);
+	}
+
+	/* close all sessions, and let workers exit after ready queue processed */
+	pthread_mutex_lock(&(server->lock));
+	for (s = server->sessions; s != NULL; s = next) {
+		next = s->next;
+		epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+		shutdown(s->fd, SHUT_RDWR);
+		pthread_mutex_lock(&(s->lock));
+		s->closed = 1;
+		pthread_cond_broadcast(&(s->cond));
+		if (!s->scheduled) { /* not in ready queue, released after unlock */
+			pthread_mutex_unlock(&(s->lock));
+			session_unlink_locked(server, s);
+			s->ready_next = idle;
+			idle = s;
+		} else {
+			pthread_mutex_unlock(&(s->lock));
+		}
+	}
+	server->stop_workers = 1;
+	pthread_cond_broadcast(&(server->cond));
+	pthread_mutex_unlock(&(server->lock));
+	for (s = idle; s != NULL; s = next) {
+		next = s->ready_next;
+		session_release(s);
+	}
+	return NULL;
+}
+
+/* process all input of session in worker, one session is never processed by two workers at the same time */
+static void session_run(TermSession *s) {
+	if (!s->started) {
+		s->started = 1;
+		term_session_begin(s->term);
+	}
+	while (1) {
+		pthread_mutex_lock(&(s->lock));
+		if (s->closed) {
+			pthread_mutex_unlock(&(s->lock));
+			session_free(s->server, s);
+			return;
+		}
+		if (!s->exiting && s->input_off >= s->input.used && s->wake) {
+			s->wake = 0;
+			pthread_mutex_unlock(&(s->lock));
+			term_session_drain(s->term);
+			continue;
+		}
+		if (s->exiting || s->input_off >= s->input.used) {
+			s->scheduled = 0;
+			pthread_mutex_unlock(&(s->lock));
+			return;
+		}
+		pthread_mutex_unlock(&(s->lock));
+		if (term_session_key(s->term) < 0) {
+			pthread_mutex_lock(&(s->lock));
+			s->exiting = 1;
+			pthread_mutex_unlock(&(s->lock));
+			shutdown(s->fd, SHUT_RDWR); /* io thread will get EPOLLRDHUP and close it */
+		}
+	}
+}
+
+/* spare worker exits once a parked worker is back and there are more spares than parked */
+static void server_worker_loop(TermServer *server, int spare) {
+	TermSession *s = NULL;
+
+	while (1) {
+		pthread_mutex_lock(&(server->lock));
+		while (server->ready_head == NULL && !server->stop_workers && !(spare && server->spare_num > server->parked)) {
+			pthread_cond_wait(&(server->cond), &(server->lock));
+		}
+		s = server->ready_head;
+		if (s == NULL || (spare && server->spare_num > server->parked)) {
+			if (spare) {
+				server->spare_num--;
+				pthread_cond_broadcast(&(server->cond)); /* term_server_destroy waits spares exited */
+			}
+			pthread_mutex_unlock(&(server->lock));
+			break;
+		}
+		server->ready_head = s->ready_next;
+		if (server->ready_head == NULL) {
+			server->ready_tail = NULL;
+		}
+		pthread_mutex_unlock(&(server->lock));
+		session_run(s);
+	}
+}
+
+static void *server_worker_thread(void *arg) {
+	server_worker_loop((TermServer *)arg, 0);
+	return NULL;
+}
+
+static void *server_spare_thread(void *arg) {
+	server_worker_loop((TermServer *)arg, 1);
+	return NULL;
+}
+
+static int server_listen(TermServer *server, const char *address) {
+	int fd = -1, one = 1, rc = -1;
+	char *host = NULL, *port = NULL, *sep = NULL;
+	struct sockaddr_un sun;
+	struct addrinfo hints, *res = NULL, *cur = NULL;
+
+	if (0 == strncmp(address, "unix:", 5)) {
+		if (strlen(address + 5) >= sizeof(sun.sun_path)) {
+			goto func_end;
+		}
+		memset(&sun, 0x00, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, address + 5);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) {
+			goto func_end;
+		}
+		unlink(sun.sun_path);
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+			goto func_end;
+		}
+		server->unix_path = MY_STRDUP(sun.sun_path);
+	} else if (0 == strncmp(address, "tcp:", 4)) {
+		host = MY_STRDUP(address + 4);
+		if (host == NULL) {
+			goto func_end;
+		}
+		sep = strrchr(host, ':');
+		if (sep != NULL) {
+			*sep = '\0';
+			port = sep + 1;
+		} else {
+			port = host;
+		}
+		memset(&hints, 0x00, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_PASSIVE;
+		if (0 != getaddrinfo(sep != NULL ? host : NULL, port, &hints, &res)) {
+			goto func_end;
+		}
+		for (cur = res; cur != NULL; cur = cur->ai_next) {
+			fd = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
+			if (fd < 0) {
+				continue;
+			}
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (bind(fd, cur->ai_addr, cur->ai_addrlen) == 0) {
+				break;
+			}
+			close(fd);
+			fd = -1;
+		}
+		if (fd < 0) {
+			goto func_end;
+		}
+		server->is_tcp = 1;
+	} else {
+		goto func_end;
+	}
+	if (listen(fd, SOMAXCONN) < 0 || set_nonblock(fd) < 0) {
+		goto func_end;
+	}
+	server->listen_fd = fd;
+	rc = 0;
+func_end:
+	if (rc != 0 && fd >= 0) {
+		close(fd);
+	}
+	if (res != NULL) {
+		freeaddrinfo(res);
+	}
+	if (host != NULL) {
+		MY_FREE(host);
+	}
+	return rc;
+}
+
+int term_server_create(TermServer **_server, const char *address, const char *prompt, TermNode *root, int workers, uint32_t flags) {
+	int ret = -1, i = 0;
+	TermServer *server = NULL;
+	struct epoll_event ev;
+
+	if (_server == NULL || address == NULL || root == NULL) {
+		return -1;
+	}
+	server = (TermServer *)MY_MALLOC(sizeof(TermServer));
+	if (server == NULL) {
+		goto func_end;
+	}
+	memset(server, 0x00, sizeof(TermServer));
+	server->listen_fd = -1;
+	server->epoll_fd = -1;
+	server->wake_fd[0] = -1;
+	server->wake_fd[1] = -1;
+	server->flags = flags;
+	server->root = root;
+	server->prompt = MY_STRDUP(prompt != NULL ? prompt : "");
+	pthread_mutex_init(&(server->lock), NULL);
+	pthread_cond_init(&(server->cond), NULL);
+	if (server->prompt == NULL) {
+		goto func_end;
+	}
+	if (0 != server_listen(server, address)) {
+		goto func_end;
+	}
+	if (pipe(server->wake_fd) < 0) {
+		goto func_end;
+	}
+	set_nonblock(server->wake_fd[0]);
+	set_nonblock(server->wake_fd[1]);
+	server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (server->epoll_fd < 0) {
+		goto func_end;
+	}
+	memset(&ev, 0x00, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = server;
+	if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &ev) < 0) {
+		goto func_end;
+	}
+	ev.data.ptr = server->wake_fd;
+	if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->wake_fd[0], &ev) < 0) {
+		goto func_end;
+	}
+
+	workers = workers > 0 ? workers : 1;
+	server->workers = (pthread_t *)MY_MALLOC(sizeof(pthread_t) * workers);
+	if (server->workers == NULL) {
+		goto func_end;
+	}
+	for (i = 0; i < workers; i++) {
+		if (0 != pthread_create(&(server->workers[i]), NULL, server_worker_thread, server)) {
+			goto func_end;
+		}
+		server->worker_num++;
+	}
+	if (0 != pthread_create(&(server->io_thread), NULL, server_io_thread, server)) {
+		goto func_end;
+	}
+	server->io_started = 1;
+	*_server = server;
+	ret = 0;
+func_end:
+	if (ret != 0 && server != NULL) {
+		term_server_destroy(server);
+	}
+	return ret;
+}
+
+void term_server_destroy(TermServer *server) {
+	int i = 0;
+	char ch = 0;
+
+	if (server->io_started) {
+		pthread_mutex_lock(&(server->lock));
+		server->stop_io = 1;
+		pthread_mutex_unlock(&(server->lock));
+		while (write(server->wake_fd[1], &ch, 1) < 0 && errno == EINTR);
+		pthread_join(server->io_thread, NULL);
+	} else {
+		pthread_mutex_lock(&(server->lock));
+		server->stop_workers = 1;
+		pthread_cond_broadcast(&(server->cond));
+		pthread_mutex_unlock(&(server->lock));
+	}
+	for (i = 0; i < server->worker_num; i++) {
+		pthread_join(server->workers[i], NULL);
+	}
+	pthread_mutex_lock(&(server->lock));
+	while (server->spare_num > 0) { /* spares are detached, ready queue is empty once workers exited */
+		pthread_cond_wait(&(server->cond), &(server->lock));
+	}
+	pthread_mutex_unlock(&(server->lock));
+	if (server->workers != NULL) {
+		MY_FREE(server->workers);
+	}
+	if (server->listen_fd >= 0) {
+		close(server->listen_fd);
+	}
+	if (server->epoll_fd >= 0) {
+		close(server->epoll_fd);
+	}
+	if (server->wake_fd[0] >= 0) {
+		close(server->wake_fd[0]);
+		close(server->wake_fd[1]);
+	}
+	if (server->unix_path != NULL) {
+		unlink(server->unix_path);
+		MY_FREE(server->unix_path);
+	}
+	if (server->prompt != NULL) {
+		MY_FREE(server->prompt);
+	}
+	pthread_cond_destroy(&(server->cond));
+	pthread_mutex_destroy(&(server->lock));
+	MY_FREE(server);
+}
+
+void term_server_userdata_set(TermServer *server, void *userdata) {
+	server->userdata = userdata;
+}
+
+int term_server_session_count(TermServer *server) {
+	int cnt = 0;
+	pthread_mutex_lock(&(server->lock));
+	cnt = server->session_cnt;
+	pthread_mutex_unlock(&(server->lock));
+	return cnt;
+}
+#endif /* end of #if !defined(_WIN32) */
@@ -0,0 +1,27 @@
+#ifndef __TERM_SERVER_H__
+#define __TERM_SERVER_H__
+
+#ifndef __TERMINAL_H__
+#include "terminal.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TERM_SERVER_TELNET           (1 << 0) /* negotiate telnet NVT (ECHO, SGA, NAWS) with client */
+
+typedef struct TermServer TermServer;
+
+/* address is "unix:/path/to/socket" or "tcp:port" or "tcp:host:port", workers is count of threads process sessions */
+extern int term_server_create(TermServer **_server, const char *address, const char *prompt, TermNode *root, int workers, uint32_t flags);
+extern void term_server_destroy(TermServer *server);
+
+extern void term_server_userdata_set(TermServer *server, void *userdata); /* userdata for term_userdata_get in every session */
+extern int term_server_session_count(TermServer *server);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
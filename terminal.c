@@ -3,7 +3,10 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
+#include <ctype.h>
 #include <stdarg.h>
+#include <errno.h>
+#include <time.h>
 
 #if defined(_WIN32)
 	#include <io.h>
@@ -18,29 +21,87 @@
 	#define read _read
 	#define write _write
 	#define isatty _isatty
+	#define open _open
+	#define close _close
+	#define O_RDONLY _O_RDONLY
+	#include "w32_pthread.h"
+	typedef DWORD TermThreadId;
+	#define term_thread_self() GetCurrentThreadId()
+	#define term_thread_equal(a, b) ((a) == (b))
+	#define ATOMIC_XCHG_PTR(p, v) InterlockedExchangePointer((PVOID volatile *)(p), (v))
+	#define ATOMIC_LOAD_PTR(p) InterlockedCompareExchangePointer((PVOID volatile *)(p), NULL, NULL)
+	#define ATOMIC_STORE_PTR(p, v) InterlockedExchangePointer((PVOID volatile *)(p), (v))
+	#define ATOMIC_XCHG_INT(p, v) InterlockedExchange((LONG volatile *)(p), (v))
+	#define ATOMIC_LOAD_INT(p) InterlockedCompareExchange((LONG volatile *)(p), 0, 0)
+	#define ATOMIC_STORE_INT(p, v) InterlockedExchange((LONG volatile *)(p), (v))
+	#define ATOMIC_ADD_INT(p, v) InterlockedExchangeAdd((LONG volatile *)(p), (v))
+	#define TERM_THREAD_LOCAL __declspec(thread)
 #else /* Linux */
 	#include <unistd.h>
+	#include <pthread.h>
 	#include <termios.h>
 	#include <fcntl.h>
 	#include <signal.h>
 	#include <sys/ioctl.h>
+	#include <sys/uio.h>
+	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <poll.h>
+	#include <regex.h>
+	typedef pthread_t TermThreadId;
+	#define term_thread_self() pthread_self()
+	#define term_thread_equal(a, b) pthread_equal((a), (b))
+	#define ATOMIC_XCHG_PTR(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+	#define ATOMIC_LOAD_PTR(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+	#define ATOMIC_STORE_PTR(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+	#define ATOMIC_XCHG_INT(p, v) __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+	#define ATOMIC_LOAD_INT(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+	#define ATOMIC_STORE_INT(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+	#define ATOMIC_ADD_INT(p, v) __atomic_fetch_add((p), (v), __ATOMIC_ACQ_REL)
+	#define TERM_THREAD_LOCAL __thread
 #endif	/* end of #if defined(_WIN32) */
 
 #ifndef __TERMINAL_H__
 #include "terminal.h"
 #endif /* end of #ifndef __TERMINAL_H__ */
+#include "terminal_inner.h"
 
 #define HISTORY_LENGTH     20
 #define WALK_MAX_DEEP      32
+#define OUT_SEG_MAX        32
+#define EXEC_WORKERS       2
+#define ESC_TIMEOUT        50 /* ms, wait rest of escape sequence, ESC is a single key if nothing read */
+#define ESC_PARAM_MAX      4 /* numbers kept in <ESC>[N;N...X */
+#define UNDO_BUDGET        65536 /* bytes of edit journal of one line, oldest edits are dropped if exceeded */
+#define EDIT_INLINE        16 /* bytes of edit text kept in TermEdit, longer runs are moved to heap */
+#define WORD_INLINE        64 /* bytes of one word parsed on stack before moved to heap */
+#define HL_FRONTIER_MAX    8 /* node lists next token is matched against while highlighting */
+#define BATCH_READ_SIZE    65536 /* read size of pipe in batch mode */
+#define BATCH_FLUSH_SIZE   65536 /* output is flushed if collected more than it in batch mode */
+#define STREAM_CHUNK_SIZE  4096 /* output of term_execute_stream is passed to callback once collected more than it */
+#define STAT_SUB_BITS      3 /* 8 buckets per power of 2 in latency histogram, percentile is at most 1/8 above */
+#define STAT_SUB           (1 << STAT_SUB_BITS)
+#define STAT_MAX_EXP       39 /* longer than 2^40 us is counted in last bucket */
+#define STAT_BUCKETS       ((STAT_MAX_EXP - STAT_SUB_BITS + 2) << STAT_SUB_BITS)
+#define OUT_QUEUE_HIGH     (1024 * 1024) /* bytes of output queued for transport before policy applies */
+#define OUT_WAIT_MAX       5000 /* ms owner waits for transport under TERM_OUT_WAIT, output is dropped after it */
 
 #define MATCH_NONE         0
 #define MATCH_PART         1
 #define MATCH_ALL          2
 
+#ifdef WATCH_RAM
+#include "tt_malloc_debug.h"
+#define MY_MALLOC(x) my_malloc((x), __FILE__, __LINE__)
+#define MY_FREE(x) my_free((x), __FILE__, __LINE__)
+#define MY_REALLOC(x, y) my_realloc((x), (y), __FILE__, __LINE__)
+#define MY_STRDUP(x) my_strdup((x), __FILE__, __LINE__)
+#else
 #define MY_MALLOC(x) malloc((x))
 #define MY_FREE(x) free((x))
 #define MY_REALLOC(x, y) realloc((x), (y))
 #define MY_STRDUP(x) strdup((x))
+#endif
 
 #define CTRL_FLAG (0x01000000)
 #define ALT_FLAG (0x02000000)
@@ -62,6 +123,8 @@
 #define KEY_PGDN (0x17 << 8)
 #define KEY_INSERT (0x18 << 8)
 #define KEY_DELETE (0x19 << 8)
+#define KEY_EOF (0x1e << 8) /* input closed, term->read returned error */
+#define KEY_TIMEOUT (0x1f << 8) /* nothing read in timeout of term_getch_timeout */
 
 typedef struct TermWordHelp {
 	char *word;
@@ -72,6 +135,44 @@ typedef struct TermWordHelp {
 typedef struct TermWordHelp TermComplete;
 typedef struct TermWordHelp TermHits;
 
+/* path compressed prefix tree of history, for suggestion of line being typed.
+ * a node is split where entries differ, and merged with its only child once no entry ends at it */
+typedef struct TermHistNode {
+	int count; /* history entries through this node */
+	int best; /* id of most recent history entry through this node */
+	int len;
+	char *label; /* chars of edge from parent, saved after this struct, NULL for root */
+	struct TermHistNode *children;
+	struct TermHistNode *next;
+} TermHistNode;
+
+/* style of token in input line */
+#define HL_NONE            0 /* after pipe, or not classified */
+#define HL_KEY             1
+#define HL_OPTION          2
+#define HL_TEXT            3
+#define HL_UNKNOWN         4
+
+/* token of input line classified by command tree for highlight */
+typedef struct TermHlToken {
+	int start;
+	int end; /* offset of SPACE or end of line after token */
+	int style;
+	int frontier_num; /* < 0 after pipe */
+	TermNode *frontier[HL_FRONTIER_MAX]; /* node lists next token is matched against */
+} TermHlToken;
+
+/* one edit in journal of line for undo and redo */
+typedef struct TermEdit {
+	int insert; /* 1 if text was inserted at pos, 0 if text at pos was removed */
+	int pos;
+	int merge; /* next typed char extends this edit */
+	TTBuffer text;
+	char text_space[EDIT_INLINE];
+	struct TermEdit *prev;
+	struct TermEdit *next;
+} TermEdit;
+
 struct TermNode {
 	NodeType type;
 	char *word;
@@ -89,9 +190,160 @@ struct TermNode {
 
 typedef struct TermArg {
 	char *content;
+	int pipe; /* '|' not quoted or escaped, output of command is passed to filters after it */
+	int end; /* offset of char after arg in parsed line */
 	struct TermArg *next;
 } TermArg;
 
+/* args and completion walk of last TAB, reused while the line before them is not changed */
+typedef struct TermCompleteCache {
+	TermArg *args; /* args parsed by last TAB, those ended before line_dirty are kept */
+	int prefix; /* count of args before last arg walked, visits are valid for them, < 0 if not recorded */
+	int tail_null; /* visits recorded with space tail, no last arg */
+	TermNode *root;
+	int version; /* term_tree_version when recorded */
+	TTBuffer visits; /* nodes matched against last arg in order of walk, NULL for executable found before it */
+} TermCompleteCache;
+
+typedef enum TermFilterType {
+	FILTER_INCLUDE,
+	FILTER_EXCLUDE,
+	FILTER_BEGIN,
+	FILTER_COUNT,
+} TermFilterType;
+
+/* one stage of "command | filter pattern", output is passed through stages line by line */
+typedef struct TermFilter {
+	TermFilterType type;
+	char *pattern;
+	size_t pattern_len;
+	int literal; /* pattern has no meta char of regex, matched by term_filter_find */
+#if !defined(_WIN32)
+	regex_t regex;
+#endif
+	int begun; /* FILTER_BEGIN matched, all lines passed since then */
+	uint64_t count; /* lines counted by FILTER_COUNT */
+	struct TermFilter *next;
+} TermFilter;
+
+typedef struct TermOutSeg {
+	const void *base; /* NULL if content is saved in tempbuf */
+	size_t offset; /* offset in tempbuf if base is NULL */
+	size_t len;
+	TTBuffer owned; /* content handed over by term_write_buffer, freed after written */
+} TermOutSeg;
+
+/* message printed by other threads, see term_async_push */
+typedef struct TermAsyncMsg {
+	struct TermAsyncMsg *next;
+	size_t len;
+	char *data; /* saved after this struct, NULL for stub */
+} TermAsyncMsg;
+
+typedef struct TermExecPending {
+	TermExec exec;
+	int argc;
+	char **argv; /* all strings are copied, tree may change before exec */
+	char *path; /* command for statistics, NULL if not built with TERM_STATS */
+	int async; /* EXEC_ASYNC is set, argv is moved to TermJob */
+	struct TermExecPending *next;
+} TermExecPending;
+
+/* state of term_batch_run */
+typedef struct TermBatch {
+	const char *name; /* file name for errors */
+	int lineno;
+	int start; /* first line of current command, may be multiline */
+	int failed;
+} TermBatch;
+
+typedef enum TermJobState {
+	JOB_QUEUED,
+	JOB_RUNNING,
+	JOB_DONE,
+} TermJobState;
+
+/* EXEC_ASYNC command run by worker thread, see term_job_start */
+typedef struct TermJob {
+	int id;
+	TermExec exec;
+	int argc;
+	char **argv;
+	char *command; /* joined argv, printed by jobs and fg */
+	char *path; /* moved from TermExecPending */
+	int cancel; /* polled by term_exec_cancelled */
+	int fg; /* waited by fg, done message is not printed */
+	TermJobState state; /* protected by job_lock, job is never touched by worker after JOB_DONE */
+	struct TermJob *next; /* in term->jobs, accessed by owner only */
+	struct TermJob *queue_next; /* protected by job_lock */
+} TermJob;
+
+static TERM_THREAD_LOCAL TermJob *term_job_current; /* job running in this worker thread */
+static TERM_THREAD_LOCAL Terminal *term_job_term; /* terminal of job worker thread, see term_job_transport */
+
+/* options generated by dyn_option of selector, kept by walk and never written into tree */
+typedef struct TermDynOptions {
+	TermNode *selector;
+	TermNode *option;
+	struct TermDynOptions *next;
+} TermDynOptions;
+
+#ifdef TERM_STATS
+/* HDR style histogram of latency in us, see term_stat_bucket */
+typedef struct TermStatHist {
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t buckets[STAT_BUCKETS];
+} TermStatHist;
+
+/* latency of one command or selector, kept until term_destroy so path given to term_statistics stays valid */
+typedef struct TermStatPath {
+	TermStatPhase phase;
+	char *path;
+	TermStatHist hist;
+	struct TermStatPath *next;
+} TermStatPath;
+#endif
+
+/* state of one parse and walk, tree is only read while walking, so walks can run in parallel */
+typedef struct TermWalk {
+	Terminal *term;
+	TermEvent event;
+	TermArg *args;
+	int spacetail; /* command has space tail or not */
+	int exec_num;
+	TermComplete *complete;
+	TermHits *hints;
+	TermExecPending *pending; /* handlers matched by term_walk_tree, run after walk finished */
+	TermDynOptions *dyn_options;
+	int detached; /* run by term_execute_*, handlers output into out instead of terminal */
+	TTBuffer out;
+	TTBuffer *capture; /* buffer of term_execute_capture, output is formatted into it directly */
+	TermOutputCb stream; /* callback of term_execute_stream */
+	void *stream_data;
+	int cancel; /* stream returned < 0, output is dropped and term_exec_cancelled return 1 */
+	TermArg *pipe; /* args from first '|', removed from args */
+	TermFilter *filters; /* parsed from pipe */
+	const char *pipe_error; /* filters are invalid, command is not executed */
+	TTBuffer filtered; /* lines passed filters, written to sink after each pass */
+	int pager; /* output is written to screen page by page, see term_pager_write */
+	int pager_rows; /* rows written since last page */
+	int pager_col; /* column of last row not ended by '\n' */
+	struct TermWalk *parent; /* detached walk of same terminal which handler called term_execute_* */
+	TermCompleteCache *record; /* completion walk is recorded into it */
+	TermArg *tail; /* last arg matched by recorded walk, NULL if space tail */
+} TermWalk;
+
+static TERM_THREAD_LOCAL TermWalk *term_walk_current; /* walk collecting output of handlers in this thread */
+static int term_tree_version; /* changed by every change of node trees, recorded walks are dropped, ATOMIC_* only */
+
+/* walk of term collecting output of handlers in this thread, NULL if output is printed to terminal */
+static TermWalk *term_walk_detached(Terminal *term) {
+	TermWalk *walk = term_walk_current;
+	return (walk != NULL && walk->term == term) ? walk : NULL;
+}
+
 struct Terminal {
     char *init_content;
     int init_content_offset;
@@ -99,26 +351,116 @@ struct Terminal {
 	char *prompt;
 	char *default_prompt;
 	unsigned int prompt_color;
+	TTBuffer prompt_out; /* prompt in its color and reset after it, built by term_prompt_set and term_prompt_color_set */
+	unsigned int sgr; /* attributes on screen set by term_color_set, TERM_COLOR_DEFAULT after reset */
 	TTBuffer prefix; /* saved content for multiline " ' \ */
-	TTBuffer line_command;
-	TTBuffer tempbuf; /* for format output */
+	TTBuffer line_command; /* gap buffer, [0, used) is before gap, line_tail bytes after gap are at end of space */
+	int line_tail;
+	int line_dirty; /* lowest position of line changed since last TAB */
+	int highlight; /* color tokens of line by command tree, set by term_highlight_set */
+	int hl_dirty; /* lowest position of line changed since tokens classified */
+	int hl_num;
+	int hl_space;
+	TermHlToken *hl_tokens; /* tokens ended before hl_dirty are kept */
+	TTBuffer hl_word; /* unescaped word of token [hl_word_start, hl_word_end), resumed if only chars after it changed */
+	int hl_word_start;
+	int hl_word_end;
+	int hl_quot; /* quot open at hl_word_end */
+	int refresh_defer; /* set while an edit key is processed with more input read ahead, term_refresh only records change */
+	int refresh_pending; /* line on screen is at shown_pos and shown_num, drawn from refresh_from by term_refresh_flush */
+	int refresh_from;
+	int shown_pos;
+	int shown_num;
+	TermNode *hl_root; /* root and term_tree_version tokens classified by */
+	int hl_version;
+	TermCompleteCache complete_cache;
+	TermEdit *edit_first; /* journal of edits on current line, oldest first */
+	TermEdit *edit_last; /* last edit applied, edits after it are undone and kept for redo */
+	size_t edit_bytes;
+	TTBuffer tempbuf; /* for format output, keep segments until term_out_flush */
+	int batch; /* > 0 if output is collected into seg by term_out_begin */
+	int seg_num;
+	TermOutSeg seg[OUT_SEG_MAX];
 	int history_cnt;
 	int history_cur; /* current histroy index */
 	char **history; /* histroy content */
+	int history_total; /* entries ever added, id of next entry */
+	TermHistNode history_index; /* root of prefix tree of history */
+	int suggest; /* show rest of most recent history matching the line, set by term_suggest_set */
+	int ghost; /* length of suggestion shown after line */
+	const char *ghost_text; /* suggestion shown, reset when history changes */
+	int ghost_id; /* id of history entry suggestion shown is rest of */
 	char *line; /* term_getline or term_password will use */
 	int pos; /* cursor position */
 	int num; /* length of line_command */
 	int mask; /* set true if need mask */
 	int multiline; /* true if line command end with '\\' or found '\"' or '\'' but not close */
 	int exit_flag; /* set true when need exit term_loop */
-	int spacetail; /* command has space tail or not */
-	TermEvent event;
-	TermArg *command_args;
-	TermComplete *complete;
-	TermHits *hints;
-	int exec_num;
-	ssize_t (*read)(struct Terminal *term, void *buf, size_t count);
-	ssize_t (*write)(struct Terminal *term, const void *buf, size_t count);
+	TermEvent event; /* E_EVENT_EXEC while owner is running handlers of command */
+	int local; /* attached to process STDIN/STDOUT */
+	int script; /* in term_batch_run, no prompt, cursor and color */
+	int raw; /* raw mode of transport enabled */
+	int pager; /* page output of handlers longer than screen, set by term_pager_set */
+	unsigned char in_buf[64]; /* input block read ahead by term_getch */
+	int in_pos;
+	int in_len;
+	int esc_timeout; /* ms, set by term_esc_timeout_set */
+	int owned; /* set while owner is processing input, other threads print by async queue */
+	int served; /* term_loop, term_batch_run or session serves terminal, async queue is drained by owner */
+	TermThreadId owner;
+	TermAsyncMsg async_stub;
+	TermAsyncMsg *async_head; /* wait-free push by producers */
+	TermAsyncMsg *async_tail; /* pop by owner only */
+	int async_wake; /* wakeup called and not processed by owner */
+	int frame_interval; /* ms, messages from other threads are printed at most once every interval */
+	int frame_max; /* max messages printed in one frame, 0 for no limit */
+	int frame_armed; /* tp.timer called for deferred frame */
+	uint64_t frame_last; /* time of last frame in ms */
+	uint64_t async_printed;
+	uint64_t async_dropped;
+	int async_shed; /* messages dropped by producers while output queue is over high water mark */
+	TTBuffer out_queue; /* output not taken by transport, [out_queue_off, used) is not sent */
+	size_t out_queue_off;
+	int out_queued; /* bytes not sent, read by producers */
+	size_t out_high; /* set by term_output_limit_set */
+	int out_policy;
+	int out_stalled; /* waited OUT_WAIT_MAX in vain, output is dropped until queue is sent */
+	uint64_t out_dropped; /* bytes dropped by policy */
+	int region; /* print messages from other threads into scroll region above input line */
+	int region_pinned; /* input line is at the bottom of screen since prompt redrawn by frame */
+	int region_rows; /* rows used by input line since pinned */
+	int region_cols; /* screen size when pinned */
+	int region_screen;
+	uint64_t std_due; /* time read_std return 0 for timer_std, 0 if not set */
+#if !defined(_WIN32)
+	int std_wake[2]; /* pipe to wake up read_std */
+	int std_out; /* tty opened again without blocking, or STDOUT_FILENO */
+#endif
+	TermTransport tp;
+	void *tp_data; /* get by term_transport_data */
+	ssize_t (*read)(struct Terminal *term, void *buf, size_t count); /* read_init_content or tp.read */
+	TermJob *jobs; /* EXEC_ASYNC commands not reaped yet */
+	int job_id; /* id of last job */
+	int job_workers; /* threads started at first job */
+	int job_started;
+	int job_alive; /* workers not exited, the last one frees terminal if term_destroy found it running */
+	pthread_t *job_threads;
+	pthread_mutex_t job_lock; /* protect job queue, state of jobs, job_alive and job_stop */
+	pthread_cond_t job_cond;
+	TermJob *job_queue_head;
+	TermJob *job_queue_tail;
+	int job_stop; /* set by term_destroy, transport may be freed by its owner after that */
+	TermTraceEvent *trace; /* ring of latency events, NULL if tracing is stopped, see term_trace_set */
+	int trace_size;
+	uint64_t trace_next; /* events ever added, next one is saved at trace_next % trace_size */
+	uint32_t trace_seq; /* input blocks read since tracing started */
+	uint64_t trace_read; /* us when last input block was read */
+	int trace_echo; /* output of last input block is not flushed yet */
+#ifdef TERM_STATS
+	pthread_mutex_t stat_lock; /* walks and jobs of other threads are counted too */
+	TermStatHist stat_phase[TERM_STAT_PHASES];
+	TermStatPath *stat_paths;
+#endif
 	void *userdata; /* set by term_prompt_userdata_set */
 };
 
@@ -143,1031 +485,3537 @@ static int isdelimiter(char ch) {
 	return 0;
 }
 
-static int term_vprintf_inner(Terminal *term, const char *format, va_list args) {
-	int ret = -1;
+static uint64_t term_time_ms(void);
 
-	if ((ret = tt_buffer_vprintf(&(term->tempbuf), format, args)) < 0) {
-		ret = -1;
-		goto func_end;
-	}
-	term->write(term, term->tempbuf.content, term->tempbuf.used);
-	term->tempbuf.used = 0;
-func_end:
-	return ret;
+static uint64_t term_time_us(void) {
+#if defined(_WIN32)
+	LARGE_INTEGER freq, now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (uint64_t)(now.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(now.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
 }
 
-static int term_printf_inner(Terminal *term, const char *format, ...) {
-	int rc;
-	va_list args;
+/* add event of phase from start to now into trace ring, caller checks term->trace first */
+static void term_trace_add(Terminal *term, TermTracePhase phase, uint64_t start, uint32_t arg) {
+	TermTraceEvent *event = &(term->trace[term->trace_next % term->trace_size]);
+	uint64_t now = term_time_us();
 
-	va_start(args, format);
-	rc = term_vprintf_inner(term, format, args);
-	va_end(args);
-	return rc;
+	if (start == 0) { /* tracing started while phase was running */
+		return;
+	}
+	event->ts_us = start;
+	event->dur_us = (uint32_t)(now - start);
+	event->phase = phase;
+	event->seq = term->trace_seq;
+	event->arg = arg;
+	term->trace_next++;
 }
 
-static int term_command_write(Terminal *term, const void *content, size_t count) {
-	return tt_buffer_write(&(term->line_command), content, count);
+static int term_would_block(ssize_t rc) {
+	return rc == 0 || (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
 }
 
-static void term_free_args(Terminal *term) {
-	TermArg *p_cur = NULL, *p_next = NULL;
+/* send output queued, return 0 if queue is empty, 1 if transport would block, -1 if queue is dropped by error */
+static int term_out_queue_send(Terminal *term) {
+	ssize_t rc = 0;
+	TTBuffer *queue = &(term->out_queue);
 
-	for (p_cur = term->command_args; p_cur != NULL; p_cur = p_next) {
-		p_next = p_cur->next;
-		if (p_cur->content) {
-			MY_FREE(p_cur->content);
+	while (term->out_queue_off < queue->used) {
+		rc = term->tp.write(term, queue->content + term->out_queue_off, queue->used - term->out_queue_off);
+		if (rc < 0 && errno == EINTR) {
+			continue;
 		}
-		MY_FREE(p_cur);
+		if (term_would_block(rc)) {
+			ATOMIC_STORE_INT(&(term->out_queued), (int)(queue->used - term->out_queue_off));
+			return 1;
+		}
+		if (rc < 0) {
+			break;
+		}
+		term->out_queue_off += rc;
+	}
+	rc = term->out_queue_off < queue->used ? -1 : 0;
+	term->out_stalled = 0;
+	queue->used = 0;
+	term->out_queue_off = 0;
+	if (queue->space > OUT_QUEUE_HIGH / 16) { /* burst is over, keep small space only */
+		tt_buffer_free(queue);
 	}
-	term->command_args = NULL;
+	ATOMIC_STORE_INT(&(term->out_queued), 0);
+	return (int)rc;
 }
 
-/* term_split_args return < 0 if need continue read content, for case multiline or quot */
-static int term_split_args(Terminal *term) {
-	int ret = 0;
-	const char *start = NULL, *end = NULL;
-	TermArg *p_new = NULL, *p_tail = NULL;
-	TTBuffer command_buf, arg_buf;
-	char in_quot = '\0';
-	int backslash_tail = 0, eof = 0;
-
-	term_free_args(term);
-	tt_buffer_init(&command_buf);
-	tt_buffer_init(&arg_buf);
-	if (!term->multiline) {
-		tt_buffer_empty(&(term->prefix));
-	}
+/* queue segments not taken by transport, all or none of them are queued,
+ * above high water mark owner waits transport by TERM_OUT_WAIT, or drops them */
+static int term_out_queue_add(Terminal *term, const TermIOVec *iov, int iovcnt) {
+	int i = 0;
+	size_t count = 0;
+	uint64_t now = 0, due = 0;
 
-	if (term->multiline) { /* merge prefix and line_command */
-		tt_buffer_empty(&command_buf);
-		tt_buffer_write(&command_buf, term->prefix.content, term->prefix.used);
-		tt_buffer_write(&command_buf, term->line_command.content, term->line_command.used);
-		start = (char *)(command_buf.content);
-	} else {
-		start = (char *)(term->line_command.content);
+	for (i = 0; i < iovcnt; i++) {
+		count += iov[i].len;
 	}
-
-	while (1) { /* parse all content */
-		if (in_quot == '\0') {
-			for (; *start == ' '; start++); /* move to first word for lstrip */
-		}
-		for (end = start; ; end++) { /* parse one argument */
-			if ((*end == '"' || *end == '\'') && (end == start || *(end - 1) != '\\')) { /* found '"' or '\'' and no escape(\) */
-				if (in_quot == '\0') { /* is quot start */
-					in_quot = *end;
-					continue;
-				} else if (*end == in_quot) { /* is quot end */
-					in_quot = '\0';
-					continue;
-				}
-			}
-			if (*end == '\\') {
-				if (*(end + 1) == '\0') { /* found '\\' at end of content, is multiline */
-					backslash_tail = 1;
-					start = end + 1;
-					eof = 1;
-					break;
-				} else if (*(end + 1) == 'n') { /* escape '\n' */
-					end++;
-					tt_buffer_write(&arg_buf, "\n", 1);
-					continue;
-				} else if (*(end + 1) == ' ' || *(end + 1) == '\\' || *(end + 1) == '\'' || *(end + 1) == '"') { /* escape SPACE, BACKSPLASH and QUOT */
-					end++;
-					tt_buffer_write(&arg_buf, end, 1);
-					continue;
-				}
-			}
-			if (in_quot == '\0') { /* not between quot */
-				if (*end != ' ' && *end != '\0') {
-					tt_buffer_write(&arg_buf, end, 1);
-					continue;
-				}
-				if (arg_buf.used > 0) {
-					p_new = (TermArg *)MY_MALLOC(sizeof(TermArg));
-					if (p_new == NULL) {
-						goto func_end;
-					}
-					memset(p_new, 0x00, sizeof(TermArg));
-					p_new->content = (char *)MY_STRDUP((char *)arg_buf.content);
-					if (p_new->content == NULL) {
-						goto func_end;
-					}
-					tt_buffer_empty(&arg_buf);
-					term->spacetail = !(*end == '\0');
-					if (term->command_args == NULL) {
-						term->command_args = p_new;
-					} else {
-						p_tail->next = p_new; /* it's impossible that p_tail is NULL because term->command_args must be NULL at first loop */
-					}
-					p_tail = p_new;
-					p_new = NULL;
-				}
-				if (*end == '\0') {
-					eof = 1;
-					break;
-				}
-				start = end;
-			} else {
-				if (*end == '\0') {
-					eof = 1;
-					break;
-				}
-				/* found arg content */
-				tt_buffer_write(&arg_buf, end, 1);
+	if (term->out_policy == TERM_OUT_WAIT && term->tp.writable != NULL && !term->out_stalled) {
+		now = term_time_ms();
+		due = now + OUT_WAIT_MAX;
+		while (term->out_queue.used - term->out_queue_off + count > term->out_high && now < due) {
+			if (term->tp.writable(term, (int)(due - now)) <= 0 || term_out_queue_send(term) < 0) {
+				break;
 			}
-		}  /* end of parse one argumeng */
-		if (eof) { /* end of line */
-			break;
+			now = term_time_ms();
 		}
 	}
-	if (term->event != E_EVENT_COMPLETE) {
-		if (in_quot || backslash_tail) {
-			/* save current line content to prefix and return 1 to continue read */
-			if (backslash_tail) { /* skip '\\' */
-				tt_buffer_write(&(term->prefix), term->line_command.content, term->line_command.used - 1);
-			} else {
-				tt_buffer_write(&(term->prefix), term->line_command.content, term->line_command.used);
-			}
-			if (in_quot) {
-				tt_buffer_write(&(term->prefix), "\n", 1);
-			}
-			ret = -1; /* return -1 means continue */
-		}
-		term->multiline = ret;
+	if (term->out_queue.used - term->out_queue_off + count > term->out_high) {
+		term->out_stalled = term->out_policy == TERM_OUT_WAIT; /* not wait again for each write */
+		term->out_dropped += count;
+		return 0;
 	}
-func_end:
-	tt_buffer_free(&arg_buf);
-	tt_buffer_free(&command_buf);
-	if (p_new != NULL) {
-		if (p_new->content != NULL) {
-			MY_FREE(p_new->content);
-		}
-		MY_FREE(p_new);
+	for (i = 0; i < iovcnt; i++) {
+		tt_buffer_write(&(term->out_queue), iov[i].base, iov[i].len);
 	}
-	return ret;
+	ATOMIC_STORE_INT(&(term->out_queued), (int)(term->out_queue.used - term->out_queue_off));
+	return 0;
 }
 
-static int term_getch(Terminal *term) {
-	int ret = 0;
-	char key = 0;
-	while (1) {
-		ret = term->read(term, &key, 1);
-		if (ret < 0) {
-			perror("term->read()");
-			break;
-		}
-		if (ret == 0) {
+/* write to transport, rest is queued if transport would block */
+static int term_write_all(Terminal *term, const void *buf, size_t count) {
+	ssize_t rc = 0;
+	size_t done = 0;
+	TermIOVec rest;
+
+	if ((rc = term_out_queue_send(term)) < 0) {
+		return -1;
+	} else if (rc > 0) { /* written after queued */
+		goto queue_rest;
+	}
+	while (done < count) {
+		rc = term->tp.write(term, (const char *)buf + done, count - done);
+		if (rc < 0 && errno == EINTR) {
 			continue;
 		}
-		break;
+		if (term_would_block(rc)) {
+			goto queue_rest;
+		}
+		if (rc < 0) {
+			return -1;
+		}
+		done += rc;
 	}
-	// printf("%3d 0x%02x (%c)\n", key, key, isprint(key) ? key : ' ');
-	return key;
+	return 0;
+queue_rest:
+	rest.base = (const char *)buf + done;
+	rest.len = count - done;
+	return term_out_queue_add(term, &rest, 1);
 }
 
-static void term_screen_get(Terminal *term, int *cols, int *rows) {
-#if defined(_WIN32)
-	CONSOLE_SCREEN_BUFFER_INFO inf;
-	GetConsoleScreenBufferInfo (GetStdHandle(STD_OUTPUT_HANDLE), &inf);
-	*cols = inf.srWindow.Right - inf.srWindow.Left + 1;
-	*rows = inf.srWindow.Bottom - inf.srWindow.Top + 1;
-#else
-	struct winsize ws = {0};
-
-	ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
-	*cols = ws.ws_col;
-	*rows = ws.ws_row;
-#endif
-	*cols = *cols > 1 ? *cols : 80;
-	*rows = *rows > 1 ? *rows : 24;
-}
+static int term_writev_all(Terminal *term, TermIOVec *iov, int iovcnt) {
+	ssize_t rc = 0;
 
-static void term_cursor_move(Terminal *term, int col_off, int row_off) {
-#if defined(_WIN32)
-	CONSOLE_SCREEN_BUFFER_INFO inf;
-	GetConsoleScreenBufferInfo (GetStdHandle(STD_OUTPUT_HANDLE), &inf);
-	inf.dwCursorPosition.Y += (SHORT)row_off;
-	inf.dwCursorPosition.X += (SHORT)col_off;
-	SetConsoleCursorPosition (GetStdHandle(STD_OUTPUT_HANDLE), inf.dwCursorPosition);
-#else
-	if (row_off > 0) {
-		term_printf_inner(term, "\e[%dB", row_off);
-	} else if (row_off < 0) {
-		term_printf_inner(term, "\e[%dA", -row_off);
+	if ((rc = term_out_queue_send(term)) != 0) {
+		return rc < 0 ? -1 : term_out_queue_add(term, iov, iovcnt);
 	}
-	if (col_off > 0) {
-		term_printf_inner(term, "\e[%dC", col_off);
-	} else if (col_off < 0) {
-		term_printf_inner(term, "\e[%dD", -col_off);
+	while (iovcnt > 0) {
+		rc = term->tp.writev(term, iov, iovcnt);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (term_would_block(rc) && iov->len > 0) {
+			return term_out_queue_add(term, iov, iovcnt);
+		}
+		if (rc < 0) {
+			return -1;
+		}
+		for (; iovcnt > 0 && (size_t)rc >= iov->len; iov++, iovcnt--) { /* skip segments written */
+			rc -= iov->len;
+		}
+		if (iovcnt > 0) { /* partial written */
+			iov->base = (const char *)iov->base + rc;
+			iov->len -= rc;
+		}
 	}
-#endif
+	return 0;
 }
 
-void term_color_set(Terminal *term, unsigned int color) {
-	term_printf_inner(term, "\033[0m");
-	if (color & 0xff) {
-		term_printf_inner(term, "\033[%dm", color & 0xff);
+/* write all collected segments, by writev if transport supported */
+static void term_out_flush(Terminal *term) {
+	int i = 0;
+	size_t bytes = 0;
+	uint64_t trace_start = 0;
+	TermIOVec iov[OUT_SEG_MAX];
+
+	if (term->seg_num == 0) {
+		return;
 	}
-	if (color & 0xff00) {
-		term_printf_inner(term, "\033[%dm", (color & 0xff00) >> 8);
+	if (term->trace != NULL) {
+		trace_start = term_time_us();
 	}
-	if (color & TERM_STYLE_BOLD) {
-		term_printf_inner(term, "\033[1m");
+	for (i = 0; i < term->seg_num; i++) {
+		iov[i].base = term->seg[i].base != NULL ? term->seg[i].base : term->tempbuf.content + term->seg[i].offset;
+		iov[i].len = term->seg[i].len;
+		bytes += iov[i].len;
 	}
-	if (color & TERM_STYLE_UNDERSCORE) {
-		term_printf_inner(term, "\033[4m");
+	if (term->seg_num == 1) {
+		term_write_all(term, iov[0].base, iov[0].len);
+	} else if (term->tp.writev == NULL) { /* without writev, all segments are copied into tempbuf */
+		term_write_all(term, term->tempbuf.content, term->tempbuf.used);
+	} else {
+		term_writev_all(term, iov, term->seg_num);
 	}
-	if (color & TERM_STYLE_BLINKING) {
-		term_printf_inner(term, "\033[5m");
+	if (term->trace != NULL) {
+		term_trace_add(term, TERM_TRACE_OUTPUT, trace_start, (uint32_t)bytes);
+		if (term->trace_echo) { /* first output after input block, latency seen by user */
+			term_trace_add(term, TERM_TRACE_ECHO, term->trace_read, (uint32_t)bytes);
+			term->trace_echo = 0;
+		}
 	}
-	if (color & TERM_STYLE_INVERSE) {
-		term_printf_inner(term, "\033[7m");
+	for (i = 0; i < term->seg_num; i++) { /* released after written, even if write failed */
+		tt_buffer_free(&(term->seg[i].owned));
 	}
+	term->seg_num = 0;
+	term->tempbuf.used = 0;
 }
 
-int term_prompt_set(Terminal *term, const char *prompt) {
-	int ret = -1;
-	if (prompt == NULL) {
-		prompt = term->default_prompt;
-	}
-	if (term->prompt != NULL) {
-		MY_FREE(term->prompt);
-		term->prompt = NULL;
+static void term_out_seg_add(Terminal *term, const void *base, size_t offset, size_t len) {
+	TermOutSeg *last = NULL;
+
+	if (len == 0) {
+		return;
 	}
-	if (prompt == NULL) {
-		term->prompt = MY_STRDUP("");
-	} else {
-		term->prompt = MY_STRDUP(prompt);
+	if (term->seg_num > 0) {
+		last = &(term->seg[term->seg_num - 1]);
+		if (base == NULL && last->base == NULL && last->offset + last->len == offset) { /* merge with tempbuf */
+			last->len += len;
+			return;
+		}
 	}
-	ret = 0;
-	return ret;
+	term->seg[term->seg_num].base = base;
+	term->seg[term->seg_num].offset = offset;
+	term->seg[term->seg_num].len = len;
+	tt_buffer_init(&(term->seg[term->seg_num].owned));
+	term->seg_num++;
 }
 
-void term_prompt_color_set(Terminal *term, unsigned int color) {
-	term->prompt_color = color;
+/* collect output until term_out_end, then write it at once */
+static void term_out_begin(Terminal *term) {
+	term->batch++;
 }
 
-void term_userdata_set(Terminal *term, void *userdata) {
-	term->userdata = userdata;
+static void term_out_end(Terminal *term) {
+	term->batch--;
+	if (term->batch == 0) {
+		term_out_flush(term);
+	}
 }
-void *term_userdata_get(Terminal *term) {
-	return term->userdata;
+
+/* output content without copy if transport support writev, content must be valid until term_out_flush */
+static void term_out_borrow(Terminal *term, const void *content, size_t len) {
+	size_t offset = 0;
+
+	if (term->batch == 0) {
+		term_write_all(term, content, len);
+		return;
+	}
+	if (term->seg_num >= OUT_SEG_MAX) {
+		term_out_flush(term);
+	}
+	if (term->tp.writev == NULL) {
+		offset = term->tempbuf.used;
+		tt_buffer_write(&(term->tempbuf), content, len);
+		term_out_seg_add(term, NULL, offset, len);
+	} else {
+		term_out_seg_add(term, content, 0, len);
+	}
 }
 
-static void term_print_prompt(Terminal *term) {
-	if (!term->multiline) {
-		term_color_set(term, term->prompt_color);
-		term_printf_inner(term, term->prompt);
-		term_printf_inner(term, " ");
-		term_color_set(term, TERM_COLOR_DEFAULT);
+/* start output appended to tempbuf, return offset of it */
+static size_t term_out_open(Terminal *term) {
+	if (term->batch > 0 && term->seg_num >= OUT_SEG_MAX) {
+		term_out_flush(term);
+	}
+	return term->tempbuf.used;
+}
+
+/* output tempbuf appended since offset, collected as one segment or written now */
+static void term_out_close(Terminal *term, size_t offset) {
+	if (term->batch > 0) {
+		term_out_seg_add(term, NULL, offset, term->tempbuf.used - offset);
 	} else {
-		term_printf_inner(term, "> ");
+		term_write_all(term, term->tempbuf.content, term->tempbuf.used);
+		term->tempbuf.used = 0;
 	}
-	term->pos = 0;
 }
 
-static ssize_t read_std(Terminal *term, void *buf, size_t count) {
-	ssize_t ret = 0;
+/* output content of buf without copy, buf is emptied and released after written.
+ * handlers of interactive commands run unbatched, content is written at once from buf.
+ * while batching (term_batch_run), content becomes an owned segment if transport support writev, else copied */
+static void term_out_own(Terminal *term, TTBuffer *buf) {
+	TermOutSeg *seg = NULL;
 
-#if defined(_WIN32)
-	fflush(stdout);
-	*(char *)buf = _getch();
-	ret = 1;
-#else
-	struct termios old_term, cur_term;
-	if (tcgetattr(STDIN_FILENO, &old_term) < 0) {
-		perror("tcsetattr");
+	if (buf->used == 0) {
+		tt_buffer_free(buf);
+		return;
 	}
-	cur_term = old_term;
-	cur_term.c_lflag &= ~(ICANON | ECHO | ISIG); // echoing off, canonical off, no signal chars
-	cur_term.c_cc[VMIN] = 1;
-	cur_term.c_cc[VTIME] = 0;
-	if (tcsetattr(STDIN_FILENO, TCSANOW, &cur_term) < 0) {
-		perror("tcsetattr");
+	if (term->batch == 0) {
+		term_write_all(term, buf->content, buf->used);
+		tt_buffer_free(buf);
+		return;
 	}
-	ret = read(STDIN_FILENO, buf, count);
-	if (tcsetattr(STDIN_FILENO, TCSADRAIN, &old_term) < 0) {
-		perror("tcsetattr");
+	if (buf->is_malloced != 1 || term->tp.writev == NULL) {
+		term_out_borrow(term, buf->content, buf->used);
+		tt_buffer_free(buf);
+		return;
 	}
-#endif
-	return ret;
+	if (term->seg_num >= OUT_SEG_MAX) {
+		term_out_flush(term);
+	}
+	term_out_seg_add(term, buf->content, 0, buf->used);
+	seg = &(term->seg[term->seg_num - 1]);
+	seg->owned = *buf; /* never merged, segment of base is added as is */
+	tt_buffer_init(buf);
 }
 
-static ssize_t read_init_content(Terminal *term, void *buf, size_t count) {
-	ssize_t ret = 0;
-	if (term->init_content == NULL) {
-		term->read = read_std;
-		ret = 0;
-	} else {
-		*(char *)buf = *(term->init_content + term->init_content_offset);
-		if (*(char *)buf == '\0') {
-			MY_FREE(term->init_content);
-			term->init_content = NULL;
-			term->init_content_offset = 0;
-			term->read = read_std;
-			ret = 0;
-		} else {
-			term->init_content_offset++;
-			ret = 1;
-		}
+/* output copy of content, content can be changed after return */
+static void term_out_write(Terminal *term, const void *content, size_t len) {
+	size_t offset = term_out_open(term);
+
+	tt_buffer_write(&(term->tempbuf), content, len);
+	term_out_close(term, offset);
+}
+
+/* output count copies of ch */
+static void term_out_repeat(Terminal *term, char ch, int count) {
+	size_t offset = 0;
+
+	if (count <= 0) {
+		return;
 	}
-	return ret;
+	offset = term_out_open(term);
+	if (tt_buffer_reserve(&(term->tempbuf), count) == 0) {
+		memset(term->tempbuf.content + term->tempbuf.used, ch, count);
+		term->tempbuf.used += count;
+		term->tempbuf.content[term->tempbuf.used] = '\0';
+	}
+	term_out_close(term, offset);
 }
 
-static ssize_t write_std(Terminal *term, const void *buf, size_t count) {
-	return write(STDOUT_FILENO, buf, count);
+/* output ESC [ param final without format, param is omitted if < 0 */
+static void term_out_csi(Terminal *term, int param, char final) {
+	size_t offset = term_out_open(term);
+
+	tt_buffer_put_csi(&(term->tempbuf), param, final);
+	term_out_close(term, offset);
 }
 
-static void wordhelp_free(struct TermWordHelp **p_head) {
-	TermWordHelp *p_cur = NULL, *p_next = NULL;
+static int term_vprintf_inner(Terminal *term, const char *format, va_list args) {
+	int ret = -1;
+	size_t offset = term_out_open(term);
 
-	for (p_cur = (*p_head); p_cur != NULL; p_cur = p_next) {
-		p_next = p_cur->next;
-		if (p_cur->word != NULL) {
-			MY_FREE(p_cur->word);
-		}
-		if (p_cur->help != NULL) {
-			MY_FREE(p_cur->help);
-		}
-		MY_FREE(p_cur);
+	if ((ret = tt_buffer_vprintf(&(term->tempbuf), format, args)) < 0) {
+		return -1;
 	}
+	term_out_close(term, offset);
+	return ret;
 }
 
+static int term_printf_inner(Terminal *term, const char *format, ...) {
+	int rc;
+	va_list args;
 
-void term_destroy(Terminal *term) {
-	int i = 0;
-	if (term->prompt != NULL) {
-		MY_FREE(term->prompt);
+	va_start(args, format);
+	rc = term_vprintf_inner(term, format, args);
+	va_end(args);
+	return rc;
+}
+
+static int term_job_transport(Terminal *term);
+static void term_job_transport_done(Terminal *term);
+
+static void term_async_init(Terminal *term) {
+	memset(&(term->async_stub), 0x00, sizeof(TermAsyncMsg));
+	term->async_head = &(term->async_stub);
+	term->async_tail = &(term->async_stub);
+}
+
+/* multi-producer push, wait-free: one exchange and one store */
+static void term_async_push(Terminal *term, TermAsyncMsg *msg) {
+	TermAsyncMsg *prev = NULL;
+
+	msg->next = NULL;
+	prev = (TermAsyncMsg *)ATOMIC_XCHG_PTR(&(term->async_head), msg);
+	ATOMIC_STORE_PTR(&(prev->next), msg);
+}
+
+/* single consumer pop by owner, return NULL if empty or a producer is between exchange and store */
+static TermAsyncMsg *term_async_pop(Terminal *term) {
+	TermAsyncMsg *tail = term->async_tail, *next = NULL;
+
+	next = (TermAsyncMsg *)ATOMIC_LOAD_PTR(&(tail->next));
+	if (tail == &(term->async_stub)) {
+		if (next == NULL) {
+			return NULL;
+		}
+		term->async_tail = next;
+		tail = next;
+		next = (TermAsyncMsg *)ATOMIC_LOAD_PTR(&(next->next));
 	}
-	if (term->default_prompt != NULL) {
-		MY_FREE(term->default_prompt);
+	if (next != NULL) {
+		term->async_tail = next;
+		return tail;
 	}
-	tt_buffer_free(&(term->prefix));
-	tt_buffer_free(&(term->line_command));
-	tt_buffer_free(&(term->tempbuf));
-	for (i = 0; i < term->history_cnt; i++) {
-		MY_FREE(term->history[i]);
+	if (tail != (TermAsyncMsg *)ATOMIC_LOAD_PTR(&(term->async_head))) {
+		return NULL; /* producer will wake owner again after store */
 	}
-	MY_FREE(term->history);
-	if (term->line != NULL) {
-		MY_FREE(term->line);
+	term_async_push(term, &(term->async_stub)); /* tail is the last one, push stub after it */
+	next = (TermAsyncMsg *)ATOMIC_LOAD_PTR(&(tail->next));
+	if (next != NULL) {
+		term->async_tail = next;
+		return tail;
 	}
-	term->history_cnt = 0;
-	term->history = NULL;
-	term_free_args(term);
-	wordhelp_free(&(term->complete));
-	wordhelp_free(&(term->hints));
-	memset(term, 0x00, sizeof(Terminal));
-	free(term);
+	return NULL;
 }
 
-int term_create(Terminal **_term, const char *prompt, TermNode *root, const char *init_content) {
-	int ret = -1, not_support = 0;
-	Terminal *term = NULL;
+static void term_async_free(Terminal *term) {
+	TermAsyncMsg *msg = NULL;
 
-#if defined(_WIN32)
-	HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
-	if (hOut == INVALID_HANDLE_VALUE) {
-		return GetLastError();
+	while ((msg = term_async_pop(term)) != NULL) {
+		MY_FREE(msg);
 	}
+}
 
-	DWORD dwMode = 0;
-	if (!GetConsoleMode(hOut, &dwMode)) {
-		return GetLastError();
+/* wake up owner only if it is not woken yet */
+static void term_async_notify(Terminal *term) {
+	if (ATOMIC_XCHG_INT(&(term->async_wake), 1) == 0 && term->tp.wakeup != NULL && term_job_transport(term)) {
+		term->tp.wakeup(term);
+		term_job_transport_done(term);
 	}
+}
 
-	dwMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
-	if (!SetConsoleMode(hOut, dwMode)){
-		return GetLastError();
+/* format message by producer thread */
+/* producers never wait for a stalled transport, message is dropped if output queue is over high water mark */
+static int term_async_shed(Terminal *term) {
+	if ((size_t)ATOMIC_LOAD_INT(&(term->out_queued)) <= term->out_high) {
+		return 0;
 	}
-#endif
-	if (!isatty(STDIN_FILENO)) {  // input is not from a terminal
-		not_support = 1;
+	ATOMIC_ADD_INT(&(term->async_shed), 1);
+	return 1;
+}
+
+static int term_async_write(Terminal *term, const void *buf, size_t len) {
+	TermAsyncMsg *msg = NULL;
+
+	if (term_async_shed(term)) {
+		return 0;
 	}
-	if (not_support) {
-		printf("not support\n");
-		goto func_end;
+	msg = (TermAsyncMsg *)MY_MALLOC(sizeof(TermAsyncMsg) + len + 1);
+	if (msg == NULL) {
+		return -1;
 	}
+	msg->data = (char *)(msg + 1);
+	msg->len = len;
+	memcpy(msg->data, buf, len);
+	msg->data[len] = '\0';
+	term_async_push(term, msg);
+	term_async_notify(term);
+	return (int)len;
+}
 
-	term = (Terminal *)malloc(sizeof(Terminal));
-	if (term == NULL) {
+static int term_async_vprintf(Terminal *term, const char *format, va_list args) {
+	int len = 0;
+	char local[256];
+	va_list args_bk;
+	TermAsyncMsg *msg = NULL;
+
+	if (term_async_shed(term)) {
+		return 0;
+	}
+	va_copy(args_bk, args);
+	len = vsnprintf(local, sizeof(local), format, args);
+	if (len < 0) {
 		goto func_end;
 	}
-	memset(term, 0x00, sizeof(Terminal));
-	tt_buffer_init(&(term->line_command));
-	tt_buffer_swapto_malloced(&(term->line_command), 0); /* avoid term->line_command->content is null */
-	tt_buffer_init(&(term->tempbuf));
-	tt_buffer_init(&(term->prefix));
-	tt_buffer_swapto_malloced(&(term->prefix), 0); /* avoid term->frefix->content is null */
-	term->default_prompt = MY_STRDUP(prompt);
-	if (0 != term_prompt_set(term, prompt)) {
+	msg = (TermAsyncMsg *)MY_MALLOC(sizeof(TermAsyncMsg) + len + 1);
+	if (msg == NULL) {
+		len = -1;
 		goto func_end;
 	}
-	if (init_content != NULL) {
-		term->init_content = MY_STRDUP(init_content);
-		term->init_content_offset = 0;
-		term->read = read_init_content;
+	msg->data = (char *)(msg + 1);
+	msg->len = len;
+	if (len < (int)sizeof(local)) {
+		memcpy(msg->data, local, len + 1);
 	} else {
-		term->read = read_std;
+		vsnprintf(msg->data, len + 1, format, args_bk);
 	}
-	term->write = write_std;
-	term->root = root;
-	term_prompt_color_set(term, TERM_FGCOLOR_BRIGHT_GREEN | TERM_STYLE_BOLD);
-	*_term = term;
-	ret = 0;
+	term_async_push(term, msg);
+	term_async_notify(term);
 func_end:
-	if (ret != 0) {
-		if (term != NULL) {
-			term_destroy(term);
+	va_end(args_bk);
+	return len;
+}
+
+/* write by thread while nothing serves terminal and async queue would never be drained,
+ * output queue of owner is not touched, transport not writable is waited by writable */
+static int term_direct_write(Terminal *term, const void *buf, size_t len) {
+	ssize_t rc = 0;
+	size_t done = 0;
+
+	if (!term_job_transport(term)) {
+		return -1;
+	}
+	while (done < len) {
+		rc = term->tp.write(term, (const char *)buf + done, len - done);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (term_would_block(rc)) {
+			if (term->tp.writable != NULL && term->tp.writable(term, OUT_WAIT_MAX) > 0) {
+				continue;
+			}
+			break;
+		}
+		if (rc < 0) {
+			break;
 		}
+		done += rc;
 	}
-	return ret;
+	term_job_transport_done(term);
+	return done < len ? -1 : (int)len;
 }
 
-int term_root_set(Terminal *term, TermNode *root) {
-	term->root = root;
-	return 0;
+/* restore served, messages left in queue are written directly if nothing serves terminal anymore */
+static void term_serve_end(Terminal *term, int served) {
+	TermAsyncMsg *msg = NULL;
+
+	ATOMIC_STORE_INT(&(term->served), served);
+	if (served) {
+		return;
+	}
+	term_out_flush(term);
+	ATOMIC_XCHG_INT(&(term->async_wake), 0);
+	while ((msg = term_async_pop(term)) != NULL) {
+		if (msg->len > 0) {
+			term_direct_write(term, msg->data, msg->len);
+		}
+		MY_FREE(msg);
+	}
 }
 
-static int term_getkey(Terminal *term) {
-	int num1 = 0, num2 = 0;
-	int key = 0;
+static int term_direct_vprintf(Terminal *term, const char *format, va_list args) {
+	int rc = 0;
+	char space[256];
+	TTBuffer buf;
 
-#if defined(_WIN32)
-	key = term_getch(term);
-	if ((unsigned char)key == 0xe0) { /* extern */
-		key = term_getch(term);
-		switch (key) {
-			case 0x47: return KEY_HOME;
-			case 0x48: return KEY_UP;
-			case 0x4b: return KEY_LEFT;
-			case 0x4d: return KEY_RIGHT;
-			case 0x4f: return KEY_END;
-			case 0x50: return KEY_DOWN;
-			case 0x73: return KEY_CTRL(KEY_LEFT);
-			case 0x74: return KEY_CTRL(KEY_RIGHT);
-		}
-	} else if (key == 0x7f) {
-		return KEY_BACKSPACE;
+	tt_buffer_init_inline(&buf, space, sizeof(space));
+	rc = tt_buffer_vprintf(&buf, format, args);
+	if (rc >= 0) {
+		rc = term_direct_write(term, buf.content, buf.used);
+	}
+	tt_buffer_free(&buf);
+	return rc;
+}
+
+/* owner is published by release store of owned, producers read it only after acquire load */
+static void term_own(Terminal *term, int owned) {
+	ATOMIC_STORE_INT(&(term->owned), 0);
+	if (owned) {
+		term->owner = term_thread_self();
+		ATOMIC_STORE_INT(&(term->owned), 1);
 	}
+}
+
+static int term_is_owner(Terminal *term) {
+	return ATOMIC_LOAD_INT(&(term->owned)) && term_thread_equal(term->owner, term_thread_self());
+}
+
+static uint64_t term_time_ms(void) {
+#if defined(_WIN32)
+	return GetTickCount64();
 #else
-	key = term_getch(term);
-	if (KEY_ESC == key) { /* need escape */
-		key = term_getch(term);
-		switch (key) {
-			case '[':
-				key = term_getch(term);
-				if (key >= '0' && key <= '9') {
-					do {
-						num1 *= 10;
-						num1 += key - '0';
-						key = term_getch(term);
-					} while (key >= '0' && key <= '9');
-					switch (key) {
-						case '~':
-							switch (num1) { /* <ESC>1~	<ESC>[15~ */
-								case 1: return KEY_HOME;
-								case 2: return KEY_INSERT;
-								case 3: return KEY_DELETE;
-								case 4: return KEY_END;
-								case 5: return KEY_PGUP;
-								case 6: return KEY_PGDN;
-								case 15:
-								case 17:
-								case 18:
-								case 19:
-								case 20:
-								case 21:
-								case 23:
-								case 24: return KEY_FUN(num1 - 10);
-								default: return -1;
-							}
-						case ';':
-							key = term_getch(term);
-							do {
-								num2 *= 10;
-								num2 += key - '0';
-								key = term_getch(term);
-							} while (key >= '0' && key <= '9');
-							switch (num1) { /* <ESC>[1;3A <ESC>5;3~ */
-								case 1:
-									switch (num2) {
-										case 5:
-											switch (key) {
-												case 'A': return KEY_CTRL(KEY_UP);
-												case 'B': return KEY_CTRL(KEY_DOWN);
-												case 'C': return KEY_CTRL(KEY_RIGHT);
-												case 'D': return KEY_CTRL(KEY_LEFT);
-												case 'F': return KEY_CTRL(KEY_END);
-												case 'H': return KEY_CTRL(KEY_HOME);
-												case 'P': return KEY_CTRL(KEY_FUN(1));
-												case 'Q': return KEY_CTRL(KEY_FUN(2));
-												case 'R': return KEY_CTRL(KEY_FUN(3));
-												case 'S': return KEY_CTRL(KEY_FUN(4));
-												default: return -1;
-											}
-									}
-								case 5:
-									if (num2 == 3 && key == '~') {
-										return KEY_ALT(KEY_PGUP);
-									}
-									return -1;
-								case 6:
-									if (num2 == 3 && key == '~') {
-										return KEY_ALT(KEY_PGDN);
-									}
-									return -1;
-								default: return -1;
-							}
-						default: return -1;
-					}
-				} else {
-					switch (key) { /* <ESC>[A */
-						case 'A': return KEY_UP;
-						case 'B': return KEY_DOWN;
-						case 'C': return KEY_RIGHT;
-						case 'D': return KEY_LEFT;
-						case 'F': return KEY_END;
-						case 'H': return KEY_HOME;
-						default: return -1;
-					}
-				}
-			case 'O':
-				key = term_getch(term);
-				switch (key) { /* <ESC>OP */
-					case 'P': return KEY_FUN(1);
-					case 'Q': return KEY_FUN(2);
-					case 'R': return KEY_FUN(3);
-					case 'S': return KEY_FUN(4);
-					default: return -1;
-				}
-			default:
-				return KEY_ALT(key);
-		}
-	} else if (key == 0x7f) {
-		return KEY_BACKSPACE;
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+#ifdef TERM_STATS
+/* index of us in histogram, exact below STAT_SUB, then STAT_SUB buckets per power of 2 */
+static int term_stat_bucket(uint64_t us) {
+	int exp = 0;
+
+	if (us < STAT_SUB) {
+		return (int)us;
 	}
+#if defined(__GNUC__)
+	exp = 63 - __builtin_clzll(us);
+#else
+	for (exp = STAT_SUB_BITS; (us >> (exp + 1)) != 0; exp++);
 #endif
-	return key;
+	if (exp > STAT_MAX_EXP) {
+		return STAT_BUCKETS - 1;
+	}
+	return ((exp - STAT_SUB_BITS + 1) << STAT_SUB_BITS) + (int)((us >> (exp - STAT_SUB_BITS)) & (STAT_SUB - 1));
 }
 
-static void term_refresh(Terminal *term, int pos, int num, int refresh_pos) {
-	int i = 0, prompt_len = 0, pos_row = 0, pos_col = 0;;
-	int rows = 0, cols = 0;
+/* largest us counted in bucket index */
+static uint64_t term_stat_bucket_max(int index) {
+	int exp = (index >> STAT_SUB_BITS) + STAT_SUB_BITS - 1;
 
-	term_screen_get(term, &cols, &rows);
-	prompt_len = strlen(term->prompt) + 1; /* 1: cursor and space after prompt */
+	if (index < STAT_SUB) {
+		return (uint64_t)index;
+	}
+	return ((uint64_t)(STAT_SUB + (index & (STAT_SUB - 1)) + 1) << (exp - STAT_SUB_BITS)) - 1;
+}
 
-	if (refresh_pos >= 0) { /* update changes */
-		term->line_command.content[num] = '\0';
-		pos_row = (refresh_pos + prompt_len) / cols - (term->pos + prompt_len) / cols;
-		pos_col = (refresh_pos + prompt_len) % cols - (term->pos + prompt_len) % cols;
-		term_cursor_move(term, pos_col, pos_row);
-		for (i = refresh_pos; i < num; i++) {
-			if (term->mask) {
-				term_printf_inner(term, "*");
-			} else {
-				term_printf_inner(term, "%c", *((char *)(term->line_command.content) + i));
-			}
-			refresh_pos += 1;
-			if ((refresh_pos + prompt_len) % cols == 0) { /* reach right border, new line */
-				term_printf_inner(term, "\r\n");
+static void term_stat_hist_add(TermStatHist *hist, uint64_t us) {
+	hist->count++;
+	hist->total_us += us;
+	if (us > hist->max_us) {
+		hist->max_us = us;
+	}
+	hist->buckets[term_stat_bucket(us)]++;
+}
+
+/* count us into phase, and into path of phase if path is not NULL */
+static void term_stat_add(Terminal *term, TermStatPhase phase, const char *path, uint64_t us) {
+	TermStatPath *p_cur = NULL;
+
+	pthread_mutex_lock(&(term->stat_lock));
+	term_stat_hist_add(&(term->stat_phase[phase]), us);
+	if (path != NULL) {
+		for (p_cur = term->stat_paths; p_cur != NULL; p_cur = p_cur->next) {
+			if (p_cur->phase == phase && 0 == strcmp(p_cur->path, path)) {
+				break;
 			}
 		}
-		for (i = 0; i < term->num - num; i++) {
-			refresh_pos += 1;
-			term_printf_inner(term, " ");
-			if ((refresh_pos + prompt_len) % cols == 0) { /* reach right border, new line */
-				term_printf_inner(term, "\r\n");
+		if (p_cur == NULL) {
+			p_cur = (TermStatPath *)MY_MALLOC(sizeof(TermStatPath));
+			if (p_cur != NULL) {
+				memset(p_cur, 0x00, sizeof(TermStatPath));
+				p_cur->phase = phase;
+				p_cur->path = MY_STRDUP(path);
+				if (p_cur->path == NULL) {
+					MY_FREE(p_cur);
+					p_cur = NULL;
+				} else {
+					p_cur->next = term->stat_paths;
+					term->stat_paths = p_cur;
+				}
 			}
 		}
-		pos_row = (pos + prompt_len) / cols - (refresh_pos + prompt_len) / cols;
-		pos_col = (pos + prompt_len) % cols - (refresh_pos + prompt_len) % cols;
-		term_cursor_move(term, pos_col, pos_row);
-	} else { /* move cursor only */
-		pos_row = (pos + prompt_len) / cols - (term->pos + prompt_len) / cols;
-		pos_col = (pos + prompt_len) % cols - (term->pos + prompt_len) % cols;
-		term_cursor_move(term, pos_col, pos_row);
+		if (p_cur != NULL) {
+			term_stat_hist_add(&(p_cur->hist), us);
+		}
 	}
-	term->pos = pos;
-	term->num = num;
-	term->line_command.used = num;
+	pthread_mutex_unlock(&(term->stat_lock));
 }
 
-static void term_wordhelp_free(TermWordHelp **wordhelp) {
-	TermWordHelp *p_next = NULL, *p_cur = NULL;
+static void term_stat_free(Terminal *term) {
+	TermStatPath *p_cur = NULL, *p_next = NULL;
 
-	for (p_cur = *wordhelp; p_cur != NULL; p_cur = p_next) {
+	for (p_cur = term->stat_paths; p_cur != NULL; p_cur = p_next) {
 		p_next = p_cur->next;
-		MY_FREE(p_cur->word);  /* word must not be NULL */
-		if (p_cur->help != NULL) {
-			MY_FREE(p_cur->help);
-		}
+		MY_FREE(p_cur->path);
 		MY_FREE(p_cur);
 	}
-	*wordhelp = NULL;
+	term->stat_paths = NULL;
+	pthread_mutex_destroy(&(term->stat_lock));
 }
 
-static void term_wordhelp_add(TermWordHelp **wordhelp, const char *word, const char *help) {
-	int ret = -1;
-	TermWordHelp *p_new = NULL, *p_cur = NULL;
+#define STAT_START(start) ((start) = term_time_us())
+#define STAT_END(term, phase, path, start) term_stat_add((term), (phase), (path), term_time_us() - (start))
+#else
+#define STAT_START(start) ((void)(start))
+#define STAT_END(term, phase, path, start)
+#endif
 
-	p_new = (TermWordHelp *)MY_MALLOC(sizeof(TermWordHelp));
-	if (p_new == NULL) {
-		goto func_end;
+static void term_async_drain(Terminal *term);
+static int term_jobs_stop(Terminal *term);
+static void term_jobs_free(Terminal *term);
+static int compare_keyword(const char *target, const char *content);
+static void term_refresh_flush(Terminal *term);
+static const char *term_suggest_find(Terminal *term, int num, int *len, int *id);
+
+/* content after gap of line_command */
+static char *term_line_tail(Terminal *term) {
+	return (char *)(term->line_command.content + term->line_command.space - term->line_tail);
+}
+
+/* char at pos of line, pos must be less than length */
+static char term_line_at(Terminal *term, int pos) {
+	int used = (int)(term->line_command.used);
+	return pos < used ? (char)(term->line_command.content[pos]) : term_line_tail(term)[pos - used];
+}
+
+/* move gap of line_command to pos, only content between gap and pos is moved */
+static void term_line_gap_move(Terminal *term, int pos) {
+	int n = 0, used = (int)(term->line_command.used);
+
+	if (pos < used) {
+		n = used - pos;
+		memmove(term_line_tail(term) - n, term->line_command.content + pos, n);
+		term->line_tail += n;
+	} else if (pos > used) {
+		n = pos - used;
+		memmove(term->line_command.content + used, term_line_tail(term), n);
+		term->line_tail -= n;
 	}
-	memset(p_new, 0x00, sizeof(TermWordHelp));
-	if (word == NULL) { /* word must not be NULL */
-		goto func_end;
+	term->line_command.used = pos;
+}
+
+/* line is changed from pos, parsed args and highlight after it are out of date */
+static void term_line_changed(Terminal *term, int pos) {
+	term->line_dirty = pos < term->line_dirty ? pos : term->line_dirty;
+	term->hl_dirty = pos < term->hl_dirty ? pos : term->hl_dirty;
+}
+
+/* grow space for gap at least count and '\0' of term_line_join, content after gap is kept at end of space */
+static int term_line_gap_reserve(Terminal *term, size_t count) {
+	size_t old_space = term->line_command.space;
+
+	if (term->line_command.used + term->line_tail + count + 1 <= old_space) {
+		return 0;
 	}
-	p_new->word = MY_STRDUP(word);
-	if (p_new->word == NULL) {
-		goto func_end;
+	if (tt_buffer_swapto_malloced(&(term->line_command), term->line_tail + count) != 0) {
+		return -1;
 	}
-	if (help != NULL) {
-		p_new->help = (char *)MY_STRDUP(help);
-		if (p_new->help == NULL) {
-			goto func_end;
-		}
+	memmove(term_line_tail(term), term->line_command.content + old_space - term->line_tail, term->line_tail);
+	return 0;
+}
+
+/* insert content at pos of line */
+static int term_line_insert(Terminal *term, int pos, const void *content, size_t count) {
+	if (term_line_gap_reserve(term, count) != 0) {
+		return -1;
 	}
-	if (*wordhelp == NULL) {
-		*wordhelp = p_new;
+	term_line_gap_move(term, pos);
+	term_line_changed(term, pos);
+	memcpy(term->line_command.content + term->line_command.used, content, count);
+	term->line_command.used += count;
+	return 0;
+}
+
+/* remove count chars at pos of line */
+static void term_line_erase(Terminal *term, int pos, int count) {
+	term_line_gap_move(term, pos);
+	term_line_changed(term, pos);
+	term->line_tail -= count;
+}
+
+/* drop content after num of line */
+static void term_line_truncate(Terminal *term, int num) {
+	int used = (int)(term->line_command.used);
+
+	if (num < used + term->line_tail) {
+		term_line_changed(term, num);
+	}
+	if (num <= used) {
+		term->line_command.used = num;
+		term->line_tail = 0;
+	} else if (num < used + term->line_tail) {
+		term_line_gap_move(term, num);
+		term->line_tail = 0;
+	}
+}
+
+/* free edit and edits after it */
+static void term_edit_free_from(Terminal *term, TermEdit *edit) {
+	TermEdit *next = NULL;
+
+	if (edit == NULL) {
+		return;
+	}
+	if (edit->prev != NULL) {
+		edit->prev->next = NULL;
 	} else {
-		for (p_cur = *wordhelp; p_cur->next != NULL; p_cur = p_cur->next);
-		p_cur->next = p_new;
+		term->edit_first = NULL;
 	}
-	ret = 0;
-func_end:
-	if (ret != 0) {
-		if (p_new != NULL) {
-			if (p_new->word != NULL) {
-				MY_FREE(p_new->word);
-			}
-			if (p_new->help != NULL) {
-				MY_FREE(p_new->help);
-			}
-			MY_FREE(p_new);
+	for (; edit != NULL; edit = next) {
+		next = edit->next;
+		term->edit_bytes -= sizeof(TermEdit) + edit->text.used;
+		tt_buffer_free(&(edit->text));
+		MY_FREE(edit);
+	}
+}
+
+/* forget journal, called when line is done */
+static void term_edit_reset(Terminal *term) {
+	term_edit_free_from(term, term->edit_first);
+	term->edit_last = NULL;
+}
+
+/* drop oldest edits until journal fits in UNDO_BUDGET, an edit larger than budget is dropped as well */
+static void term_edit_trim(Terminal *term) {
+	TermEdit *edit = NULL;
+
+	while (term->edit_bytes > UNDO_BUDGET && (edit = term->edit_first) != NULL) {
+		term->edit_first = edit->next;
+		if (edit->next != NULL) {
+			edit->next->prev = NULL;
 		}
+		if (term->edit_last == edit) { /* redo is freed before trim, so it is the only one left */
+			term->edit_last = NULL;
+		}
+		term->edit_bytes -= sizeof(TermEdit) + edit->text.used;
+		tt_buffer_free(&(edit->text));
+		MY_FREE(edit);
 	}
-	return;
 }
 
-static void term_complete_free(Terminal *term) {
-	term_wordhelp_free(&(term->complete));
+/* add edit to journal, typed chars next to last edit are merged into it if merge is set,
+ * until the edit reaches UNDO_BUDGET */
+static void term_edit_record(Terminal *term, int insert, int pos, const char *text, int len, int merge) {
+	TermEdit *edit = term->edit_last;
+
+	term_edit_free_from(term, edit != NULL ? edit->next : term->edit_first); /* redo is lost after new edit */
+	if (merge && edit != NULL && edit->merge && edit->insert == insert && sizeof(TermEdit) + edit->text.used + len <= UNDO_BUDGET) {
+		if (insert && edit->text.content[edit->text.used - 1] == ' ' && text[0] != ' ') {
+			/* typed word starts new edit, undo removes words one by one */
+		} else if (insert ? (pos == edit->pos + (int)(edit->text.used)) : (pos == edit->pos)) { /* typed or Delete */
+			tt_buffer_write(&(edit->text), text, len);
+			term->edit_bytes += len;
+			term_edit_trim(term);
+			return;
+		}
+		if (!insert && pos + len == edit->pos) { /* Backspace */
+			tt_buffer_write(&(edit->text), text, len);
+			memmove(edit->text.content + len, edit->text.content, edit->text.used - len);
+			memcpy(edit->text.content, text, len);
+			edit->pos = pos;
+			term->edit_bytes += len;
+			term_edit_trim(term);
+			return;
+		}
+	}
+	edit = MY_MALLOC(sizeof(TermEdit));
+	if (edit == NULL) {
+		return;
+	}
+	memset(edit, 0x00, sizeof(TermEdit));
+	edit->insert = insert;
+	edit->pos = pos;
+	edit->merge = merge;
+	tt_buffer_init_inline(&(edit->text), edit->text_space, sizeof(edit->text_space));
+	tt_buffer_write(&(edit->text), text, len);
+	edit->prev = term->edit_last;
+	if (term->edit_last != NULL) {
+		term->edit_last->next = edit;
+	} else {
+		term->edit_first = edit;
+	}
+	term->edit_last = edit;
+	term->edit_bytes += sizeof(TermEdit) + len;
+	term_edit_trim(term);
 }
 
-static void term_complete_add(Terminal *term, const char *word, const char *help) {
-	term_wordhelp_add(&(term->complete), word, help);
+/* insert into line and record it for undo */
+static void term_edit_insert(Terminal *term, int pos, const char *text, int len, int merge) {
+	if (len <= 0 || term_line_insert(term, pos, text, len) != 0) {
+		return;
+	}
+	term_edit_record(term, 1, pos, (char *)(term->line_command.content) + pos, len, merge);
 }
 
-static void term_hints_free(Terminal *term) {
-	term_wordhelp_free(&(term->hints));
+/* erase from line and record it for undo */
+static void term_edit_erase(Terminal *term, int pos, int len, int merge) {
+	if (len <= 0) {
+		return;
+	}
+	term_line_gap_move(term, pos); /* erased text is at start of tail */
+	term_edit_record(term, 0, pos, term_line_tail(term), len, merge);
+	term_line_erase(term, pos, len);
 }
 
-static void term_hints_add(Terminal *term, const char *word, const char *help) {
-	term_wordhelp_add(&(term->hints), word, help);
+/* move gap to end and return line as string, content and used of line_command are the whole line until next edit */
+static char *term_line_join(Terminal *term) {
+	term_line_gap_move(term, (int)(term->line_command.used) + term->line_tail);
+	term->line_command.content[term->line_command.used] = '\0';
+	return (char *)(term->line_command.content);
 }
 
-static int strlenwithesc(const char *s) {
-	int ret = 0;
-	const char *cur = NULL;
-	for (cur = s; *cur != '\0'; cur++) {
-		if (*cur == '\n' || *cur == ' ' || *cur == '\\' || *cur == '\'' || *cur == '\"') {
-			ret += 2;
-		} else {
-			ret += 1;
+/* output [start, end) of line, borrowed until term_out_flush */
+static void term_line_out(Terminal *term, int start, int end) {
+	int used = (int)(term->line_command.used);
+
+	if (start < used) {
+		term_out_borrow(term, term->line_command.content + start, (end < used ? end : used) - start);
+	}
+	if (end > used) {
+		start = start > used ? start : used;
+		term_out_borrow(term, term_line_tail(term) + start - used, end - start);
+	}
+}
+
+static void term_free_args(TermArg *args) {
+	TermArg *p_cur = NULL, *p_next = NULL;
+
+	for (p_cur = args; p_cur != NULL; p_cur = p_next) {
+		p_next = p_cur->next;
+		if (p_cur->content) {
+			MY_FREE(p_cur->content);
 		}
+		MY_FREE(p_cur);
 	}
-	return ret;
 }
 
-static char *strcatwithesc(char *dest, const char *src) {
-	char *dst_cur = NULL;
-	const char *src_cur = NULL;
-	for (dst_cur = dest; *dst_cur != '\0'; dst_cur++);
-	for (src_cur = src; *src_cur != '\0'; src_cur++) {
-		if (*src_cur == '\n') {
-			*dst_cur = '\\';
-			dst_cur++;
-			*dst_cur = 'n';
-			dst_cur++;
-		} else if(*src_cur == ' ' || *src_cur == '\\' || *src_cur == '\'' || *src_cur == '\"') {
-			*dst_cur = '\\';
-			dst_cur++;
-			*dst_cur = *src_cur;
-			dst_cur++;
-		} else {
-			*dst_cur = *src_cur;
-			dst_cur++;
+/* free nodes in list and all their children, children are appended to the list instead of recursion */
+static void term_hist_node_free(TermHistNode *node) {
+	TermHistNode *next = NULL, *last = NULL;
+
+	for (last = node; last != NULL && last->next != NULL; last = last->next);
+	for (; node != NULL; node = next) {
+		if (node->children != NULL) {
+			for (last->next = node->children; last->next != NULL; last = last->next);
 		}
+		next = node->next;
+		MY_FREE(node);
 	}
-	*dst_cur = '\0';
-	return dest;
 }
 
-static void term_history_add(Terminal *term) {
+static void term_complete_cache_reset(Terminal *term) {
+	term_free_args(term->complete_cache.args);
+	term->complete_cache.args = NULL;
+	term->complete_cache.prefix = -1;
+	tt_buffer_free(&(term->complete_cache.visits));
+}
+
+static void term_argv_free(int argc, char **argv) {
+	int i = 0;
+
+	if (argv == NULL) {
+		return;
+	}
+	for (i = 0; i < argc; i++) {
+		if (argv[i] != NULL) {
+			MY_FREE(argv[i]);
+		}
+	}
+	MY_FREE(argv);
+}
+
+static void term_pending_free(TermWalk *walk) {
+	TermExecPending *p_cur = NULL, *p_next = NULL;
+
+	for (p_cur = walk->pending; p_cur != NULL; p_cur = p_next) {
+		p_next = p_cur->next;
+		term_argv_free(p_cur->argc, p_cur->argv);
+		if (p_cur->path != NULL) {
+			MY_FREE(p_cur->path);
+		}
+		MY_FREE(p_cur);
+	}
+	walk->pending = NULL;
+}
+
+static const struct {
+	const char *word;
+	TermFilterType type;
+	int has_pattern;
+} term_filter_names[] = {
+	{"include", FILTER_INCLUDE, 1},
+	{"exclude", FILTER_EXCLUDE, 1},
+	{"begin", FILTER_BEGIN, 1},
+	{"count", FILTER_COUNT, 0},
+};
+
+static void term_filters_free(TermFilter *filters) {
+	TermFilter *p_cur = NULL, *p_next = NULL;
+
+	for (p_cur = filters; p_cur != NULL; p_cur = p_next) {
+		p_next = p_cur->next;
+#if !defined(_WIN32)
+		if (p_cur->pattern != NULL && !p_cur->literal) {
+			regfree(&(p_cur->regex));
+		}
+#endif
+		if (p_cur->pattern != NULL) {
+			MY_FREE(p_cur->pattern);
+		}
+		MY_FREE(p_cur);
+	}
+}
+
+/* parse one stage after '|', words after filter name are joined by SPACE as pattern */
+static TermFilter *term_filter_create(TermWalk *walk, TermArg *stage) {
+	int i = 0, found = -1, num = 0, match = MATCH_NONE;
 	size_t len = 0;
 	TermArg *p_arg = NULL;
+	TermFilter *filter = NULL;
 
-	if (term->history == NULL) {
-		term->history = (char **)MY_MALLOC(sizeof(char *) * HISTORY_LENGTH);
-		if (term->history == NULL) {
-			goto func_end;
+	for (i = 0; i < (int)(sizeof(term_filter_names) / sizeof(term_filter_names[0])) && match != MATCH_ALL; i++) {
+		match = compare_keyword(term_filter_names[i].word, stage->content);
+		if (match == MATCH_ALL) { /* exact name, even if it is prefix of other name */
+			found = i;
+			num = 1;
+		} else if (match == MATCH_PART) {
+			found = i;
+			num++;
 		}
-		memset(term->history, 0x00, sizeof(char *) * HISTORY_LENGTH);
 	}
-	if (term->command_args == NULL) {
-		goto func_end;
+	if (num != 1) {
+		walk->pipe_error = num == 0 ? "unknown filter after '|'" : "ambiguous filter after '|'";
+		return NULL;
 	}
-	len = 0;
-	for (p_arg = term->command_args; p_arg != NULL; p_arg = p_arg->next) {
-		len += strlenwithesc(p_arg->content) + 1;
+	for (p_arg = stage->next; p_arg != NULL && !p_arg->pipe; p_arg = p_arg->next) {
+		len += strlen(p_arg->content) + 1;
 	}
-	if (term->history_cnt < HISTORY_LENGTH) {
-		term->history_cnt += 1;
-	} else {
-		MY_FREE(term->history[0]);
-		memmove(&term->history[0], &term->history[1], HISTORY_LENGTH - 1);
+	if (term_filter_names[found].has_pattern != (len > 0)) {
+		walk->pipe_error = len > 0 ? "filter takes no pattern" : "missing pattern of filter";
+		return NULL;
 	}
-	term->history[term->history_cnt - 1] = (char *)MY_MALLOC(len);
-	if (term->history[term->history_cnt - 1] == NULL) {
-		goto func_end;
+	filter = (TermFilter *)MY_MALLOC(sizeof(TermFilter));
+	if (filter == NULL) {
+		walk->pipe_error = "out of memory";
+		return NULL;
 	}
-	term->history[term->history_cnt - 1][0] = '\0';
-	for (p_arg = term->command_args; p_arg != NULL; p_arg = p_arg->next) {
-		if (term->history[term->history_cnt - 1][0] != '\0') {
-			strcat(term->history[term->history_cnt - 1], " ");
+	memset(filter, 0x00, sizeof(TermFilter));
+	filter->type = term_filter_names[found].type;
+	if (len == 0) {
+		return filter;
+	}
+	filter->pattern = (char *)MY_MALLOC(len);
+	if (filter->pattern == NULL) {
+		walk->pipe_error = "out of memory";
+		MY_FREE(filter);
+		return NULL;
+	}
+	filter->pattern[0] = '\0';
+	for (p_arg = stage->next; p_arg != NULL && !p_arg->pipe; p_arg = p_arg->next) {
+		if (filter->pattern[0] != '\0') {
+			strcat(filter->pattern, " ");
 		}
-		strcatwithesc(term->history[term->history_cnt - 1], p_arg->content);
+		strcat(filter->pattern, p_arg->content);
 	}
-func_end:
-	return;
+	filter->pattern_len = strlen(filter->pattern);
+#if !defined(_WIN32)
+	filter->literal = (strpbrk(filter->pattern, ".[]()*+?{}|^$\\") == NULL);
+	if (!filter->literal && regcomp(&(filter->regex), filter->pattern, REG_EXTENDED | REG_NOSUB) != 0) {
+		walk->pipe_error = "invalid regular expression";
+		MY_FREE(filter->pattern);
+		MY_FREE(filter);
+		return NULL;
+	}
+#else
+	filter->literal = 1; /* no regex on windows */
+#endif
+	return filter;
 }
 
+/* move args from first '|' to walk->pipe, and parse them into filters */
+static void term_pipe_parse(TermWalk *walk) {
+	TermArg **pp = NULL, *p_arg = NULL;
+	TermFilter *filter = NULL, **pp_filter = &(walk->filters);
 
-static int compare_keyword(const char *target, const char *content) {
-	if (target == NULL || content == NULL) {
-		return MATCH_ALL;
-	}
-	if (0 == strcasecmp(content, target)) {
-		return MATCH_ALL;
+	for (pp = &(walk->args); *pp != NULL && !(*pp)->pipe; pp = &((*pp)->next));
+	if (*pp == NULL) {
+		return;
 	}
-	if (0 == strncasecmp(content, target, strlen(content))) {
-		return MATCH_PART;
+	walk->pipe = *pp;
+	*pp = NULL;
+	walk->spacetail = 1; /* last arg of command is followed by SPACE and '|' */
+	for (p_arg = walk->pipe; p_arg != NULL; p_arg = p_arg->next) {
+		if (!p_arg->pipe) {
+			continue;
+		}
+		if (p_arg->next == NULL || p_arg->next->pipe) {
+			walk->pipe_error = "missing filter after '|'";
+			return;
+		}
+		filter = term_filter_create(walk, p_arg->next);
+		if (filter == NULL) {
+			return;
+		}
+		*pp_filter = filter;
+		pp_filter = &(filter->next);
 	}
-	return MATCH_NONE;
 }
 
-static void term_output_complete_or_help(Terminal *term) {
-	int i = 0, common_len = 0, tail_arglen = 0, start_pos = 0, end_pos = 0, completed = 0;
-	int word_width = 0, with_help = 0, rows = 0, cols = 0, words_len = 0, word_num = 0;
-	TermComplete *p_com = NULL;
-	TermArg *p_lastarg = NULL;
-	int executable = (term->exec_num == 1);
+#define ARGS_CLOSED 0
+#define ARGS_OPEN_QUOT (1 << 0) /* quot is not closed */
+#define ARGS_OPEN_BACKSLASH (1 << 1) /* content end with '\\' */
 
-	if (term->complete != NULL) {
-		common_len = (int)strlen(term->complete->word);
-		// find common string for auto complete
-		for (p_com = term->complete->next; (p_com != NULL) && (common_len > 0); p_com = p_com->next) {
-			while ((common_len > 0) && strncasecmp(term->complete->word, p_com->word, common_len)) {
-				common_len--;
-			}
+/* split content into walk->args, return ARGS_OPEN_* if content need to be continued */
+static int term_args_parse(TermWalk *walk, const char *start) {
+	int ret = ARGS_CLOSED;
+	const char *end = NULL, *base = start;
+	TermArg *p_new = NULL, *p_tail = NULL;
+	TTBuffer arg_buf;
+	char arg_space[WORD_INLINE];
+	char in_quot = '\0';
+	int backslash_tail = 0, eof = 0, quoted = 0;
+	uint64_t stat_start = 0;
+
+	STAT_START(stat_start);
+	tt_buffer_init_inline(&arg_buf, arg_space, sizeof(arg_space));
+	while (1) { /* parse all content */
+		if (in_quot == '\0') {
+			for (; *start == ' '; start++); /* move to first word for lstrip */
 		}
-		if (common_len > 0) {
-			tail_arglen = 0;
-			p_lastarg = NULL;
-			if (term->command_args != NULL) {
-				for (p_lastarg = term->command_args; p_lastarg->next != NULL; p_lastarg = p_lastarg->next);
+		for (end = start; ; end++) { /* parse one argument */
+			if ((*end == '"' || *end == '\'') && (end == start || *(end - 1) != '\\')) { /* found '"' or '\'' and no escape(\) */
+				if (in_quot == '\0') { /* is quot start */
+					in_quot = *end;
+					quoted = 1;
+					continue;
+				} else if (*end == in_quot) { /* is quot end */
+					in_quot = '\0';
+					continue;
+				}
 			}
-			if (p_lastarg && !term->spacetail && term->command_args != NULL) {
-				tail_arglen = strlen(p_lastarg->content);
+			if (*end == '\\') {
+				if (*(end + 1) == '\0') { /* found '\\' at end of content, is multiline */
+					backslash_tail = 1;
+					start = end + 1;
+					eof = 1;
+					break;
+				} else if (*(end + 1) == 'n') { /* escape '\n' */
+					end++;
+					tt_buffer_write(&arg_buf, "\n", 1);
+					quoted = 1;
+					continue;
+				} else if (*(end + 1) == ' ' || *(end + 1) == '\\' || *(end + 1) == '\'' || *(end + 1) == '"') { /* escape SPACE, BACKSPLASH and QUOT */
+					end++;
+					tt_buffer_write(&arg_buf, end, 1);
+					quoted = 1;
+					continue;
+				}
 			}
-			if (tail_arglen > 0) { /* null arg for help */
-				start_pos = term->num - tail_arglen;
-				end_pos = start_pos + common_len;
-				if (common_len > tail_arglen) {
-					/* malloc for complete, command_len - tail_arglen is the size that need expand */
-					tt_buffer_swapto_malloced(&(term->line_command), common_len - tail_arglen);
+			if (in_quot == '\0') { /* not between quot */
+				if (*end != ' ' && *end != '\0') {
+					tt_buffer_write(&arg_buf, end, 1);
+					continue;
 				}
-				if (memcmp(term->line_command.content + start_pos, term->complete->word, common_len)) {
-					memcpy(term->line_command.content + start_pos, term->complete->word, common_len);
-					completed = 1;
+				if (arg_buf.used > 0) {
+					p_new = (TermArg *)MY_MALLOC(sizeof(TermArg));
+					if (p_new == NULL) {
+						goto func_end;
+					}
+					memset(p_new, 0x00, sizeof(TermArg));
+					p_new->content = (char *)MY_STRDUP((char *)arg_buf.content);
+					if (p_new->content == NULL) {
+						goto func_end;
+					}
+					p_new->pipe = !quoted && strcmp(p_new->content, "|") == 0;
+					p_new->end = (int)(end - base);
+					quoted = 0;
+					tt_buffer_empty(&arg_buf);
+					walk->spacetail = !(*end == '\0');
+					if (walk->args == NULL) {
+						walk->args = p_new;
+					} else {
+						p_tail->next = p_new; /* it's impossible that p_tail is NULL because walk->args must be NULL at first loop */
+					}
+					p_tail = p_new;
+					p_new = NULL;
 				}
-				term->line_command.used += common_len - tail_arglen;
-				*(term->line_command.content + end_pos) = '\0';
-				if (term->complete->next == NULL) { /* only one match, add SPACE at the end of word */
-					tt_buffer_swapto_malloced(&(term->line_command), 1); /* malloc for complete SPACE */
-					strcat((char *)(term->line_command.content), " ");
-					end_pos += 1;
-					term->line_command.used += 1;
-					completed = 1;
+				if (*end == '\0') {
+					eof = 1;
+					break;
 				}
-				// printf("term->pos %d, start_pos %d, end_pos %d\n", term->pos, start_pos, end_pos);
-				term_refresh(term, end_pos, end_pos, start_pos);
+				start = end;
+			} else {
+				if (*end == '\0') {
+					eof = 1;
+					break;
+				}
+				/* found arg content */
+				tt_buffer_write(&arg_buf, end, 1);
 			}
+		}  /* end of parse one argumeng */
+		if (eof) { /* end of line */
+			break;
 		}
 	}
-	if (completed == 0) { /* print help informations */
-		with_help = 0;
-		word_width = 0;
-		for (p_com = term->complete; p_com != NULL; p_com = p_com->next) {
-			if (p_com->help != NULL && p_com->help[0] != '\0') {
-				with_help = 1;
-			}
-			if ((int)strlen(p_com->word) > word_width) {
-				word_width = strlen(p_com->word);
-			}
-		}
-		for (p_com = term->hints; p_com != NULL; p_com = p_com->next) {
-			if (p_com->help != NULL && p_com->help[0] != '\0') {
-				with_help = 1;
+	if (in_quot) {
+		ret |= ARGS_OPEN_QUOT;
+	}
+	if (backslash_tail) {
+		ret |= ARGS_OPEN_BACKSLASH;
+	}
+	if (ret == ARGS_CLOSED && walk->event != E_EVENT_COMPLETE) {
+		term_pipe_parse(walk);
+	}
+func_end:
+	tt_buffer_free(&arg_buf);
+	STAT_END(walk->term, TERM_STAT_PARSE, NULL, stat_start);
+	if (p_new != NULL) {
+		if (p_new->content != NULL) {
+			MY_FREE(p_new->content);
+		}
+		MY_FREE(p_new);
+	}
+	return ret;
+}
+
+/* term_split_args return < 0 if need continue read content, for case multiline or quot */
+static int term_split_args(Terminal *term, TermWalk *walk) {
+	int ret = 0, open = 0;
+	const char *start = NULL;
+	TTBuffer command_buf;
+
+	tt_buffer_init(&command_buf);
+	term_line_join(term);
+	if (!term->multiline) {
+		tt_buffer_empty(&(term->prefix));
+	}
+
+	if (term->multiline) { /* merge prefix and line_command */
+		tt_buffer_empty(&command_buf);
+		tt_buffer_write(&command_buf, term->prefix.content, term->prefix.used);
+		tt_buffer_write(&command_buf, term->line_command.content, term->line_command.used);
+		start = (char *)(command_buf.content);
+	} else {
+		start = (char *)(term->line_command.content);
+	}
+	open = term_args_parse(walk, start);
+	if (walk->event != E_EVENT_COMPLETE) {
+		if (open != ARGS_CLOSED) {
+			/* save current line content to prefix and return 1 to continue read */
+			if (open & ARGS_OPEN_BACKSLASH) { /* skip '\\' */
+				tt_buffer_write(&(term->prefix), term->line_command.content, term->line_command.used - 1);
+			} else {
+				tt_buffer_write(&(term->prefix), term->line_command.content, term->line_command.used);
 			}
-			if ((int)strlen(p_com->word) > word_width) {
-				word_width = strlen(p_com->word);
+			if (open & ARGS_OPEN_QUOT) {
+				tt_buffer_write(&(term->prefix), "\n", 1);
 			}
+			ret = -1; /* return -1 means continue */
 		}
-		term_printf_inner(term, "\n");
-		if (with_help) { /* print word and help line by line */
-			for (p_com = term->complete; p_com != NULL; p_com = p_com->next) {
-				term_color_set(term, TERM_FGCOLOR_BRIGHT_BLUE);
-				term_printf_inner(term, "%s", p_com->word);
-				term_color_set(term, TERM_COLOR_DEFAULT);
-				if (p_com->help != NULL) {
-					term_printf_inner(term, "%*s	 %s\n", word_width - strlen(p_com->word), "", p_com->help);
-				} else {
-					term_printf_inner(term, "\n"); /* show word only if help is NULL */
-				}
+		term->multiline = ret;
+	}
+	tt_buffer_free(&command_buf);
+	return ret;
+}
+
+/* get one byte from input block read ahead, read next block if all used,
+ * return KEY_TIMEOUT if nothing read in timeout ms, never timeout if timeout < 0 or transport has no timer */
+static int term_getch_timeout(Terminal *term, int timeout) {
+	int ret = 0;
+	uint64_t due = 0, now = 0;
+
+	if (term->in_pos < term->in_len) {
+		return (char)(term->in_buf[term->in_pos++]);
+	}
+	term_refresh_flush(term); /* rest of a sequence is waited, typed chars before it are drawn */
+	if (timeout >= 0 && term->tp.timer != NULL) {
+		due = term_time_ms() + timeout;
+	}
+	while (1) {
+		term_async_drain(term);
+		if (due > 0) {
+			now = term_time_ms();
+			if (now >= due) {
+				return KEY_TIMEOUT;
 			}
-			for (p_com = term->hints; p_com != NULL; p_com = p_com->next) {
-				term_color_set(term, TERM_FGCOLOR_BRIGHT_CYAN);
-				term_printf_inner(term, "%s", p_com->word);
-				term_color_set(term, TERM_COLOR_DEFAULT);
-				if (p_com->help != NULL) {
-					term_printf_inner(term, "%*s	 %s\n", word_width - strlen(p_com->word), "", p_com->help);
-				} else {
-					term_printf_inner(term, "\n");
-				}
+			term->frame_armed = 0; /* timer is replaced, deferred frame is armed again by next drain */
+			term->tp.timer(term, (int)(due - now));
+		}
+		errno = 0;
+		ret = term->read(term, term->in_buf, sizeof(term->in_buf));
+		if (ret < 0) {
+			if (term->local && errno != 0) {
+				perror("term->read()");
 			}
-		} else { /* only show words */
-			term_screen_get(term, &cols, &rows);
-			words_len = 0;
-			i = 0;
-			for (p_com = term->complete; p_com != NULL; p_com = p_com->next, i++) {
-				if (i != 0) {
-					words_len += 2;
-				}
-				words_len += strlen(p_com->word);
+			return KEY_EOF;
+		}
+		if (ret == 0) {
+			continue;
+		}
+		term->in_pos = 0;
+		term->in_len = ret;
+		if (term->trace != NULL) {
+			term->trace_seq++;
+			term->trace_read = term_time_us();
+			term->trace_echo = 1;
+			term_trace_add(term, TERM_TRACE_INPUT, term->trace_read, (uint32_t)ret);
+		}
+		break;
+	}
+	// printf("%3d 0x%02x (%c)\n", key, key, isprint(key) ? key : ' ');
+	return (char)(term->in_buf[term->in_pos++]);
+}
+
+static int term_getch(Terminal *term) {
+	return term_getch_timeout(term, -1);
+}
+
+/* put back the last byte got from input block */
+static void term_ungetch(Terminal *term) {
+	if (term->in_pos > 0) {
+		term->in_pos--;
+	}
+}
+
+static void term_screen_get(Terminal *term, int *cols, int *rows) {
+	*cols = 0;
+	*rows = 0;
+	if (term->tp.winsize != NULL) {
+		term->tp.winsize(term, cols, rows);
+	}
+	*cols = *cols > 1 ? *cols : 80;
+	*rows = *rows > 1 ? *rows : 24;
+}
+
+static void term_raw_set(Terminal *term, int enable) {
+	if (term->raw == enable) {
+		return;
+	}
+	if (term->tp.raw_mode != NULL) {
+		term_out_flush(term);
+		term->tp.raw_mode(term, enable);
+	}
+	term->raw = enable;
+}
+
+static void term_cursor_move(Terminal *term, int col_off, int row_off) {
+#if defined(_WIN32)
+	CONSOLE_SCREEN_BUFFER_INFO inf;
+	if (!term->local) {
+		goto escape;
+	}
+	term_out_flush(term); /* collected output must be written before cursor moved by console api */
+	GetConsoleScreenBufferInfo (GetStdHandle(STD_OUTPUT_HANDLE), &inf);
+	inf.dwCursorPosition.Y += (SHORT)row_off;
+	inf.dwCursorPosition.X += (SHORT)col_off;
+	SetConsoleCursorPosition (GetStdHandle(STD_OUTPUT_HANDLE), inf.dwCursorPosition);
+	return;
+escape:
+#endif
+	if (row_off > 0) {
+		term_out_csi(term, row_off, 'B');
+	} else if (row_off < 0) {
+		term_out_csi(term, -row_off, 'A');
+	}
+	if (col_off > 0) {
+		term_out_csi(term, col_off, 'C');
+	} else if (col_off < 0) {
+		term_out_csi(term, -col_off, 'D');
+	}
+}
+
+static const unsigned int term_sgr_styles[][2] = {
+	{TERM_STYLE_BOLD, 1},
+	{TERM_STYLE_UNDERSCORE, 4},
+	{TERM_STYLE_BLINKING, 5},
+	{TERM_STYLE_INVERSE, 7},
+};
+
+/* format one SGR sequence changing attributes from old to color, reset first if an attribute is removed or reset is set,
+ * buf must hold 32 bytes, return length, 0 if nothing changed */
+static int term_sgr_format(char *buf, unsigned int old, unsigned int color, int reset) {
+	int len = 2, i = 0;
+
+	if (((old & 0xff) && !(color & 0xff)) || ((old & 0xff00) && !(color & 0xff00)) || (old & ~color & 0xff0000)) {
+		reset = 1;
+	}
+	memcpy(buf, "\033[", 2);
+	if (reset) {
+		old = TERM_COLOR_DEFAULT;
+		len += sprintf(buf + len, "0;");
+	}
+	if ((color & 0xff) != (old & 0xff)) {
+		len += sprintf(buf + len, "%u;", color & 0xff);
+	}
+	if ((color & 0xff00) != (old & 0xff00)) {
+		len += sprintf(buf + len, "%u;", (color & 0xff00) >> 8);
+	}
+	for (i = 0; i < (int)(sizeof(term_sgr_styles) / sizeof(term_sgr_styles[0])); i++) {
+		if ((color & term_sgr_styles[i][0]) && !(old & term_sgr_styles[i][0])) {
+			len += sprintf(buf + len, "%u;", term_sgr_styles[i][1]);
+		}
+	}
+	if (len == 2) {
+		return 0;
+	}
+	buf[len - 1] = 'm';
+	return len;
+}
+
+/* color of pager and script is not written */
+static int term_color_muted(Terminal *term) {
+	TermWalk *walk = term_walk_detached(term);
+	return term->script || (walk != NULL && (walk->detached || walk->filters != NULL));
+}
+
+void term_color_set(Terminal *term, unsigned int color) {
+	char seq[32];
+	int len = 0;
+
+	if (color == term->sgr || term_color_muted(term)) { /* color of pager is written in place */
+		return;
+	}
+	len = term_sgr_format(seq, term->sgr, color, 0);
+	term_out_write(term, seq, len);
+	term->sgr = color;
+}
+
+/* prompt is written by one copy, starting with reset as handlers may leave any attributes */
+static void term_prompt_build(Terminal *term) {
+	char seq[32];
+	int len = 0;
+
+	term->prompt_out.used = 0;
+	len = term_sgr_format(seq, TERM_COLOR_DEFAULT, term->prompt_color, 1);
+	tt_buffer_write(&(term->prompt_out), seq, len);
+	tt_buffer_write(&(term->prompt_out), term->prompt, strlen(term->prompt));
+	tt_buffer_write(&(term->prompt_out), " ", 1);
+	if (term->prompt_color != TERM_COLOR_DEFAULT) {
+		tt_buffer_write(&(term->prompt_out), "\033[0m", 4);
+	}
+}
+
+int term_prompt_set(Terminal *term, const char *prompt) {
+	int ret = -1;
+	if (prompt == NULL) {
+		prompt = term->default_prompt;
+	}
+	if (term->prompt != NULL) {
+		MY_FREE(term->prompt);
+		term->prompt = NULL;
+	}
+	if (prompt == NULL) {
+		term->prompt = MY_STRDUP("");
+	} else {
+		term->prompt = MY_STRDUP(prompt);
+	}
+	term_prompt_build(term);
+	ret = 0;
+	return ret;
+}
+
+void term_prompt_color_set(Terminal *term, unsigned int color) {
+	term->prompt_color = color;
+	term_prompt_build(term);
+}
+
+void term_userdata_set(Terminal *term, void *userdata) {
+	term->userdata = userdata;
+}
+void *term_userdata_get(Terminal *term) {
+	return term->userdata;
+}
+
+static void term_print_prompt(Terminal *term) {
+	if (!term->multiline && term_color_muted(term)) {
+		term_out_write(term, term->prompt, strlen(term->prompt));
+		term_out_write(term, " ", 1);
+	} else if (!term->multiline) {
+		term_out_write(term, term->prompt_out.content, term->prompt_out.used);
+		term->sgr = TERM_COLOR_DEFAULT;
+	} else {
+		term_printf_inner(term, "> ");
+	}
+	term->pos = 0;
+	term->region_pinned = 0; /* prompt may not be at the bottom, pinned again by next frame */
+}
+
+#if !defined(_WIN32)
+static struct termios std_saved_term; /* STDIN is shared by process, restored when raw mode disabled */
+#endif
+
+static ssize_t read_std(Terminal *term, void *buf, size_t count) {
+	ssize_t ret = 0;
+
+#if defined(_WIN32)
+	fflush(stdout);
+	while (!_kbhit()) {
+		if (term->async_wake && term->std_due <= term_time_ms()) { /* message from other thread, and frame is due */
+			term->std_due = 0;
+			return 0;
+		}
+		Sleep(10);
+	}
+	*(char *)buf = _getch();
+	ret = 1;
+#else
+	char drop[64];
+	int timeout = -1;
+	uint64_t now = 0;
+	struct pollfd pfd[3];
+
+	pfd[0].fd = STDIN_FILENO;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = term->std_wake[0]; /* ignored by poll if < 0 */
+	pfd[1].events = POLLIN;
+	pfd[2].fd = term->out_queue.used > 0 ? term->std_out : -1; /* queued output is sent once writable */
+	pfd[2].events = POLLOUT;
+	while (1) {
+		pfd[0].revents = 0;
+		pfd[1].revents = 0;
+		pfd[2].revents = 0;
+		timeout = -1;
+		if (term->std_due > 0) {
+			now = term_time_ms();
+			if (now >= term->std_due) {
+				term->std_due = 0;
+				return 0; /* timeout of timer_std */
 			}
-			for (p_com = term->hints; p_com != NULL; p_com = p_com->next, i++) {
-				if (i != 0) {
-					words_len += 2;
-				}
-				words_len += strlen(p_com->word);
+			timeout = (int)(term->std_due - now);
+		}
+		if (poll(pfd, 3, timeout) < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
-			if (words_len <= cols) {
-				i = 0;
-				for (p_com = term->complete; p_com != NULL; p_com = p_com->next, i++) {
-					if (i != 0) {
-						term_printf_inner(term, "  ");
-					}
-					term_color_set(term, TERM_FGCOLOR_BRIGHT_BLUE);
-					term_printf_inner(term, "%s", p_com->word);
-					term_color_set(term, TERM_COLOR_DEFAULT);
-				}
-				for (p_com = term->hints; p_com != NULL; p_com = p_com->next, i++) {
-					if (i != 0) {
-						term_printf_inner(term, "  ");
-					}
-					term_color_set(term, TERM_FGCOLOR_BRIGHT_CYAN);
-					term_printf_inner(term, "%s", p_com->word);
-					term_color_set(term, TERM_COLOR_DEFAULT);
-				}
-				if (i != 0) {
-					term_printf_inner(term, "\n");
-				}
-			} else { /* print word as a table */
-				word_num = ((cols - word_width) / (word_width + 2)) + 1;
-				i = 0;
-				for (p_com = term->complete; p_com != NULL; p_com = p_com->next, i++) {
-					if (i % word_num == 0) {
-						term_printf_inner(term, "%s", i ? "\n" : "");
-					} else {
-						term_printf_inner(term, "  ");
-					}
-					term_color_set(term, TERM_FGCOLOR_BRIGHT_BLUE);
-					term_printf_inner(term, "%s", p_com->word);
-					term_color_set(term, TERM_COLOR_DEFAULT);
-					term_printf_inner(term, "%*s", word_width - strlen(p_com->word), "");
-				}
-				for (p_com = term->hints; p_com != NULL; p_com = p_com->next, i++) {
-					if (i % word_num == 0) {
-						term_printf_inner(term, "%s", i ? "\n" : "");
-					} else {
-						term_printf_inner(term, "  ");
-					}
-					term_color_set(term, TERM_FGCOLOR_BRIGHT_CYAN);
-					term_printf_inner(term, "%s", p_com->word);
-					term_color_set(term, TERM_COLOR_DEFAULT);
-					term_printf_inner(term, "%*s", word_width - strlen(p_com->word), "");
-				}
-				if (i != 0) {
-					term_printf_inner(term, "\n");
-				}
+			return -1;
+		}
+		if (pfd[1].revents & POLLIN) {
+			while (read(term->std_wake[0], drop, sizeof(drop)) > 0);
+			if (pfd[0].revents == 0) {
+				return 0; /* woken up by wakeup_std */
 			}
-		} /* end only show words */
-		if (executable) {
-			term_printf_inner(term, "<CR>\n");
 		}
-		term_print_prompt(term);
-		// printf("term->pos %d, line_command %d\n", term->pos, strlen((char *)(term->line_command.content)));
-		term_refresh(term, strlen((char *)(term->line_command.content)), strlen((char *)(term->line_command.content)), 0);
+		if (pfd[0].revents != 0) {
+			break;
+		}
+		if (pfd[2].revents != 0) {
+			return 0;
+		}
+	}
+	ret = read(STDIN_FILENO, buf, count);
+	if (ret == 0) { /* EOF */
+		ret = -1;
+	}
+#endif
+	return ret;
+}
+
+#if !defined(_WIN32)
+static void wakeup_std(Terminal *term) {
+	ssize_t rc = 0;
+	rc = write(term->std_wake[1], "", 1); /* pipe is non-blocking, full pipe wakes up as well */
+	(void)rc;
+}
+#endif
+
+/* called by owner only, read_std is called by the same thread */
+static void timer_std(Terminal *term, int ms) {
+	term->std_due = term_time_ms() + ms;
+}
+
+static int raw_mode_std(Terminal *term, int enable) {
+#if !defined(_WIN32) /* _getch is not buffered and echoed already */
+	struct termios cur_term;
+	if (enable) {
+		if (tcgetattr(STDIN_FILENO, &std_saved_term) < 0) {
+			perror("tcgetattr");
+			return -1;
+		}
+		cur_term = std_saved_term;
+		cur_term.c_lflag &= ~(ICANON | ECHO | ISIG); // echoing off, canonical off, no signal chars
+		cur_term.c_cc[VMIN] = 1;
+		cur_term.c_cc[VTIME] = 0;
+		if (tcsetattr(STDIN_FILENO, TCSANOW, &cur_term) < 0) {
+			perror("tcsetattr");
+			return -1;
+		}
+	} else {
+		if (tcsetattr(STDIN_FILENO, TCSADRAIN, &std_saved_term) < 0) {
+			perror("tcsetattr");
+			return -1;
+		}
+	}
+#endif
+	return 0;
+}
+
+static void winsize_std(Terminal *term, int *cols, int *rows) {
+#if defined(_WIN32)
+	CONSOLE_SCREEN_BUFFER_INFO inf;
+	GetConsoleScreenBufferInfo (GetStdHandle(STD_OUTPUT_HANDLE), &inf);
+	*cols = inf.srWindow.Right - inf.srWindow.Left + 1;
+	*rows = inf.srWindow.Bottom - inf.srWindow.Top + 1;
+#else
+	struct winsize ws = {0};
+
+	ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+	*cols = ws.ws_col;
+	*rows = ws.ws_row;
+#endif
+}
+
+static ssize_t read_init_content(Terminal *term, void *buf, size_t count) {
+	ssize_t ret = 0;
+	if (term->init_content == NULL) {
+		term->read = term->tp.read;
+		ret = 0;
+	} else {
+		*(char *)buf = *(term->init_content + term->init_content_offset);
+		if (*(char *)buf == '\0') {
+			MY_FREE(term->init_content);
+			term->init_content = NULL;
+			term->init_content_offset = 0;
+			term->read = term->tp.read;
+			ret = 0;
+		} else {
+			term->init_content_offset++;
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
+static ssize_t write_std(Terminal *term, const void *buf, size_t count) {
+#if defined(_WIN32)
+	return write(STDOUT_FILENO, buf, count);
+#else
+	return write(term->std_out, buf, count);
+#endif
+}
+
+#if !defined(_WIN32)
+static int writable_std(Terminal *term, int ms) {
+	struct pollfd pfd;
+
+	pfd.fd = term->std_out;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
+	return poll(&pfd, 1, ms);
+}
+
+static ssize_t writev_std(Terminal *term, const TermIOVec *iov, int iovcnt) {
+	int i = 0;
+	struct iovec vec[OUT_SEG_MAX];
+
+	iovcnt = iovcnt < OUT_SEG_MAX ? iovcnt : OUT_SEG_MAX; /* caller will write remain */
+	for (i = 0; i < iovcnt; i++) {
+		vec[i].iov_base = (void *)iov[i].base;
+		vec[i].iov_len = iov[i].len;
+	}
+	return writev(term->std_out, vec, iovcnt);
+}
+#endif
+
+/* free terminal after its job workers exited */
+static void term_free(Terminal *term) {
+	int i = 0;
+
+	term_jobs_free(term);
+	if (term->init_content != NULL) { /* not consumed if term_loop ran term_batch_run */
+		MY_FREE(term->init_content);
+	}
+	if (term->prompt != NULL) {
+		MY_FREE(term->prompt);
+	}
+	if (term->default_prompt != NULL) {
+		MY_FREE(term->default_prompt);
+	}
+	tt_buffer_free(&(term->prefix));
+	tt_buffer_free(&(term->line_command));
+	term_edit_reset(term);
+	term_complete_cache_reset(term);
+	if (term->hl_tokens != NULL) {
+		MY_FREE(term->hl_tokens);
+	}
+	tt_buffer_free(&(term->hl_word));
+	tt_buffer_free(&(term->tempbuf));
+	tt_buffer_free(&(term->prompt_out));
+	tt_buffer_free(&(term->out_queue));
+	for (i = 0; i < term->history_cnt; i++) {
+		MY_FREE(term->history[i]);
+	}
+	MY_FREE(term->history);
+	term_hist_node_free(term->history_index.children);
+	term->history_index.children = NULL;
+	if (term->line != NULL) {
+		MY_FREE(term->line);
+	}
+	term->history_cnt = 0;
+	term->history = NULL;
+	term_async_free(term);
+	if (term->trace != NULL) {
+		MY_FREE(term->trace);
+	}
+#ifdef TERM_STATS
+	term_stat_free(term);
+#endif
+#if !defined(_WIN32)
+	if (term->std_wake[0] >= 0) {
+		close(term->std_wake[0]);
+		close(term->std_wake[1]);
+	}
+	if (term->std_out != STDOUT_FILENO) {
+		close(term->std_out);
+	}
+#endif
+	memset(term, 0x00, sizeof(Terminal));
+	MY_FREE(term);
+}
+
+void term_destroy(Terminal *term) {
+	if (term_jobs_stop(term) > 0) {
+		return; /* jobs are cancelled, freed by last worker once handler returned, never waited here */
+	}
+	term_free(term);
+}
+
+static Terminal *term_alloc(const char *prompt, TermNode *root) {
+	int ret = -1;
+	Terminal *term = NULL;
+
+	term = (Terminal *)MY_MALLOC(sizeof(Terminal));
+	if (term == NULL) {
+		goto func_end;
+	}
+	memset(term, 0x00, sizeof(Terminal));
+	term_async_init(term);
+	term->job_workers = EXEC_WORKERS;
+	term->esc_timeout = ESC_TIMEOUT;
+	term->out_high = OUT_QUEUE_HIGH;
+	term->out_policy = TERM_OUT_WAIT;
+	term->suggest = 1;
+	term->highlight = 1;
+	term->complete_cache.prefix = -1;
+	pthread_mutex_init(&(term->job_lock), NULL);
+	pthread_cond_init(&(term->job_cond), NULL);
+#ifdef TERM_STATS
+	pthread_mutex_init(&(term->stat_lock), NULL);
+#endif
+#if !defined(_WIN32)
+	term->std_wake[0] = -1;
+	term->std_wake[1] = -1;
+	term->std_out = STDOUT_FILENO;
+#endif
+	tt_buffer_init(&(term->out_queue));
+	tt_buffer_init(&(term->line_command));
+	tt_buffer_swapto_malloced(&(term->line_command), 0); /* avoid term->line_command->content is null */
+	tt_buffer_init(&(term->tempbuf));
+	tt_buffer_init(&(term->prompt_out));
+	tt_buffer_init(&(term->prefix));
+	tt_buffer_swapto_malloced(&(term->prefix), 0); /* avoid term->frefix->content is null */
+	tt_buffer_init(&(term->hl_word));
+	tt_buffer_swapto_malloced(&(term->hl_word), 0); /* word is passed as string even if empty */
+	term->default_prompt = MY_STRDUP(prompt);
+	if (0 != term_prompt_set(term, prompt)) {
+		goto func_end;
+	}
+	term->root = root;
+	term_prompt_color_set(term, TERM_FGCOLOR_BRIGHT_GREEN | TERM_STYLE_BOLD);
+	ret = 0;
+func_end:
+	if (ret != 0) {
+		if (term != NULL) {
+			term_destroy(term);
+			term = NULL;
+		}
+	}
+	return term;
+}
+
+int term_create(Terminal **_term, const char *prompt, TermNode *root, const char *init_content) {
+	int ret = -1;
+	Terminal *term = NULL;
+#if !defined(_WIN32)
+	const char *tty = NULL;
+#endif
+
+#if defined(_WIN32)
+	HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
+	if (hOut == INVALID_HANDLE_VALUE) {
+		return GetLastError();
+	}
+
+	DWORD dwMode = 0;
+	if (isatty(STDIN_FILENO)) { /* output may be redirected in batch mode */
+		if (!GetConsoleMode(hOut, &dwMode)) {
+			return GetLastError();
+		}
+
+		dwMode |= ENABLE_VIRTUAL_TERMINAL_PROCESSING;
+		if (!SetConsoleMode(hOut, dwMode)){
+			return GetLastError();
+		}
+	}
+#endif
+
+	term = term_alloc(prompt, root);
+	if (term == NULL) {
+		goto func_end;
+	}
+	term->local = 1;
+	term->pager = 1; /* off for transports, see term_pager_set */
+	term->tp.read = read_std;
+	term->tp.write = write_std;
+#if !defined(_WIN32)
+	term->tp.writev = writev_std;
+	if (0 == pipe(term->std_wake)) {
+		fcntl(term->std_wake[0], F_SETFL, fcntl(term->std_wake[0], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(term->std_wake[1], F_SETFL, fcntl(term->std_wake[1], F_GETFL, 0) | O_NONBLOCK);
+		fcntl(term->std_wake[0], F_SETFD, FD_CLOEXEC);
+		fcntl(term->std_wake[1], F_SETFD, FD_CLOEXEC);
+		term->tp.wakeup = wakeup_std;
+	} else {
+		term->std_wake[0] = -1;
+		term->std_wake[1] = -1;
+	}
+	if (isatty(STDOUT_FILENO) && (tty = ttyname(STDOUT_FILENO)) != NULL
+			&& (term->std_out = open(tty, O_WRONLY | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) >= 0) {
+		term->tp.writable = writable_std; /* own open file of tty, STDOUT shared with other processes keeps blocking */
+	} else {
+		term->std_out = STDOUT_FILENO;
+	}
+#endif
+	term->tp.winsize = winsize_std;
+	term->tp.raw_mode = raw_mode_std;
+	term->tp.timer = timer_std;
+	if (init_content != NULL) {
+		term->init_content = MY_STRDUP(init_content);
+		term->init_content_offset = 0;
+		term->read = read_init_content;
+	} else {
+		term->read = term->tp.read;
+	}
+	*_term = term;
+	ret = 0;
+func_end:
+	if (ret != 0) {
+		if (term != NULL) {
+			term_destroy(term);
+		}
+	}
+	return ret;
+}
+
+int term_create_transport(Terminal **_term, const char *prompt, TermNode *root, const TermTransport *transport, void *transport_data) {
+	Terminal *term = NULL;
+
+	if (_term == NULL || transport == NULL || transport->read == NULL || transport->write == NULL) {
+		return -1;
+	}
+	term = term_alloc(prompt, root);
+	if (term == NULL) {
+		return -1;
+	}
+	term->tp = *transport;
+	term->tp_data = transport_data;
+	term->read = term->tp.read;
+	*_term = term;
+	return 0;
+}
+
+void *term_transport_data(Terminal *term) {
+	return term->tp_data;
+}
+
+int term_root_set(Terminal *term, TermNode *root) {
+	term->root = root;
+	term->complete_cache.prefix = -1;
+	return 0;
+}
+
+#if !defined(_WIN32)
+/* keys by final char of <ESC>[X <ESC>OX <ESC>[1;NX */
+static const int term_key_final[0x80] = {
+	['A'] = KEY_UP, ['B'] = KEY_DOWN, ['C'] = KEY_RIGHT, ['D'] = KEY_LEFT,
+	['F'] = KEY_END, ['H'] = KEY_HOME,
+	['P'] = KEY_FUN(1), ['Q'] = KEY_FUN(2), ['R'] = KEY_FUN(3), ['S'] = KEY_FUN(4),
+};
+/* keys by number of <ESC>[N~ <ESC>[N;N~ */
+static const int term_key_tilde[25] = {
+	[1] = KEY_HOME, [2] = KEY_INSERT, [3] = KEY_DELETE, [4] = KEY_END, [5] = KEY_PGUP, [6] = KEY_PGDN,
+	[7] = KEY_HOME, [8] = KEY_END,
+	[11] = KEY_FUN(1), [12] = KEY_FUN(2), [13] = KEY_FUN(3), [14] = KEY_FUN(4), [15] = KEY_FUN(5),
+	[17] = KEY_FUN(6), [18] = KEY_FUN(7), [19] = KEY_FUN(8), [20] = KEY_FUN(9), [21] = KEY_FUN(10),
+	[23] = KEY_FUN(11), [24] = KEY_FUN(12),
+};
+/* keys by code of <ESC>[N;Nu, others are the code itself */
+static int term_key_code(int code) {
+	switch (code) {
+		case 9: return KEY_TAB;
+		case 13: return KEY_CR;
+		case 27: return KEY_ESC;
+		case 127: return KEY_BACKSPACE;
+		default: return (code > 0 && code < 0x80) ? code : 0;
+	}
+}
+
+/* apply xterm modifier N of <ESC>[1;NX, N - 1 is bits of shift(1) alt(2) ctrl(4), shift is ignored */
+static int term_key_modify(int key, int modifier) {
+	modifier = modifier > 1 ? modifier - 1 : 0;
+	if (modifier & 4) {
+		key = (key >= 'a' && key <= 'z') ? KEY_CTRL(key - 'a' + 'A') : KEY_CTRL(key);
+	}
+	if (modifier & 2) {
+		key = KEY_ALT(key);
+	}
+	return key;
+}
+
+/* decode rest of escape sequence after ESC, whole sequence is consumed even if unknown,
+ * CSI: <ESC>[ numbers separated by ';', private or intermediate chars, final char in 0x40 - 0x7e */
+static int term_getkey_escape(Terminal *term) {
+	int key = 0, intro = 0, num = 0, private = 0, modifier = 0;
+	int param[ESC_PARAM_MAX];
+
+	key = term_getch_timeout(term, term->esc_timeout);
+	if (key == KEY_TIMEOUT) {
+		return KEY_ESC;
+	}
+	if (key == KEY_EOF) {
+		return KEY_EOF;
+	}
+	if (key != '[' && key != 'O') { /* <ESC>x is Alt+x */
+		return KEY_ALT(key);
+	}
+	intro = key;
+	memset(param, 0x00, sizeof(param));
+	while (1) {
+		key = term_getch_timeout(term, term->esc_timeout);
+		if (key == KEY_EOF) {
+			return KEY_EOF;
+		}
+		if (key == KEY_TIMEOUT) { /* sequence broken, dropped */
+			return -1;
+		}
+		if (key >= '0' && key <= '9') {
+			if (num < ESC_PARAM_MAX && param[num] < 100000) {
+				param[num] = param[num] * 10 + key - '0';
+			}
+		} else if (key == ';') {
+			num++;
+		} else if (key >= 0x40 && key <= 0x7e) { /* final char */
+			break;
+		} else if (key >= 0x20 && key < 0x40) { /* private marker or intermediate char, such as <ESC>[?1u */
+			private = 1;
+		} else { /* control char breaks sequence, it is processed as next key */
+			term_ungetch(term);
+			return -1;
+		}
+	}
+	if (private) {
+		return -1;
+	}
+	modifier = (intro == 'O' && num == 0) ? param[0] : param[1]; /* <ESC>O5A sent by some terminals */
+	if (key == '~' && intro == '[') {
+		key = param[0] < (int)(sizeof(term_key_tilde) / sizeof(term_key_tilde[0])) ? term_key_tilde[param[0]] : 0;
+	} else if (key == 'u' && intro == '[') {
+		key = term_key_code(param[0]);
+	} else {
+		key = term_key_final[key];
+	}
+	if (key == 0) {
+		return -1;
+	}
+	return term_key_modify(key, num > 0 || intro == 'O' ? modifier : 0);
+}
+#endif
+
+static int term_getkey(Terminal *term) {
+	int key = 0;
+
+#if defined(_WIN32)
+	key = term_getch(term);
+	if ((unsigned char)key == 0xe0) { /* extern */
+		key = term_getch(term);
+		if (key == KEY_EOF) {
+			return KEY_EOF;
+		}
+		switch (key) {
+			case 0x47: return KEY_HOME;
+			case 0x48: return KEY_UP;
+			case 0x4b: return KEY_LEFT;
+			case 0x4d: return KEY_RIGHT;
+			case 0x4f: return KEY_END;
+			case 0x50: return KEY_DOWN;
+			case 0x73: return KEY_CTRL(KEY_LEFT);
+			case 0x74: return KEY_CTRL(KEY_RIGHT);
+		}
+	} else if (key == 0x7f) {
+		return KEY_BACKSPACE;
+	}
+#else
+	key = term_getch(term);
+	if (KEY_ESC == key) { /* need escape */
+		return term_getkey_escape(term);
+	} else if (key == 0x7f) {
+		return KEY_BACKSPACE;
+	}
+#endif
+	return key;
+}
+
+static const unsigned int term_hl_colors[] = {
+	[HL_NONE] = TERM_COLOR_DEFAULT,
+	[HL_KEY] = TERM_FGCOLOR_BRIGHT_BLUE, /* same as words of completion */
+	[HL_OPTION] = TERM_FGCOLOR_BRIGHT_MAGENTA,
+	[HL_TEXT] = TERM_FGCOLOR_BRIGHT_CYAN, /* same as hints of completion */
+	[HL_UNKNOWN] = TERM_FGCOLOR_BRIGHT_RED,
+};
+
+/* add node list to frontier of token, skip if already added */
+static void term_hl_frontier_add(TermHlToken *tok, TermNode *list) {
+	int i = 0;
+
+	if (list == NULL || tok->frontier_num >= HL_FRONTIER_MAX) {
+		return;
+	}
+	for (i = 0; i < tok->frontier_num; i++) {
+		if (tok->frontier[i] == list) {
+			return;
+		}
+	}
+	tok->frontier[tok->frontier_num++] = list;
+}
+
+/* match word against node list, set style of tok and add lists after matched nodes to its frontier,
+ * style is the best of KEY and OPTION matched by word, TEXT and UNKNOWN */
+static void term_hl_match(TermHlToken *tok, TermNode *list, const char *word) {
+	TermNode *node = NULL;
+
+	for (node = list; node != NULL; node = node->next) {
+		if (node->selector != NULL) { /* option of TYPE_SELECT or TYPE_MULSEL */
+			if (compare_keyword(node->word, word) == MATCH_NONE) {
+				continue;
+			}
+			tok->style = tok->style == HL_KEY ? HL_KEY : HL_OPTION;
+			term_hl_frontier_add(tok, node->selector->children);
+			if (node->selector->type == TYPE_MULSEL) {
+				term_hl_frontier_add(tok, node->selector->option);
+			}
+		} else if (node->type == TYPE_SELECT || node->type == TYPE_MULSEL) {
+			if (node->dyn_option != NULL) { /* options of callback are not fetched while typing */
+				tok->style = tok->style == HL_UNKNOWN || tok->style == HL_TEXT ? HL_OPTION : tok->style;
+				term_hl_frontier_add(tok, node->children);
+			} else {
+				term_hl_match(tok, node->option, word);
+			}
+			if (node->flags & MULSEL_OPTIONAL) {
+				term_hl_match(tok, node->children, word);
+			}
+		} else if (node->type == TYPE_KEY) {
+			if (compare_keyword(node->word, word) != MATCH_NONE) {
+				tok->style = HL_KEY;
+				term_hl_frontier_add(tok, node->children);
+			}
+		} else if (node->type == TYPE_TEXT) {
+			tok->style = tok->style == HL_UNKNOWN ? HL_TEXT : tok->style;
+			term_hl_frontier_add(tok, node->children);
+		}
+	}
+}
+
+/* classify tokens of line changed since last call, tokens before them are kept,
+ * token changed only after its start is scanned on from its saved word, so typing a long word scans each char once,
+ * return first position whose style is changed, num if none */
+static int term_hl_update(Terminal *term, int num) {
+	int i = 0, k = 0, pos = 0, changed = num, quot = 0, old_style = 0, old_start = 0, resume = 0;
+	char ch = 0;
+	TTBuffer *word = &(term->hl_word);
+	TermHlToken *tok = NULL, *prev = NULL, *tokens = NULL;
+	int version = ATOMIC_LOAD_INT(&term_tree_version);
+
+	if (term->hl_root != term->root || term->hl_version != version) {
+		term->hl_num = 0;
+		term->hl_dirty = 0;
+		term->hl_root = term->root;
+		term->hl_version = version;
+	}
+	for (k = 0; k < term->hl_num && term->hl_tokens[k].end < term->hl_dirty && term->hl_tokens[k].end < num; k++);
+	pos = k > 0 ? term->hl_tokens[k - 1].end : 0;
+	tok = k < term->hl_num ? &(term->hl_tokens[k]) : NULL;
+	if (tok != NULL && tok->start == term->hl_word_start && tok->end == term->hl_word_end && tok->start < term->hl_dirty && term->hl_dirty <= num
+			&& (tok->end == term->hl_dirty || (term->hl_quot == 0 && (int)(word->used) == tok->end - tok->start)) /* word is a copy of line if no quot or escape */
+			&& term_line_at(term, term->hl_dirty - 1) != '\\') { /* '\\' at end of line was not an escape */
+		resume = term->hl_dirty;
+		word->used = resume - tok->start < (int)(word->used) ? (size_t)(resume - tok->start) : word->used;
+		word->content[word->used] = '\0';
+	}
+	while (1) {
+		if (resume == 0) {
+			for (; pos < num && term_line_at(term, pos) == ' '; pos++);
+			if (pos >= num) {
+				break;
+			}
+		}
+		if (k >= term->hl_space) {
+			tokens = MY_REALLOC(term->hl_tokens, sizeof(TermHlToken) * (k + 16));
+			if (tokens == NULL) {
+				break;
+			}
+			term->hl_tokens = tokens;
+			term->hl_space = k + 16;
+		}
+		tok = &(term->hl_tokens[k]);
+		old_style = k < term->hl_num ? tok->style : -1;
+		old_start = k < term->hl_num ? tok->start : -1;
+		if (resume > 0) { /* chars before resume are in word */
+			pos = resume;
+			quot = term->hl_quot;
+			resume = 0;
+		} else {
+			tok->start = pos;
+			tt_buffer_empty(word);
+			quot = 0;
+		}
+		for (; pos < num; pos++) { /* unescaped like term_args_parse */
+			ch = term_line_at(term, pos);
+			if (ch == '\\' && pos + 1 < num) {
+				ch = term_line_at(term, ++pos);
+			} else if (quot != 0 && ch == quot) {
+				quot = 0;
+				continue;
+			} else if (quot == 0 && (ch == '"' || ch == '\'')) {
+				quot = ch;
+				continue;
+			} else if (quot == 0 && ch == ' ') {
+				break;
+			}
+			tt_buffer_putc(word, ch);
+		}
+		tok->end = pos;
+		term->hl_word_start = tok->start;
+		term->hl_word_end = pos;
+		term->hl_quot = quot;
+		tok->frontier_num = 0;
+		tok->style = HL_UNKNOWN;
+		prev = k > 0 ? &(term->hl_tokens[k - 1]) : NULL;
+		if ((prev != NULL && prev->frontier_num < 0) || (word->used == 1 && word->content[0] == '|' && term_line_at(term, tok->start) == '|')) {
+			tok->style = HL_NONE; /* filters after pipe are not in command tree */
+			tok->frontier_num = -1;
+		} else if (prev == NULL) {
+			term_hl_match(tok, term->root->children, (char *)(word->content));
+		} else {
+			for (i = 0; i < prev->frontier_num; i++) {
+				term_hl_match(tok, prev->frontier[i], (char *)(word->content));
+			}
+		}
+		if ((tok->style != old_style || tok->start != old_start) && tok->start < changed) {
+			changed = tok->start;
+		}
+		k++;
+	}
+	term->hl_num = k;
+	term->hl_dirty = num;
+	return changed;
+}
+
+/* output [start, end) of line in colors of tokens, color is set only where it differs from the one on screen */
+static void term_hl_out(Terminal *term, int start, int end) {
+	int i = 0, next = 0, k = 0;
+
+	for (k = 0; k < term->hl_num && term->hl_tokens[k].end <= start; k++);
+	for (i = start; i < end; i = next) {
+		if (k < term->hl_num && term->hl_tokens[k].start <= i) {
+			term_color_set(term, term_hl_colors[term->hl_tokens[k].style]);
+			next = term->hl_tokens[k].end < end ? term->hl_tokens[k].end : end;
+			k++;
+		} else { /* SPACE between tokens keeps color */
+			next = (k < term->hl_num && term->hl_tokens[k].start < end) ? term->hl_tokens[k].start : end;
+		}
+		term_line_out(term, i, next);
+	}
+}
+
+/* draw line from refresh_pos to num and suggestion after it, clear rest of old content, move cursor to pos.
+ * suggestion is not drawn again if the typed char is the first char of it.
+ * while keys of one input block are processed, only the change is recorded and drawn by term_refresh_flush.
+ * color of line is kept on screen for next refresh, reset by term_line_leave before other output */
+static void term_refresh(Terminal *term, int pos, int num, int refresh_pos) {
+	int i = 0, end = 0, tail = 0, prompt_len = 0, pos_row = 0, pos_col = 0;;
+	int rows = 0, cols = 0, ghost = 0, ghost_id = 0, highlight = 0;
+	const char *ghost_text = NULL;
+	uint64_t trace_start = 0;
+
+	if (term->refresh_defer) { /* draw once for all keys of input block, content before lowest refresh_pos is kept */
+		if (!term->refresh_pending) {
+			term->refresh_pending = 1;
+			term->refresh_from = refresh_pos;
+			term->shown_pos = term->pos;
+			term->shown_num = term->num;
+		} else if (refresh_pos >= 0 && (term->refresh_from < 0 || refresh_pos < term->refresh_from)) {
+			term->refresh_from = refresh_pos;
+		}
+		term_line_truncate(term, num);
+		term->pos = pos;
+		term->num = num;
+		return;
+	}
+	if (term->trace != NULL) {
+		trace_start = term_time_us();
+	}
+	term_screen_get(term, &cols, &rows);
+	prompt_len = strlen(term->prompt) + 1; /* 1: cursor and space after prompt */
+
+	if (refresh_pos >= 0) { /* update changes */
+		term_line_truncate(term, num);
+		ghost_text = term_suggest_find(term, num, &ghost, &ghost_id);
+		highlight = term->highlight && !term->mask && !term->multiline && term->root != NULL;
+		if (highlight) {
+			i = term_hl_update(term, num);
+			refresh_pos = refresh_pos < i ? refresh_pos : i; /* token typed in changes color from its start */
+		}
+		pos_row = (refresh_pos + prompt_len) / cols - (term->pos + prompt_len) / cols;
+		pos_col = (refresh_pos + prompt_len) % cols - (term->pos + prompt_len) % cols;
+		term_cursor_move(term, pos_col, pos_row);
+		for (i = refresh_pos; i < num; i = end) { /* output content piece by piece until right border */
+			end = i + cols - (i + prompt_len) % cols;
+			end = end < num ? end : num;
+			if (highlight) {
+				term_hl_out(term, i, end);
+			} else if (term->mask) {
+				term_color_set(term, TERM_COLOR_DEFAULT);
+				term_out_repeat(term, '*', end - i);
+			} else {
+				term_color_set(term, TERM_COLOR_DEFAULT);
+				term_line_out(term, i, end);
+			}
+			if ((end + prompt_len) % cols == 0) { /* reach right border, new line */
+				term_out_write(term, "\r\n", 2);
+			}
+		}
+		refresh_pos = refresh_pos > num ? refresh_pos : num;
+		tail = term->num + term->ghost;
+		if (ghost_text != NULL && ghost_id == term->ghost_id && ghost == term->ghost - 1 && refresh_pos == term->num + 1) {
+			tail = refresh_pos; /* typed first char of suggestion, rest is on screen */
+		} else if (ghost_text != NULL) {
+			term_color_set(term, TERM_FGCOLOR_BRIGHT_BLACK);
+			for (i = num; i < num + ghost; i = end) {
+				end = i + cols - (i + prompt_len) % cols;
+				end = end < num + ghost ? end : num + ghost;
+				term_out_borrow(term, ghost_text + i - num, end - i);
+				if ((end + prompt_len) % cols == 0) { /* reach right border, new line */
+					term_out_write(term, "\r\n", 2);
+				}
+			}
+			refresh_pos = num + ghost;
+		}
+		for (i = refresh_pos; i < tail; i = end) { /* clear removed content, SPACE in color of line */
+			end = i + cols - (i + prompt_len) % cols;
+			end = end < tail ? end : tail;
+			term_out_repeat(term, ' ', end - i);
+			if ((end + prompt_len) % cols == 0) { /* reach right border, new line */
+				term_out_write(term, "\r\n", 2);
+			}
+		}
+		refresh_pos = refresh_pos > tail ? refresh_pos : tail;
+		pos_row = (pos + prompt_len) / cols - (refresh_pos + prompt_len) / cols;
+		pos_col = (pos + prompt_len) % cols - (refresh_pos + prompt_len) % cols;
+		term_cursor_move(term, pos_col, pos_row);
+		term->ghost = ghost_text != NULL ? ghost : 0;
+		term->ghost_text = ghost_text;
+		term->ghost_id = ghost_id;
+	} else { /* move cursor only */
+		pos_row = (pos + prompt_len) / cols - (term->pos + prompt_len) / cols;
+		pos_col = (pos + prompt_len) % cols - (term->pos + prompt_len) % cols;
+		term_cursor_move(term, pos_col, pos_row);
+	}
+	if (term->region_pinned) { /* screen scrolled if input line grows at bottom, and never scrolls back */
+		i = ((num + term->ghost > term->num ? num + term->ghost : term->num) + prompt_len) / cols + 1;
+		term->region_rows = term->region_rows > i ? term->region_rows : i;
+	}
+	term->pos = pos;
+	term->num = num;
+	if (term->trace != NULL) {
+		term_trace_add(term, TERM_TRACE_REFRESH, trace_start, (uint32_t)num);
+	}
+	term_out_flush(term); /* line_command borrowed by output, must be written before next change */
+}
+
+/* draw refreshes deferred while keys of one input block were processed */
+static void term_refresh_flush(Terminal *term) {
+	int pos = term->pos, num = term->num;
+
+	if (!term->refresh_pending) {
+		return;
+	}
+	term->refresh_pending = 0;
+	term->pos = term->shown_pos;
+	term->num = term->shown_num;
+	term_refresh(term, pos, num, term->refresh_from);
+}
+
+/* draw pending refresh, erase suggestion from screen and reset color of line before output below the line */
+static void term_line_leave(Terminal *term) {
+	int suggest = term->suggest;
+
+	term_refresh_flush(term);
+	if (term->ghost > 0) {
+		term->suggest = 0;
+		term_refresh(term, term->pos, term->num, term->num);
+		term->suggest = suggest;
+	}
+	term_color_set(term, TERM_COLOR_DEFAULT);
+}
+
+/* take suggestion into line, cursor moves to end */
+static void term_ghost_accept(Terminal *term) {
+	int num = term->num, len = term->ghost;
+
+	term_edit_insert(term, num, term->ghost_text, len, 0);
+	term_refresh(term, num + len, num + len, num);
+}
+
+/* undo last edit of line, or redo edit undone last if redo is set */
+static void term_edit_apply(Terminal *term, int redo) {
+	int len = 0;
+	TermEdit *edit = NULL;
+
+	if (redo) {
+		edit = term->edit_last != NULL ? term->edit_last->next : term->edit_first;
+	} else {
+		edit = term->edit_last;
+	}
+	if (edit == NULL) {
+		return;
+	}
+	len = (int)(edit->text.used);
+	if (redo ? edit->insert : !edit->insert) {
+		term_line_insert(term, edit->pos, edit->text.content, len);
+		term_refresh(term, edit->pos + len, term->num + len, edit->pos);
+	} else {
+		term_line_erase(term, edit->pos, len);
+		term_refresh(term, edit->pos, term->num - len, edit->pos);
+	}
+	term->edit_last = redo ? edit : edit->prev;
+	edit->merge = 0; /* chars typed after undo or redo start new edit */
+	if (term->edit_last != NULL) {
+		term->edit_last->merge = 0;
+	}
+}
+
+static void term_wordhelp_free(TermWordHelp **wordhelp) {
+	TermWordHelp *p_next = NULL, *p_cur = NULL;
+
+	for (p_cur = *wordhelp; p_cur != NULL; p_cur = p_next) {
+		p_next = p_cur->next;
+		MY_FREE(p_cur->word);  /* word must not be NULL */
+		if (p_cur->help != NULL) {
+			MY_FREE(p_cur->help);
+		}
+		MY_FREE(p_cur);
+	}
+	*wordhelp = NULL;
+}
+
+static void term_wordhelp_add(TermWordHelp **wordhelp, const char *word, const char *help) {
+	int ret = -1;
+	TermWordHelp *p_new = NULL, *p_cur = NULL;
+
+	p_new = (TermWordHelp *)MY_MALLOC(sizeof(TermWordHelp));
+	if (p_new == NULL) {
+		goto func_end;
+	}
+	memset(p_new, 0x00, sizeof(TermWordHelp));
+	if (word == NULL) { /* word must not be NULL */
+		goto func_end;
+	}
+	p_new->word = MY_STRDUP(word);
+	if (p_new->word == NULL) {
+		goto func_end;
+	}
+	if (help != NULL) {
+		p_new->help = (char *)MY_STRDUP(help);
+		if (p_new->help == NULL) {
+			goto func_end;
+		}
+	}
+	if (*wordhelp == NULL) {
+		*wordhelp = p_new;
+	} else {
+		for (p_cur = *wordhelp; p_cur->next != NULL; p_cur = p_cur->next);
+		p_cur->next = p_new;
+	}
+	ret = 0;
+func_end:
+	if (ret != 0) {
+		if (p_new != NULL) {
+			if (p_new->word != NULL) {
+				MY_FREE(p_new->word);
+			}
+			if (p_new->help != NULL) {
+				MY_FREE(p_new->help);
+			}
+			MY_FREE(p_new);
+		}
+	}
+	return;
+}
+
+static void term_complete_free(TermWalk *walk) {
+	term_wordhelp_free(&(walk->complete));
+}
+
+static void term_complete_add(TermWalk *walk, const char *word, const char *help) {
+	term_wordhelp_add(&(walk->complete), word, help);
+}
+
+static void term_hints_free(TermWalk *walk) {
+	term_wordhelp_free(&(walk->hints));
+}
+
+static void term_hints_add(TermWalk *walk, const char *word, const char *help) {
+	term_wordhelp_add(&(walk->hints), word, help);
+}
+
+static int strlenwithesc(const char *s) {
+	int ret = 0;
+	const char *cur = NULL;
+	for (cur = s; *cur != '\0'; cur++) {
+		if (*cur == '\n' || *cur == ' ' || *cur == '\\' || *cur == '\'' || *cur == '\"') {
+			ret += 2;
+		} else {
+			ret += 1;
+		}
+	}
+	return ret;
+}
+
+static char *strcatwithesc(char *dest, const char *src) {
+	char *dst_cur = NULL;
+	const char *src_cur = NULL;
+	for (dst_cur = dest; *dst_cur != '\0'; dst_cur++);
+	for (src_cur = src; *src_cur != '\0'; src_cur++) {
+		if (*src_cur == '\n') {
+			*dst_cur = '\\';
+			dst_cur++;
+			*dst_cur = 'n';
+			dst_cur++;
+		} else if(*src_cur == ' ' || *src_cur == '\\' || *src_cur == '\'' || *src_cur == '\"') {
+			*dst_cur = '\\';
+			dst_cur++;
+			*dst_cur = *src_cur;
+			dst_cur++;
+		} else {
+			*dst_cur = *src_cur;
+			dst_cur++;
+		}
+	}
+	*dst_cur = '\0';
+	return dest;
+}
+
+/* add entry with id to prefix tree, all nodes on its path point to it as most recent */
+/* node labeled by head and rest joined */
+static TermHistNode *term_hist_node_new(const char *head, int head_len, const char *rest, int rest_len) {
+	TermHistNode *node = (TermHistNode *)MY_MALLOC(sizeof(TermHistNode) + head_len + rest_len + 1);
+
+	if (node == NULL) {
+		return NULL;
+	}
+	memset(node, 0x00, sizeof(TermHistNode));
+	node->label = (char *)(node + 1);
+	node->len = head_len + rest_len;
+	memcpy(node->label, head, head_len);
+	memcpy(node->label + head_len, rest, rest_len);
+	node->label[node->len] = '\0';
+	return node;
+}
+
+static void term_history_index_add(Terminal *term, const char *entry, int id) {
+	int k = 0;
+	TermHistNode *node = &(term->history_index), *child = NULL, *tail = NULL;
+
+	for (; *entry != '\0'; entry += k, node = child) {
+		for (child = node->children; child != NULL && child->label[0] != *entry; child = child->next);
+		if (child == NULL) { /* rest of entry is a new leaf */
+			child = term_hist_node_new(entry, (int)strlen(entry), "", 0);
+			if (child == NULL) {
+				return;
+			}
+			child->count = 1;
+			child->best = id;
+			child->next = node->children;
+			node->children = child;
+			return;
+		}
+		for (k = 1; k < child->len && child->label[k] == entry[k]; k++);
+		if (k < child->len) { /* entry differs or ends in label, rest of label is moved into new child */
+			tail = term_hist_node_new(child->label + k, child->len - k, "", 0);
+			if (tail == NULL) {
+				return;
+			}
+			tail->count = child->count;
+			tail->best = child->best;
+			tail->children = child->children;
+			child->children = tail;
+			child->len = k;
+			child->label[k] = '\0';
+		}
+		child->count++;
+		child->best = id;
+	}
+}
+
+/* merge node at *pp with its only child if no entry ends at node */
+static void term_hist_node_merge(TermHistNode **pp) {
+	TermHistNode *node = *pp, *child = node->children, *merged = NULL;
+
+	if (child == NULL || child->next != NULL || child->count != node->count) {
+		return;
+	}
+	merged = term_hist_node_new(node->label, node->len, child->label, child->len);
+	if (merged == NULL) {
+		return;
+	}
+	merged->count = child->count;
+	merged->best = child->best;
+	merged->children = child->children;
+	merged->next = node->next;
+	*pp = merged;
+	MY_FREE(node);
+	MY_FREE(child);
+}
+
+/* remove oldest entry from prefix tree, nodes only it passed through are freed */
+static void term_history_index_del(Terminal *term, const char *entry) {
+	const char *p = NULL;
+	TermHistNode *node = &(term->history_index), *child = NULL, **pp = NULL, **node_pp = NULL;
+
+	for (p = entry; *p != '\0'; p += child->len, node = child) { /* whole path is checked before any count changes */
+		for (child = node->children; child != NULL && child->label[0] != *p; child = child->next);
+		if (child == NULL || strncmp(child->label, p, child->len) != 0) {
+			return;
+		}
+	}
+	for (node = &(term->history_index); *entry != '\0'; entry += child->len, node = child, node_pp = pp) {
+		for (pp = &(node->children); (*pp)->label[0] != *entry; pp = &((*pp)->next));
+		child = *pp;
+		if (--(child->count) == 0) {
+			*pp = child->next;
+			child->next = NULL;
+			term_hist_node_free(child);
+			break; /* node may be left with one child */
+		}
+	}
+	if (node_pp != NULL) { /* other nodes on path still have another entry ending at them or more than one child */
+		term_hist_node_merge(node_pp);
+	}
+}
+
+/* rest of most recent history entry starting with first num chars of line and id of entry, NULL if none */
+static const char *term_suggest_find(Terminal *term, int num, int *len, int *id) {
+	int i = 0, k = 0, index = 0;
+	const char *entry = NULL;
+	TermHistNode *node = &(term->history_index);
+
+	if (!term->suggest || term->mask || term->multiline || num == 0) {
+		return NULL;
+	}
+	for (i = 0; i < num && node != NULL; i += k) {
+		for (node = node->children; node != NULL && node->label[0] != term_line_at(term, i); node = node->next);
+		for (k = 1; node != NULL && k < node->len && i + k < num; k++) {
+			if (node->label[k] != term_line_at(term, i + k)) {
+				node = NULL;
+			}
+		}
+	}
+	if (node == NULL) {
+		return NULL;
+	}
+	index = node->best - (term->history_total - term->history_cnt);
+	entry = (index >= 0 && index < term->history_cnt) ? term->history[index] : NULL;
+	if (entry == NULL || entry[num] == '\0') {
+		return NULL;
+	}
+	*len = (int)strlen(entry + num);
+	*id = node->best;
+	return entry + num;
+}
+
+static void term_history_add(Terminal *term, TermArg *args) {
+	size_t len = 0;
+	TermArg *p_arg = NULL;
+
+	if (term->history == NULL) {
+		term->history = (char **)MY_MALLOC(sizeof(char *) * HISTORY_LENGTH);
+		if (term->history == NULL) {
+			goto func_end;
+		}
+		memset(term->history, 0x00, sizeof(char *) * HISTORY_LENGTH);
+	}
+	if (args == NULL) {
+		goto func_end;
+	}
+	len = 0;
+	for (p_arg = args; p_arg != NULL; p_arg = p_arg->next) {
+		len += strlenwithesc(p_arg->content) + 1;
+	}
+	if (term->history_cnt < HISTORY_LENGTH) {
+		term->history_cnt += 1;
+	} else {
+		if (term->history[0] != NULL) {
+			term_history_index_del(term, term->history[0]);
+			MY_FREE(term->history[0]);
+		}
+		memmove(&term->history[0], &term->history[1], sizeof(char *) * (HISTORY_LENGTH - 1));
+	}
+	term->history_total++;
+	term->ghost_text = NULL;
+	term->history[term->history_cnt - 1] = (char *)MY_MALLOC(len);
+	if (term->history[term->history_cnt - 1] == NULL) {
+		goto func_end;
+	}
+	term->history[term->history_cnt - 1][0] = '\0';
+	for (p_arg = args; p_arg != NULL; p_arg = p_arg->next) {
+		if (term->history[term->history_cnt - 1][0] != '\0') {
+			strcat(term->history[term->history_cnt - 1], " ");
+		}
+		strcatwithesc(term->history[term->history_cnt - 1], p_arg->content);
+	}
+	term_history_index_add(term, term->history[term->history_cnt - 1], term->history_total - 1);
+func_end:
+	return;
+}
+
+
+static int compare_keyword(const char *target, const char *content) {
+	size_t i = 0;
+
+	if (target == NULL || content == NULL) {
+		return MATCH_ALL;
+	}
+	for (i = 0; content[i] != '\0' && tolower((unsigned char)content[i]) == tolower((unsigned char)target[i]); i++); /* stop at first difference, content may be long */
+	if (content[i] != '\0') {
+		return MATCH_NONE;
+	}
+	return target[i] == '\0' ? MATCH_ALL : MATCH_PART;
+}
+
+static void term_output_complete_or_help(Terminal *term, TermWalk *walk) {
+	int i = 0, common_len = 0, tail_arglen = 0, start_pos = 0, end_pos = 0, completed = 0;
+	int word_width = 0, with_help = 0, rows = 0, cols = 0, words_len = 0, word_num = 0;
+	TermComplete *p_com = NULL;
+	TermArg *p_lastarg = NULL;
+	int executable = (walk->exec_num == 1);
+
+	if (walk->complete != NULL) {
+		common_len = (int)strlen(walk->complete->word);
+		// find common string for auto complete
+		for (p_com = walk->complete->next; (p_com != NULL) && (common_len > 0); p_com = p_com->next) {
+			while ((common_len > 0) && strncasecmp(walk->complete->word, p_com->word, common_len)) {
+				common_len--;
+			}
+		}
+		if (common_len > 0) {
+			tail_arglen = 0;
+			p_lastarg = NULL;
+			if (walk->args != NULL) {
+				for (p_lastarg = walk->args; p_lastarg->next != NULL; p_lastarg = p_lastarg->next);
+			}
+			if (p_lastarg && !walk->spacetail && walk->args != NULL) {
+				tail_arglen = strlen(p_lastarg->content);
+			}
+			if (tail_arglen > 0) { /* null arg for help */
+				start_pos = term->num - tail_arglen;
+				end_pos = start_pos + common_len;
+				if (common_len > tail_arglen || memcmp(term->line_command.content + start_pos, walk->complete->word, common_len)) {
+					term_edit_erase(term, start_pos, tail_arglen, 0);
+					term_edit_insert(term, start_pos, walk->complete->word, common_len, 0);
+					completed = 1;
+				} else if (common_len < tail_arglen) {
+					term_edit_erase(term, end_pos, tail_arglen - common_len, 0);
+				}
+				if (walk->complete->next == NULL) { /* only one match, add SPACE at the end of word */
+					term_edit_insert(term, end_pos, " ", 1, 0);
+					end_pos += 1;
+					completed = 1;
+				}
+				// printf("term->pos %d, start_pos %d, end_pos %d\n", term->pos, start_pos, end_pos);
+				term_refresh(term, end_pos, end_pos, start_pos);
+			}
+		}
+	}
+	if (completed == 0) { /* print help informations */
+		term_line_leave(term);
+		with_help = 0;
+		word_width = 0;
+		for (p_com = walk->complete; p_com != NULL; p_com = p_com->next) {
+			if (p_com->help != NULL && p_com->help[0] != '\0') {
+				with_help = 1;
+			}
+			if ((int)strlen(p_com->word) > word_width) {
+				word_width = strlen(p_com->word);
+			}
+		}
+		for (p_com = walk->hints; p_com != NULL; p_com = p_com->next) {
+			if (p_com->help != NULL && p_com->help[0] != '\0') {
+				with_help = 1;
+			}
+			if ((int)strlen(p_com->word) > word_width) {
+				word_width = strlen(p_com->word);
+			}
+		}
+		term_printf_inner(term, "\n");
+		if (with_help) { /* print word and help line by line */
+			for (p_com = walk->complete; p_com != NULL; p_com = p_com->next) {
+				term_color_set(term, TERM_FGCOLOR_BRIGHT_BLUE);
+				term_out_write(term, p_com->word, strlen(p_com->word));
+				term_color_set(term, TERM_COLOR_DEFAULT);
+				if (p_com->help != NULL) {
+					term_printf_inner(term, "%*s	 %s\n", word_width - strlen(p_com->word), "", p_com->help);
+				} else {
+					term_printf_inner(term, "\n"); /* show word only if help is NULL */
+				}
+			}
+			for (p_com = walk->hints; p_com != NULL; p_com = p_com->next) {
+				term_color_set(term, TERM_FGCOLOR_BRIGHT_CYAN);
+				term_out_write(term, p_com->word, strlen(p_com->word));
+				term_color_set(term, TERM_COLOR_DEFAULT);
+				if (p_com->help != NULL) {
+					term_printf_inner(term, "%*s	 %s\n", word_width - strlen(p_com->word), "", p_com->help);
+				} else {
+					term_printf_inner(term, "\n");
+				}
+			}
+		} else { /* only show words */
+			term_screen_get(term, &cols, &rows);
+			words_len = 0;
+			i = 0;
+			for (p_com = walk->complete; p_com != NULL; p_com = p_com->next, i++) {
+				if (i != 0) {
+					words_len += 2;
+				}
+				words_len += strlen(p_com->word);
+			}
+			for (p_com = walk->hints; p_com != NULL; p_com = p_com->next, i++) {
+				if (i != 0) {
+					words_len += 2;
+				}
+				words_len += strlen(p_com->word);
+			}
+			if (words_len <= cols) {
+				i = 0;
+				if (walk->complete != NULL) { /* blanks between words of same color are colored too */
+					term_color_set(term, TERM_FGCOLOR_BRIGHT_BLUE);
+				}
+				for (p_com = walk->complete; p_com != NULL; p_com = p_com->next, i++) {
+					if (i != 0) {
+						term_out_write(term, "  ", 2);
+					}
+					term_out_write(term, p_com->word, strlen(p_com->word));
+				}
+				if (walk->hints != NULL) {
+					term_color_set(term, TERM_FGCOLOR_BRIGHT_CYAN);
+				}
+				for (p_com = walk->hints; p_com != NULL; p_com = p_com->next, i++) {
+					if (i != 0) {
+						term_out_write(term, "  ", 2);
+					}
+					term_out_write(term, p_com->word, strlen(p_com->word));
+				}
+				term_color_set(term, TERM_COLOR_DEFAULT);
+				if (i != 0) {
+					term_printf_inner(term, "\n");
+				}
+			} else { /* print word as a table */
+				word_num = ((cols - word_width) / (word_width + 2)) + 1;
+				i = 0;
+				if (walk->complete != NULL) {
+					term_color_set(term, TERM_FGCOLOR_BRIGHT_BLUE);
+				}
+				for (p_com = walk->complete; p_com != NULL; p_com = p_com->next, i++) {
+					if (i % word_num == 0) {
+						term_printf_inner(term, "%s", i ? "\n" : "");
+					} else {
+						term_out_write(term, "  ", 2);
+					}
+					term_printf_inner(term, "%s%*s", p_com->word, (int)(word_width - strlen(p_com->word)), "");
+				}
+				if (walk->hints != NULL) {
+					term_color_set(term, TERM_FGCOLOR_BRIGHT_CYAN);
+				}
+				for (p_com = walk->hints; p_com != NULL; p_com = p_com->next, i++) {
+					if (i % word_num == 0) {
+						term_printf_inner(term, "%s", i ? "\n" : "");
+					} else {
+						term_out_write(term, "  ", 2);
+					}
+					term_printf_inner(term, "%s%*s", p_com->word, (int)(word_width - strlen(p_com->word)), "");
+				}
+				term_color_set(term, TERM_COLOR_DEFAULT);
+				if (i != 0) {
+					term_printf_inner(term, "\n");
+				}
+			}
+		} /* end only show words */
+		if (executable) {
+			term_printf_inner(term, "<CR>\n");
+		}
+		term_print_prompt(term);
+		term_refresh(term, term->num, term->num, 0); /* line_command is a gap buffer, not terminated by '\0' */
+	}
+}
+
+static TermNode *walk_dyn_options(TermWalk *walk, TermNode *selector);
+static TermNode *node_get_option(TermWalk *walk, TermNode *node) {
+	if (node->type != TYPE_SELECT && node->type != TYPE_MULSEL) {
+		return NULL;
+	}
+	if (node->dyn_option != NULL) {
+		return walk_dyn_options(walk, node);
+	}
+	return node->option;
+}
+static TermNode *node_get_unmasked_option(TermWalk *walk, TermNode *node, uint64_t mask) {
+	TermNode *cur = NULL;
+	if (node->selector == NULL || node->selector->type != TYPE_MULSEL) {
+		goto func_end;
+	}
+	for (cur = node_get_option(walk, node->selector); cur != NULL; cur = cur->next) {
+		if ((mask & (1 << cur->option_index)) == 0) {
+			break;
+		}
+	}
+func_end:
+	return cur;
+}
+/* node owns exec and flags of command */
+static TermNode *node_exec_owner(TermNode *node) {
+	if (node->selector != NULL && (node->selector->type == TYPE_SELECT || node->selector->type == TYPE_MULSEL)) {
+		return node->selector;
+	}
+	return node;
+}
+static TermExec node_executable(TermNode *node) {
+	return node_exec_owner(node)->exec;
+}
+
+static void node_free(TermNode *node) {
+	TermNode *p_node = NULL, *p_next = NULL;
+	for (p_node = node->children; p_node != NULL; p_node = p_next) {
+		p_next = p_node->next;
+		node_free(p_node);
+	}
+	for (p_node = node->option; p_node != NULL; p_node = p_next) {
+		p_next = p_node->next;
+		node_free(p_node);
+	}
+	MY_FREE(node->word);
+	if (node->help != NULL) {
+		MY_FREE(node->help);
+	}
+	MY_FREE(node);
+}
+
+/* options of selector generated once per walk, callback is called by walking thread */
+static TermNode *walk_dyn_options(TermWalk *walk, TermNode *selector) {
+	TermDynOptions *p_dyn = NULL;
+	TermNode *p_new = NULL, **pp = NULL;
+	char **word = NULL, **help = NULL;
+	int i = 0, num = 0, index = 0;
+	uint64_t stat_start = 0;
+
+	for (p_dyn = walk->dyn_options; p_dyn != NULL; p_dyn = p_dyn->next) {
+		if (p_dyn->selector == selector) {
+			return p_dyn->option;
+		}
+	}
+	p_dyn = (TermDynOptions *)MY_MALLOC(sizeof(TermDynOptions));
+	if (p_dyn == NULL) {
+		return NULL;
+	}
+	memset(p_dyn, 0x00, sizeof(TermDynOptions));
+	p_dyn->selector = selector;
+	p_dyn->next = walk->dyn_options;
+	walk->dyn_options = p_dyn;
+	STAT_START(stat_start);
+	selector->dyn_option(selector->dyn_option_udata, &word, &help, &num);
+	STAT_END(walk->term, TERM_STAT_DYN_OPTION, selector->word, stat_start);
+	for (i = 0, pp = &(p_dyn->option); i < num; i++) {
+		if (word[i] == NULL) {
+			continue;
+		}
+		p_new = (TermNode *)MY_MALLOC(sizeof(TermNode));
+		if (p_new == NULL) {
+			goto func_end;
+		}
+		memset(p_new, 0x00, sizeof(TermNode));
+		p_new->type = TYPE_KEY;
+		p_new->word = MY_STRDUP(word[i]);
+		if (help != NULL && help[i] != NULL) {
+			p_new->help = MY_STRDUP(help[i]);
+		}
+		p_new->selector = selector;
+		p_new->option_index = index++;
+		*pp = p_new;
+		pp = &(p_new->next);
+	}
+func_end:
+	if (word != NULL) {
+		for (i = 0; i < num; i++) {
+			free(word[i]);
+		}
+		free(word);
+	}
+	if (help != NULL) {
+		for (i = 0; i < num; i++) {
+			free(help[i]);
+		}
+		free(help);
+	}
+	return p_dyn->option;
+}
+
+static void term_walk_init(TermWalk *walk, Terminal *term, TermEvent event) {
+	memset(walk, 0x00, sizeof(TermWalk));
+	walk->term = term;
+	walk->event = event;
+	tt_buffer_init(&(walk->out));
+	tt_buffer_init(&(walk->filtered));
+}
+
+static void term_walk_free(TermWalk *walk) {
+	TermDynOptions *p_dyn = NULL;
+	TermNode *p_node = NULL, *p_next = NULL;
+
+	term_free_args(walk->args);
+	walk->args = NULL;
+	term_free_args(walk->pipe);
+	walk->pipe = NULL;
+	term_filters_free(walk->filters);
+	walk->filters = NULL;
+	tt_buffer_free(&(walk->filtered));
+	term_pending_free(walk);
+	term_complete_free(walk);
+	term_hints_free(walk);
+	for (p_dyn = walk->dyn_options; p_dyn != NULL; p_dyn = walk->dyn_options) {
+		walk->dyn_options = p_dyn->next;
+		for (p_node = p_dyn->option; p_node != NULL; p_node = p_next) {
+			p_next = p_node->next;
+			node_free(p_node);
+		}
+		MY_FREE(p_dyn);
+	}
+	tt_buffer_free(&(walk->out));
+}
+
+static void term_job_free(TermJob *job) {
+	term_argv_free(job->argc, job->argv);
+	if (job->command != NULL) {
+		MY_FREE(job->command);
+	}
+	if (job->path != NULL) {
+		MY_FREE(job->path);
+	}
+	MY_FREE(job);
+}
+
+static TermJobState term_job_state(Terminal *term, TermJob *job) {
+	TermJobState state = JOB_QUEUED;
+
+	pthread_mutex_lock(&(term->job_lock));
+	state = job->state;
+	pthread_mutex_unlock(&(term->job_lock));
+	return state;
+}
+
+/* free jobs finished, called by owner */
+static void term_jobs_reap(Terminal *term) {
+	TermJob **pp = NULL, *job = NULL;
+
+	for (pp = &(term->jobs); *pp != NULL;) {
+		job = *pp;
+		if (term_job_state(term, job) == JOB_DONE) {
+			*pp = job->next;
+			term_job_free(job);
+		} else {
+			pp = &(job->next);
+		}
+	}
+}
+
+/* job worker calls transport under job_lock only while terminal is not destroyed,
+ * term_destroy never waits jobs and owner of transport may free it once term_destroy returned.
+ * return 0 if output should be dropped, term_job_transport_done must be called otherwise */
+static int term_job_transport(Terminal *term) {
+	if (term_job_term != term) {
+		return 1;
+	}
+	pthread_mutex_lock(&(term->job_lock));
+	if (term->job_stop) {
+		pthread_mutex_unlock(&(term->job_lock));
+		return 0;
+	}
+	return 1;
+}
+static void term_job_transport_done(Terminal *term) {
+	if (term_job_term == term) {
+		pthread_mutex_unlock(&(term->job_lock));
+	}
+}
+
+static void *term_job_worker(void *arg) {
+	Terminal *term = (Terminal *)arg;
+	TermJob *job = NULL;
+	uint64_t stat_start = 0;
+	int last = 0;
+
+	term_job_term = term;
+	pthread_mutex_lock(&(term->job_lock));
+	while (1) {
+		while (term->job_queue_head == NULL && !term->job_stop) {
+			pthread_cond_wait(&(term->job_cond), &(term->job_lock));
+		}
+		if (term->job_stop) {
+			break;
+		}
+		job = term->job_queue_head;
+		term->job_queue_head = job->queue_next;
+		if (term->job_queue_head == NULL) {
+			term->job_queue_tail = NULL;
+		}
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&(term->job_lock));
+
+		term_job_current = job;
+		STAT_START(stat_start);
+		job->exec(term, job->argc, (const char **)job->argv); /* output is printed by owner through async queue */
+		STAT_END(term, TERM_STAT_EXEC, job->path, stat_start);
+		term_job_current = NULL;
+		if (!ATOMIC_LOAD_INT(&(job->fg))) {
+			term_printf(term, "[%d] %s  %s\n", job->id, ATOMIC_LOAD_INT(&(job->cancel)) ? "Cancelled" : "Done", job->command);
+		}
+
+		pthread_mutex_lock(&(term->job_lock));
+		job->state = JOB_DONE;
+		pthread_mutex_unlock(&(term->job_lock));
+		term_async_notify(term); /* wake up fg, term is valid until last worker exited */
+		pthread_mutex_lock(&(term->job_lock));
+	}
+	term->job_alive--;
+	last = term->job_alive == 0;
+	pthread_mutex_unlock(&(term->job_lock));
+	term_job_term = NULL;
+	if (last) { /* term_destroy returned while jobs were running */
+		term_free(term);
+	}
+	return NULL;
+}
+
+/* cancel all jobs and let workers exit without waiting them, jobs not started are dropped,
+ * return workers still running, the last of them frees terminal */
+static int term_jobs_stop(Terminal *term) {
+	int i = 0, alive = 0;
+	TermJob *job = NULL;
+
+	pthread_mutex_lock(&(term->job_lock));
+	term->job_stop = 1;
+	for (job = term->jobs; job != NULL; job = job->next) {
+		ATOMIC_STORE_INT(&(job->cancel), 1);
+	}
+	for (i = 0; i < term->job_started; i++) { /* before unlock, job_threads is freed with terminal by last worker */
+		pthread_detach(term->job_threads[i]);
+	}
+	alive = term->job_alive;
+	pthread_cond_broadcast(&(term->job_cond));
+	pthread_mutex_unlock(&(term->job_lock));
+	return alive;
+}
+
+/* free jobs and their workers, called by term_free after all workers exited */
+static void term_jobs_free(Terminal *term) {
+	TermJob *job = NULL;
+
+	if (term->job_threads != NULL) {
+		MY_FREE(term->job_threads);
+	}
+	for (job = term->jobs; job != NULL; job = term->jobs) {
+		term->jobs = job->next;
+		term_job_free(job);
+	}
+	pthread_cond_destroy(&(term->job_cond));
+	pthread_mutex_destroy(&(term->job_lock));
+}
+
+/* move argv of pending to a new job and queue it, return < 0 if failed and pending should run in place */
+static int term_job_start(Terminal *term, TermExecPending *pending) {
+	int i = 0;
+	size_t len = 0;
+	TermJob *job = NULL, *tail = NULL;
+
+	if (term->job_threads == NULL) {
+		term->job_threads = (pthread_t *)MY_MALLOC(sizeof(pthread_t) * term->job_workers);
+		if (term->job_threads == NULL) {
+			return -1;
+		}
+		for (i = 0; i < term->job_workers; i++) {
+			pthread_mutex_lock(&(term->job_lock));
+			term->job_alive++;
+			pthread_mutex_unlock(&(term->job_lock));
+			if (0 != pthread_create(&(term->job_threads[term->job_started]), NULL, term_job_worker, term)) {
+				pthread_mutex_lock(&(term->job_lock));
+				term->job_alive--;
+				pthread_mutex_unlock(&(term->job_lock));
+				break;
+			}
+			term->job_started++;
+		}
+	}
+	if (term->job_started == 0) {
+		return -1;
+	}
+	job = (TermJob *)MY_MALLOC(sizeof(TermJob));
+	if (job == NULL) {
+		return -1;
+	}
+	memset(job, 0x00, sizeof(TermJob));
+	for (i = 0; i < pending->argc; i++) {
+		len += strlen(pending->argv[i]) + 1;
+	}
+	job->command = (char *)MY_MALLOC(len + 1);
+	if (job->command == NULL) {
+		MY_FREE(job);
+		return -1;
+	}
+	job->command[0] = '\0';
+	for (i = 0; i < pending->argc; i++) {
+		if (i > 0) {
+			strcat(job->command, " ");
+		}
+		strcat(job->command, pending->argv[i]);
+	}
+	job->id = ++(term->job_id);
+	job->exec = pending->exec;
+	job->argc = pending->argc;
+	job->argv = pending->argv;
+	job->path = pending->path;
+	pending->argc = 0;
+	pending->argv = NULL;
+	pending->path = NULL;
+	term_jobs_reap(term);
+	if (term->jobs == NULL) {
+		term->jobs = job;
+	} else {
+		for (tail = term->jobs; tail->next != NULL; tail = tail->next);
+		tail->next = job;
+	}
+	term_printf_inner(term, "[%d] %s\n", job->id, job->command);
+
+	pthread_mutex_lock(&(term->job_lock));
+	job->state = JOB_QUEUED;
+	if (term->job_queue_tail == NULL) {
+		term->job_queue_head = job;
+	} else {
+		term->job_queue_tail->queue_next = job;
+	}
+	term->job_queue_tail = job;
+	pthread_cond_signal(&(term->job_cond));
+	pthread_mutex_unlock(&(term->job_lock));
+	return 0;
+}
+
+static void term_jobs_exec(Terminal *term, int argc, const char **argv) {
+	TermJob *job = NULL;
+	static const char *state_name[] = {"Queued", "Running", "Done"};
+
+	for (job = term->jobs; job != NULL; job = job->next) {
+		term_printf(term, "[%d] %s  %s\n", job->id, state_name[term_job_state(term, job)], job->command);
+	}
+	term_jobs_reap(term);
+}
+
+/* wait job in foreground, Ctrl+C set cancel token of job */
+static void term_fg_exec(Terminal *term, int argc, const char **argv) {
+	int id = 0;
+	ssize_t ret = 0;
+	char key = 0;
+	TermJob *job = NULL, *cur = NULL;
+
+	id = argc > 1 ? atoi(argv[1]) : 0;
+	for (cur = term->jobs; cur != NULL; cur = cur->next) {
+		if (id == 0 ? term_job_state(term, cur) != JOB_DONE : cur->id == id) {
+			job = cur; /* last job not done if id not set */
+		}
+	}
+	if (job == NULL) {
+		term_printf(term, "fg: no such job\n");
+		return;
+	}
+	ATOMIC_STORE_INT(&(job->fg), 1);
+	term_printf(term, "%s\n", job->command);
+	term_raw_set(term, 1); /* read Ctrl+C as key */
+	while (term_job_state(term, job) != JOB_DONE) {
+		term_async_drain(term);
+		if (term->in_pos < term->in_len) { /* typed ahead, read by term_getch */
+			key = term->in_buf[term->in_pos++];
+			ret = 1;
+		} else {
+			ret = term->read(term, &key, 1);
+		}
+		if (ret < 0) {
+			ATOMIC_STORE_INT(&(job->cancel), 1);
+			break;
+		}
+		if (ret > 0 && key == KEY_CTRL('C') && !ATOMIC_LOAD_INT(&(job->cancel))) {
+			ATOMIC_STORE_INT(&(job->cancel), 1);
+			term_printf(term, "^C\n");
+		}
+	}
+	term_async_drain(term);
+	term_raw_set(term, 0);
+	term_jobs_reap(term);
+}
+
+static void term_walk_write(TermWalk *walk, const void *buf, size_t count);
+
+static int term_getkey(Terminal *term);
+
+/* wait key at the bottom of page, SPACE for next page, ENTER for next line, q to cancel handler */
+static void term_pager_more(TermWalk *walk, int rows) {
+	int key = 0, raw = 0;
+	Terminal *term = walk->term;
+
+	term_printf_inner(term, "\033[7m--More--\033[0m");
+	raw = term->raw;
+	term_raw_set(term, 1);
+	while (1) {
+		key = term_getkey(term);
+		if (key == ' ' || key == KEY_PGDN) {
+			walk->pager_rows = 0;
+			break;
+		} else if (key == KEY_CR || key == KEY_LF || key == KEY_DOWN) {
+			walk->pager_rows = rows - 2;
+			break;
+		} else if (key == 'q' || key == 'Q' || key == KEY_CTRL('C') || key == KEY_EOF) {
+			walk->cancel = 1;
+			break;
+		}
+	}
+	term_raw_set(term, raw);
+	term_printf_inner(term, "\r\033[K");
+}
+
+/* write output to screen, handler is blocked while waiting key after one page, only rows of screen are counted */
+static void term_pager_write(TermWalk *walk, const char *buf, size_t count) {
+	int cols = 0, rows = 0, len = 0;
+	Terminal *term = walk->term;
+	const char *last = buf + count, *end = NULL;
+
+	term_screen_get(term, &cols, &rows);
+	while (buf < last) {
+		if (walk->pager_rows >= rows - 1) {
+			term_pager_more(walk, rows);
+			if (walk->cancel) {
+				return;
+			}
+		}
+		end = (const char *)memchr(buf, '\n', last - buf);
+		if (end == NULL) {
+			term_out_write(term, buf, last - buf);
+			walk->pager_col += (int)(last - buf);
+			walk->pager_rows += walk->pager_col / cols;
+			walk->pager_col %= cols;
+			return;
+		}
+		term_out_write(term, buf, end + 1 - buf);
+		len = walk->pager_col + (int)(end - buf);
+		walk->pager_rows += 1 + (len > 0 ? (len - 1) / cols : 0);
+		walk->pager_col = 0;
+		buf = end + 1;
+	}
+}
+
+/* write output of walk to its sink, into capture, stream, parent walk, or printed by owner of terminal */
+static void term_walk_emit(TermWalk *walk, const void *buf, size_t count) {
+	Terminal *term = walk->term;
+
+	if (count == 0) {
+		return;
+	}
+	if (walk->capture != NULL) {
+		tt_buffer_write(walk->capture, buf, count);
+	} else if (walk->stream != NULL) {
+		if (!walk->cancel && walk->stream(walk->stream_data, buf, count) < 0) {
+			walk->cancel = 1;
+		}
+	} else if (walk->parent != NULL) {
+		term_walk_write(walk->parent, buf, count);
+	} else if (term_is_owner(term)) {
+		if (walk->pager) {
+			term_pager_write(walk, (const char *)buf, count);
+		} else {
+			term_out_write(term, buf, count);
+		}
+	} else if (ATOMIC_LOAD_INT(&(term->owned))) {
+		term_async_write(term, buf, count); /* length based, NUL in output is kept */
+	} else { /* several threads may execute here at once, out_queue is left to owner */
+		term_direct_write(term, buf, count);
+	}
+}
+
+/* find literal pattern in line, memchr skips to candidates of first char */
+static int term_filter_find(const char *line, size_t len, const char *pattern, size_t pattern_len) {
+	const char *cur = line, *end = line + len;
+
+	if (pattern_len == 0) {
+		return 1;
+	}
+	while ((size_t)(end - cur) >= pattern_len) {
+		cur = (const char *)memchr(cur, pattern[0], end - cur - pattern_len + 1);
+		if (cur == NULL) {
+			return 0;
+		}
+		if (memcmp(cur + 1, pattern + 1, pattern_len - 1) == 0) {
+			return 1;
+		}
+		cur++;
+	}
+	return 0;
+}
+
+/* line[len] is changed to '\0' while matching by regex */
+static int term_filter_match(TermFilter *filter, char *line, size_t len) {
+#if !defined(_WIN32)
+	int ret = 0;
+	char saved = '\0';
+
+	if (!filter->literal) {
+		saved = line[len];
+		line[len] = '\0';
+		ret = (regexec(&(filter->regex), line, 0, NULL, 0) == 0);
+		line[len] = saved;
+		return ret;
+	}
+#endif
+	return term_filter_find(line, len, filter->pattern, filter->pattern_len);
+}
+
+/* pass one line through filters from filter, len includes '\n' if line has */
+static void term_filter_line(TermWalk *walk, TermFilter *filter, char *line, size_t len) {
+	size_t text_len = (len > 0 && line[len - 1] == '\n') ? len - 1 : len;
+
+	for (; filter != NULL; filter = filter->next) {
+		switch (filter->type) {
+			case FILTER_INCLUDE:
+				if (!term_filter_match(filter, line, text_len)) {
+					return;
+				}
+				break;
+			case FILTER_EXCLUDE:
+				if (term_filter_match(filter, line, text_len)) {
+					return;
+				}
+				break;
+			case FILTER_BEGIN:
+				if (!filter->begun && !(filter->begun = term_filter_match(filter, line, text_len))) {
+					return;
+				}
+				break;
+			case FILTER_COUNT:
+				filter->count++;
+				return;
+			default: ;
+		}
+	}
+	tt_buffer_write(&(walk->filtered), line, len);
+}
+
+/* pass complete lines in out through filters and write lines passed, last line without '\n' is kept until eof */
+static void term_filter_run(TermWalk *walk, int eof) {
+	int len = 0;
+	char *start = (char *)(walk->out.content), *last = start + walk->out.used, *end = NULL;
+	char count[64];
+	TermFilter *filter = NULL;
+
+	while (start < last && (end = (char *)memchr(start, '\n', last - start)) != NULL) {
+		term_filter_line(walk, walk->filters, start, end + 1 - start);
+		start = end + 1;
+	}
+	if (eof) {
+		if (start < last) {
+			term_filter_line(walk, walk->filters, start, last - start);
+			start = last;
+		}
+		for (filter = walk->filters; filter != NULL; filter = filter->next) { /* count is passed to filters after it */
+			if (filter->type == FILTER_COUNT) {
+				len = snprintf(count, sizeof(count), "Count: %" PRIu64 " lines\n", filter->count);
+				term_filter_line(walk, filter->next, count, len);
+			}
+		}
+	}
+	if (start > (char *)(walk->out.content)) {
+		walk->out.used = last - start;
+		memmove(walk->out.content, start, walk->out.used);
+		walk->out.content[walk->out.used] = '\0';
+	}
+	term_walk_emit(walk, walk->filtered.content, walk->filtered.used);
+	tt_buffer_empty(&(walk->filtered));
+}
+
+/* write output collected by walk, complete lines only if walk has filters */
+static void term_walk_flush(TermWalk *walk) {
+	if (walk->out.used == 0) {
+		return;
+	}
+	if (walk->filters != NULL) {
+		term_filter_run(walk, 0);
+		return;
+	}
+	term_walk_emit(walk, walk->out.content, walk->out.used);
+	tt_buffer_empty(&(walk->out));
+}
+
+/* write all output after handlers finished */
+static void term_walk_finish(TermWalk *walk) {
+	if (walk->filters != NULL) {
+		term_filter_run(walk, 1);
+	} else {
+		term_walk_flush(walk);
+	}
+}
+
+/* output of owner is flushed once handler printed, detached walk collect it in chunk */
+static size_t term_walk_flush_size(TermWalk *walk) {
+	if (!walk->detached) {
+		return 0;
+	}
+	return walk->stream != NULL ? STREAM_CHUNK_SIZE : BATCH_FLUSH_SIZE;
+}
+
+static void term_walk_write(TermWalk *walk, const void *buf, size_t count) {
+	if (walk->cancel) {
+		return;
+	}
+	if (walk->capture != NULL && walk->filters == NULL) {
+		tt_buffer_write(walk->capture, buf, count);
+		return;
+	}
+	tt_buffer_write(&(walk->out), buf, count);
+	if (walk->out.used >= term_walk_flush_size(walk)) {
+		term_walk_flush(walk);
+	}
+}
+
+/* format output of handler run by term_execute_* or filtered, no copy for capture */
+static int term_walk_vprintf(TermWalk *walk, const char *format, va_list args) {
+	int rc = 0;
+
+	if (walk->cancel) {
+		return 0;
+	}
+	if (walk->capture != NULL && walk->filters == NULL) {
+		return tt_buffer_vprintf(walk->capture, format, args);
+	}
+	rc = tt_buffer_vprintf(&(walk->out), format, args);
+	if (walk->out.used >= term_walk_flush_size(walk)) {
+		term_walk_flush(walk);
+	}
+	return rc;
+}
+
+/* run handlers with output collected by walk, for term_execute_*, filters and pager,
+ * EXEC_ASYNC is run in place if output is not written to screen directly */
+/* run handler of pending, timed per command if built with TERM_STATS */
+static void term_pending_exec(Terminal *term, TermExecPending *pending) {
+	uint64_t stat_start = 0;
+
+	STAT_START(stat_start);
+	pending->exec(term, pending->argc, (const char **)pending->argv);
+	STAT_END(term, TERM_STAT_EXEC, pending->path, stat_start);
+}
+
+static void term_pending_collect(Terminal *term, TermWalk *walk) {
+	TermExecPending *p_cur = NULL;
+
+	walk->parent = term_walk_detached(term);
+	term_walk_current = walk;
+	for (p_cur = walk->pending; p_cur != NULL; p_cur = p_cur->next) {
+		if (p_cur->async && !walk->detached && !term->script && walk->filters == NULL && term_job_start(term, p_cur) == 0) {
+			continue;
+		}
+		term_pending_exec(term, p_cur);
 	}
+	term_walk_current = walk->parent;
+	term_walk_finish(walk);
 }
 
-static TermNode *node_get_option(TermNode *node) {
-	if (node->type != TYPE_SELECT && node->type != TYPE_MULSEL) {
-		return NULL;
+/* run handlers matched by term_walk_tree */
+static void term_pending_run(Terminal *term, TermWalk *walk) {
+	int batch = 0, raw = 0;
+	TermEvent event = E_EVENT_NONE;
+	TermExecPending *p_cur = NULL;
+
+	if (walk->pending == NULL) {
+		return;
 	}
-	return node->option;
-}
-static TermNode *node_get_unmasked_option(TermNode *node, uint64_t mask) {
-	TermNode *cur = NULL;
-	if (node->selector == NULL || node->selector->type != TYPE_MULSEL) {
-		goto func_end;
+	if (walk->detached) { /* run in place by calling thread, terminal state is not touched */
+		term_pending_collect(term, walk);
+		term_pending_free(walk);
+		return;
 	}
-	for (cur = node->selector->option; cur != NULL; cur = cur->next) {
-		if ((mask & (1 << cur->option_index)) == 0) {
-			break;
+	event = term->event;
+	term->event = E_EVENT_EXEC;
+	if (term->script) { /* run in order, output is still collected */
+		if (walk->filters != NULL) {
+			term_pending_collect(term, walk);
+		} else {
+			for (p_cur = walk->pending; p_cur != NULL; p_cur = p_cur->next) {
+				term_pending_exec(term, p_cur);
+			}
 		}
+		term_pending_free(walk);
+		term->event = event;
+		return;
 	}
-func_end:
-	return cur;
-}
-static TermExec node_executable(TermNode *node) {
-	if (node->selector != NULL && (node->selector->type == TYPE_SELECT || node->selector->type == TYPE_MULSEL)) {
-		return node->selector->exec;
+	/* handler output is written directly, and handler may read input in cooked mode */
+	term_out_flush(term);
+	batch = term->batch;
+	term->batch = 0;
+	raw = term->raw;
+	term_raw_set(term, 0);
+	walk->pager = term->pager;
+	if (walk->filters != NULL || walk->pager) { /* lines passed filters are written by pager once handler printed */
+		term_pending_collect(term, walk);
+	} else {
+		for (p_cur = walk->pending; p_cur != NULL; p_cur = p_cur->next) {
+			if (p_cur->async && term_job_start(term, p_cur) == 0) {
+				continue;
+			}
+			term_pending_exec(term, p_cur);
+		}
 	}
-	return node->exec;
+	term_pending_free(walk);
+	term_raw_set(term, raw);
+	term->batch = batch;
+	term->event = event;
 }
 
-static void node_free(TermNode *node) {
-	TermNode *p_node = NULL, *p_next = NULL;
-	for (p_node = node->children; p_node != NULL; p_node = p_next) {
-		p_next = p_node->next;
-		node_free(p_node);
-	}
-	for (p_node = node->option; p_node != NULL; p_node = p_next) {
-		p_next = p_node->next;
-		node_free(p_node);
-	}
-	MY_FREE(node->word);
-	if (node->help != NULL) {
-		MY_FREE(node->help);
-	}
-	MY_FREE(node);
-}
+#ifdef TERM_STATS
+/* command of stacked for statistics, words of keys and selectors, names of texts in <> */
+static char *term_exec_path(WalkStacked *stacked, int deep) {
+	int i = 0;
+	size_t len = 0;
+	char *path = NULL;
+	TermNode *node = NULL;
 
-static void update_node_options(TermNode *selector, TermDynOptionCb dyncb, void *userdata) {
-	TermNode *p_node = NULL, *p_next = NULL;
-	char **word = NULL, **help = NULL;
-	int i = 0, num = 0;
-	for (p_node = selector->option; p_node != NULL; p_node = p_next) {
-		p_next = p_node->next;
-		node_free(p_node);
+	for (i = 0; i < deep + 1; i += (node->type == TYPE_SELECT || node->type == TYPE_MULSEL) ? 2 : 1) { /* skip options */
+		node = stacked[i].node;
+		len += strlen(node->word) + 3; /* SPACE and <> */
 	}
-	selector->option= NULL;
-	dyncb(userdata, &word, &help, &num);
-	for (i = 0; i < num; i++) {
-		if (term_node_option_add(selector, word[i], help != NULL ? help[i] : NULL) == NULL) {
-			goto func_end;
-		}
+	path = (char *)MY_MALLOC(len + 1);
+	if (path == NULL) {
+		return NULL;
 	}
-func_end:
-	if (word != NULL) {
-		for (i = 0; i < num; i++) {
-			free(word[i]);
+	path[0] = '\0';
+	for (i = 0; i < deep + 1; i += (node->type == TYPE_SELECT || node->type == TYPE_MULSEL) ? 2 : 1) {
+		node = stacked[i].node;
+		if (path[0] != '\0') {
+			strcat(path, " ");
 		}
-		free(word);
-	}
-	if (help != NULL) {
-		for (i = 0; i < num; i++) {
-			free(help[i]);
+		if (node->type == TYPE_TEXT) {
+			strcat(path, "<");
+			strcat(path, node->word);
+			strcat(path, ">");
+		} else {
+			strcat(path, node->word);
 		}
-		free(help);
 	}
-	return;
+	return path;
 }
-static void term_exec_run(Terminal *term, WalkStacked *stacked, int deep) {
+#endif
+
+static void term_exec_run(TermWalk *walk, WalkStacked *stacked, int deep) {
 	int i = 0, j = 0, argc = 0, mulsel_len = 0;
 	char **argv = NULL;
-	int *argv_alloced = NULL; /* argv is alloced or not */
 	uint64_t checked = 0;
 	TermNode *cur = NULL;
+	TermExecPending *p_new = NULL, *p_tail = NULL;
 	
-	term->exec_num++;
+	walk->exec_num++;
 
-	if (term->event != E_EVENT_EXEC) {
+	if (walk->event != E_EVENT_EXEC) {
 		goto func_end;
 	}
 	/* generate argv */
@@ -1177,18 +4025,26 @@ static void term_exec_run(Terminal *term, WalkStacked *stacked, int deep) {
 			argc++;
 		}
 	}
-	argv = (char **)malloc(sizeof(char *) * argc);
-	argv_alloced = (int *)malloc(sizeof(int) * argc);
-	memset(argv_alloced, 0x00, sizeof(int) * argc);
+	p_new = (TermExecPending *)MY_MALLOC(sizeof(TermExecPending));
+	if (p_new == NULL) {
+		goto func_end;
+	}
+	memset(p_new, 0x00, sizeof(TermExecPending));
+	argv = (char **)MY_MALLOC(sizeof(char *) * argc);
+	if (argv == NULL) {
+		MY_FREE(p_new);
+		goto func_end;
+	}
+	memset(argv, 0x00, sizeof(char *) * argc);
 	for (i = 0, j = 0; i < deep + 1; ) {
 		switch (stacked[i].node->type) {
-			case TYPE_TEXT: argv[j] = stacked[i].exec_argv; i++; j++; break;
-			case TYPE_KEY: argv[j] = stacked[i].node->word; i++; j++; break;
-			case TYPE_SELECT: argv[j] = stacked[i + 1].node->word; i += 2; j++; break; /* += 2 to skip options */
+			case TYPE_TEXT: argv[j] = MY_STRDUP(stacked[i].exec_argv); i++; j++; break;
+			case TYPE_KEY: argv[j] = MY_STRDUP(stacked[i].node->word); i++; j++; break;
+			case TYPE_SELECT: argv[j] = MY_STRDUP(stacked[i + 1].node->word); i += 2; j++; break; /* += 2 to skip options */
 			case TYPE_MULSEL:
 				/* calc mulsel_len */
 				checked = stacked[i].checked;
-				for (mulsel_len = 0, cur = stacked[i].node->option; checked != 0; cur = cur->next) {
+				for (mulsel_len = 0, cur = node_get_option(walk, stacked[i].node); checked != 0; cur = cur->next) {
 					if (checked & 1) {
 						if (mulsel_len > 0) {
 							mulsel_len += 1; /* join with '+' */
@@ -1199,11 +4055,15 @@ static void term_exec_run(Terminal *term, WalkStacked *stacked, int deep) {
 				}
 
 				/* join */
-				argv[j] = malloc(mulsel_len + 1); /* len + 1 for '\0' */
-				argv_alloced[j] = 1;
+				argv[j] = MY_MALLOC(mulsel_len + 1); /* len + 1 for '\0' */
+				if (argv[j] == NULL) {
+					i += 2;
+					j++;
+					break;
+				}
 				argv[j][0] = '\0';
 				checked = stacked[i].checked;
-				for (cur = stacked[i].node->option; checked != 0; cur = cur->next) {
+				for (cur = node_get_option(walk, stacked[i].node); checked != 0; cur = cur->next) {
 					if (checked & 1) {
 						if (argv[j][0] != '\0') {
 							strcat(argv[j], "+");
@@ -1219,63 +4079,111 @@ static void term_exec_run(Terminal *term, WalkStacked *stacked, int deep) {
 		}
 	}
 
-	/* run exec func */
-	node_executable(stacked[deep].node)(term, argc, (const char **)argv);
-
-	for (i = 0; i < argc; i++) {
-		if (argv_alloced[i]) {
-			free(argv[i]);
-		}
+	/* save exec func, run it after walk finished */
+	p_new->exec = node_executable(stacked[deep].node);
+	p_new->async = (node_exec_owner(stacked[deep].node)->flags & EXEC_ASYNC) != 0;
+#ifdef TERM_STATS
+	p_new->path = term_exec_path(stacked, deep);
+#endif
+	p_new->argc = argc;
+	p_new->argv = argv;
+	if (walk->pending == NULL) {
+		walk->pending = p_new;
+	} else {
+		for (p_tail = walk->pending; p_tail->next != NULL; p_tail = p_tail->next);
+		p_tail->next = p_new;
 	}
-	free(argv_alloced);
-	free(argv);
 func_end:
 	return;
 }
 #define WALK_DEBUG 0
-static void term_walk(Terminal *term) {
+/* match args of walk with tree, collect completion, help info and pending handlers, tree is not changed */
+/* record node matched against last arg, or NULL for executable found before it */
+static void term_walk_record(TermWalk *walk, TermNode *node) {
+	if (walk->record != NULL) {
+		tt_buffer_write(&(walk->record->visits), &node, sizeof(node));
+	}
+}
+
+/* same as term_walk_tree for completion, matches last arg against nodes recorded by walk with same args before it */
+static void term_walk_replay(TermWalk *walk, TermCompleteCache *cache) {
+	size_t i = 0;
+	int match = 0;
+	TermNode *node = NULL;
+	TermArg *arg = walk->tail;
+	uint64_t stat_start = 0;
+
+	STAT_START(stat_start);
+	walk->exec_num = 0;
+	for (i = 0; i < cache->visits.used; i += sizeof(node)) {
+		memcpy(&node, cache->visits.content + i, sizeof(node));
+		if (node == NULL) {
+			walk->exec_num++;
+		} else if (node->type == TYPE_KEY) {
+			if (arg == NULL) {
+				term_complete_add(walk, node->word, node->help);
+				continue;
+			}
+			match = compare_keyword(node->word, arg->content);
+			if (match != MATCH_NONE) {
+				term_complete_add(walk, node->word, node->help);
+			}
+			if (match == MATCH_ALL && node_executable(node) != NULL) {
+				walk->exec_num++;
+			}
+		} else {
+			term_hints_add(walk, node->word, node->help);
+			if (arg != NULL && node_executable(node) != NULL) {
+				walk->exec_num++;
+			}
+		}
+	}
+	STAT_END(walk->term, TERM_STAT_WALK, NULL, stat_start);
+}
+
+static void term_walk_tree(TermWalk *walk) {
 	int match = 0, deep = 0;
 	WalkStacked stacked[WALK_MAX_DEEP];
 	TermNode *node = NULL, *next = NULL;
 	TermArg *arg = NULL;
+	uint64_t stat_start = 0;
 
-	term->exec_num = 0;
+	STAT_START(stat_start);
+	walk->exec_num = 0;
 
 	memset(&stacked, 0x00, sizeof(stacked));
-	stacked[0].node = term->root->children;
-	stacked[0].arg = term->command_args;
+	stacked[0].node = walk->term->root->children;
+	stacked[0].arg = walk->args;
 
 	/* walk all nodes */
 	while (1) {
 		node = stacked[deep].node;
 		arg = stacked[deep].arg;
-		if (node->dyn_option != NULL) {
-			update_node_options(node, node->dyn_option, node->dyn_option);
-		}
 #if WALK_DEBUG
 		printf("deep:%d, arg:%s =? %s\n", deep, arg ? arg->content : "null", node ? node->word : "null");
 #endif
 		match = MATCH_NONE;
 
-		if ((node->type == TYPE_SELECT || node->type == TYPE_MULSEL) && node_get_option(node) != NULL) { /* process children in selector */
+		if ((node->type == TYPE_SELECT || node->type == TYPE_MULSEL) && node_get_option(walk, node) != NULL) { /* process children in selector */
 			if (stacked[deep].optional == 0) {
 				stacked[deep].walked = 0;
 				stacked[deep].checked = 0;
-				stacked[deep + 1].node = node_get_option(node);
+				stacked[deep + 1].node = node_get_option(walk, node);
 				stacked[deep + 1].arg = arg;
 				deep++;
 				continue;
 			} else {
 				if (arg == NULL) {
-					stacked[deep + 1].node = node_get_option(node);
+					stacked[deep + 1].node = node_get_option(walk, node);
 					stacked[deep + 1].arg = arg;
 					deep++;
-					term_exec_run(term, stacked, deep);
+					term_walk_record(walk, NULL);
+					term_exec_run(walk, stacked, deep);
 					memset(&stacked[deep], 0x00, sizeof(WalkStacked));
 					deep--;
 				}
 				if (node->children != NULL) {
-					stacked[deep + 1].node = node_get_option(node);
+					stacked[deep + 1].node = node_get_option(walk, node);
 					stacked[deep + 1].arg = arg;
 					deep++;
 					stacked[deep + 1].node = node->children;
@@ -1288,20 +4196,23 @@ static void term_walk(Terminal *term) {
 		if (node->selector != NULL && node->selector->type == TYPE_MULSEL) {
 			stacked[deep - 1].walked |= (1 << node->option_index);
 		}
+		if (arg == walk->tail && (node->type == TYPE_KEY || node->type == TYPE_TEXT)) {
+			term_walk_record(walk, node);
+		}
 
 		switch (node->type) {
 			case TYPE_KEY:
 				if (arg == NULL) {
 					 /* is last arg of input */
 					match = MATCH_ALL;
-					term_complete_add(term, node->word, node->help);
+					term_complete_add(walk, node->word, node->help);
 					break; /* break switch */
 				}
 				match = compare_keyword(node->word, arg->content);
 				if (match != MATCH_NONE) {
 					if (arg->next == NULL) {
-						if (!term->spacetail) { /* need complete or print hellp */
-							term_complete_add(term, node->word, node->help);
+						if (!walk->spacetail) { /* need complete or print hellp */
+							term_complete_add(walk, node->word, node->help);
 						}
 					}
 				}
@@ -1310,29 +4221,32 @@ static void term_walk(Terminal *term) {
 				match = MATCH_ALL;
 				if (arg == NULL) {
 					 /* is last arg of input */
-					term_hints_add(term, node->word, node->help);
+					term_hints_add(walk, node->word, node->help);
 					break; /* break switch */
 				}
 				stacked[deep].exec_argv = arg->content;
 				if (arg->next == NULL) {
-					if (!term->spacetail) { /* need complete or print help */
-						term_hints_add(term, node->word, node->help);
+					if (!walk->spacetail) { /* need complete or print help */
+						term_hints_add(walk, node->word, node->help);
 					}
 				}
 				break;
 			default: ;
 		}
 #if WALK_DEBUG
-		printf("match %d %d\n", match, arg != NULL && (arg->next || term->spacetail));
+		printf("match %d %d\n", match, arg != NULL && (arg->next || walk->spacetail));
 #endif
 		if (match == MATCH_ALL && arg != NULL) {
 			if (node->selector != NULL && node->selector->type == TYPE_MULSEL) {
 				stacked[deep - 1].checked |= (1 << node->option_index);
 			}
 			if (node_executable(node) != NULL && arg->next == NULL) {
-				term_exec_run(term, stacked, deep);
+				if (arg != walk->tail) {
+					term_walk_record(walk, NULL);
+				}
+				term_exec_run(walk, stacked, deep);
 			}
-			if (arg->next != NULL || term->spacetail) {
+			if (arg->next != NULL || walk->spacetail) {
 				/* current match, and need check children */
 				if (node->selector != NULL) { /* is option in TYPE_SELECT or TYPE_MULSEL */
 					if (node->selector->type == TYPE_SELECT) {
@@ -1373,7 +4287,7 @@ static void term_walk(Terminal *term) {
 			stacked[deep].walked = ~0;
 			next = node;
 		} else if (node->selector != NULL && node->selector->type == TYPE_MULSEL) {
-			next = node_get_unmasked_option(node, stacked[deep - 1].walked);
+			next = node_get_unmasked_option(walk, node, stacked[deep - 1].walked);
 		} else {
 			next = node->next;
 		}
@@ -1391,7 +4305,7 @@ static void term_walk(Terminal *term) {
 				stacked[deep].walked = ~0;
 				next = node;
 			} else if (node->selector != NULL && node->selector->type == TYPE_MULSEL) { /* one option in mulsel walked */
-				next = node_get_unmasked_option(node, stacked[deep - 1].walked);
+				next = node_get_unmasked_option(walk, node, stacked[deep - 1].walked);
 			} else {
 				next = node->next;
 			}
@@ -1402,26 +4316,131 @@ static void term_walk(Terminal *term) {
 		stacked[deep].node = next;
 	}
 	/* all nodes walked */
+	STAT_END(walk->term, TERM_STAT_WALK, NULL, stat_start);
+}
+
+static void term_walk(Terminal *term, TermWalk *walk) {
+	TermArg **pp = NULL;
+
+	if (walk->pipe_error == NULL) {
+		term_walk_tree(walk);
+	}
 
 	/* maybe found completion and help info */
-	if (term->event == E_EVENT_COMPLETE) {
-		term_output_complete_or_help(term);
-	} else if (term->event == E_EVENT_EXEC) {
-		term_history_add(term);
-		if (term->exec_num == 0) {
-			printf("command not found.\n");
-		} else if (term->exec_num > 1) {
-			printf("WARN: %d commands executed.\n", term->exec_num);
+	if (walk->event == E_EVENT_COMPLETE) {
+		term_output_complete_or_help(term, walk);
+	} else if (walk->event == E_EVENT_EXEC) {
+		term_pending_run(term, walk);
+		for (pp = &(walk->args); *pp != NULL; pp = &((*pp)->next));
+		*pp = walk->pipe; /* join pipe for history */
+		term_history_add(term, walk->args);
+		*pp = NULL;
+		if (walk->pipe_error != NULL) {
+			term_printf_inner(term, "invalid pipe, %s.\n", walk->pipe_error);
+		} else if (walk->exec_num == 0) {
+			term_printf_inner(term, "command not found.\n");
+		} else if (walk->exec_num > 1) {
+			term_printf_inner(term, "WARN: %d commands executed.\n", walk->exec_num);
 		}
 		if (!term->exit_flag) {
 			term_print_prompt(term);
 			term_refresh(term, 0, 0, 0);
 		}
 	}
-	term->event = E_EVENT_NONE;
+}
+
+/* TAB: parse args changed since last TAB, and replay last walk if only last arg changed */
+static void term_complete_walk(Terminal *term, TermWalk *walk) {
+	int kept = 0, num = 0, offset = 0, prefix = 0;
+	int version = ATOMIC_LOAD_INT(&term_tree_version); /* read before walk, a change while walking drops the record */
+	char *line = NULL;
+	TermArg **pp = NULL, *p_arg = NULL;
+	TermCompleteCache *cache = &(term->complete_cache);
+
+	if (term->multiline) { /* args are parsed with prefix */
+		term_complete_cache_reset(term);
+		term_split_args(term, walk);
+		term_walk(term, walk);
+		return;
+	}
+	line = term_line_join(term);
+	for (pp = &(cache->args); *pp != NULL && (*pp)->end < term->line_dirty; pp = &((*pp)->next)) {
+		offset = (*pp)->end;
+		kept++;
+	}
+	term_free_args(*pp);
+	*pp = NULL;
+	walk->spacetail = kept > 0; /* char at end of kept arg is SPACE, line is changed after it */
+	term_args_parse(walk, line + offset);
+	for (p_arg = walk->args; p_arg != NULL; p_arg = p_arg->next) {
+		p_arg->end += offset;
+	}
+	*pp = walk->args;
+	walk->args = cache->args;
+	cache->args = NULL;
+	term->line_dirty = term->num;
+
+	for (p_arg = walk->args; p_arg != NULL; p_arg = p_arg->next) {
+		num++;
+		walk->tail = p_arg;
+	}
+	if (walk->spacetail) {
+		walk->tail = NULL;
+	}
+	prefix = walk->tail != NULL ? num - 1 : num;
+	if (cache->prefix == prefix && kept >= prefix && cache->tail_null == (walk->tail == NULL)
+		&& cache->root == term->root && cache->version == version) {
+		term_walk_replay(walk, cache);
+		term_output_complete_or_help(term, walk);
+	} else {
+		tt_buffer_empty(&(cache->visits));
+		walk->record = cache;
+		term_walk(term, walk);
+		walk->record = NULL;
+		if (walk->dyn_options == NULL) { /* options of callback may change at next TAB */
+			cache->prefix = prefix;
+			cache->tail_null = walk->tail == NULL;
+			cache->root = term->root;
+			cache->version = version;
+		} else {
+			cache->prefix = -1;
+		}
+	}
+	cache->args = walk->args; /* nodes are not changed by completion */
+	walk->args = NULL;
+}
 
-	term_complete_free(term);
-	term_hints_free(term);
+/* run args of walk only if one command matched, walk again for help info if none matched */
+static TermExecStatus term_execute_args(Terminal *term, TermWalk *walk) {
+	int spacetail = walk->spacetail;
+	TermExecStatus status = E_EXEC_NOT_FOUND;
+
+	if (walk->pipe_error != NULL) {
+		return E_EXEC_INVALID_PIPE;
+	}
+	walk->event = E_EVENT_EXEC;
+	term_walk_tree(walk);
+	if (walk->exec_num == 1) {
+		term_pending_run(term, walk);
+		status = E_EXEC_DONE;
+	} else if (walk->exec_num > 1) {
+		term_pending_free(walk);
+		status = E_EXEC_AMBIGUOUS;
+	} else { /* children of last arg will be walked with space tail, found if command is prefix of others */
+		term_complete_free(walk);
+		term_hints_free(walk);
+		walk->event = E_EVENT_COMPLETE;
+		walk->spacetail = 1;
+		term_walk_tree(walk);
+		if (walk->exec_num > 0 || walk->complete != NULL || walk->hints != NULL) {
+			status = E_EXEC_INCOMPLETE;
+		}
+		walk->spacetail = spacetail;
+		walk->event = E_EVENT_EXEC;
+	}
+	term_complete_free(walk);
+	term_hints_free(walk);
+	return status;
 }
 
 void term_exit(Terminal *term) {
@@ -1429,18 +4448,27 @@ void term_exit(Terminal *term) {
 }
 
 static const char *term_getline_inner(Terminal *term, const char *prefix, int mask) {
-	int key = 0;
+	int key = 0, old_raw = 0, old_suggest = term->suggest, old_highlight = term->highlight;
+	char ch = 0;
 	char *old_prompt = NULL;
 	unsigned int old_color = 0;
 	old_prompt = MY_STRDUP(term->prompt);
 	old_color = term->prompt_color;
+	old_raw = term->raw;
+	term_raw_set(term, 1);
 	term_prompt_set(term, prefix);
 	term_prompt_color_set(term, TERM_COLOR_DEFAULT);
 	term->mask = mask;
+	term->suggest = 0; /* input of getline is not a command */
+	term->highlight = 0;
+	term_edit_reset(term); /* line of getline is not recorded */
+	term_out_begin(term);
 	term_print_prompt(term);
 	term_refresh(term, 0, 0, 0);
+	term_out_end(term);
 	while (1) { /* loop once every key press */
 		key = term_getkey(term);
+		term_out_begin(term);
 		switch (key) {
 			/* move */
 			case KEY_LEFT:
@@ -1451,22 +4479,21 @@ static const char *term_getline_inner(Terminal *term, const char *prefix, int ma
 				break;
 			case KEY_RIGHT:
 			case KEY_CTRL('F'):
-				if (term->pos < (int)(term->line_command.used)) {
+				if (term->pos < term->num) {
 					term_refresh(term, term->pos + 1, term->num, -1);
 				}
 				break;
 			/* edit */
 			case KEY_BACKSPACE: // Delete char to left of cursor
 				if (term->pos > 0) {
-					memmove(term->line_command.content + term->pos - 1, term->line_command.content + term->pos, term->line_command.used - term->pos + 1);
+					term_line_erase(term, term->pos - 1, 1);
 					term_refresh(term, term->pos - 1, term->num - 1, term->pos - 1);
 				}
 				break;
 			case KEY_DELETE: // Delete character under cursor
 			case KEY_CTRL('D'):
-				if (term->pos < (int)(term->line_command.used)) {
-					memmove(term->line_command.content + term->pos, term->line_command.content + term->pos + 1, term->line_command.used - term->pos);
-					term->line_command.used -= 1;
+				if (term->pos < term->num) {
+					term_line_erase(term, term->pos, 1);
 					term_refresh(term, term->pos, term->num - 1, term->pos);
 				}
 				break;
@@ -1476,7 +4503,7 @@ static const char *term_getline_inner(Terminal *term, const char *prefix, int ma
 				if (term->line != NULL) {
 					MY_FREE(term->line);
 				}
-				term->line = MY_STRDUP((char *)term->line_command.content);
+				term->line = MY_STRDUP(term_line_join(term));
 				goto func_end;
 			case KEY_CTRL('C'):
 				if (term->num > 0) {
@@ -1493,197 +4520,528 @@ static const char *term_getline_inner(Terminal *term, const char *prefix, int ma
 					goto func_end;
 				}
 				break;
+			case KEY_EOF:
+				if (term->line != NULL) {
+					MY_FREE(term->line);
+					term->line = NULL;
+				}
+				goto func_end;
 			default:
 				if (key >= ' ' && key <= '~') { /* key value may be too large, must not use isprint(key) */
-					tt_buffer_swapto_malloced(&(term->line_command), 1);  /* malloc for complete SPACE */
-					memmove(term->line_command.content + term->pos + 1, term->line_command.content + term->pos, term->num - term->pos);
-					*(term->line_command.content + term->pos) = (char)key;
+					ch = (char)key;
+					term_line_insert(term, term->pos, &ch, 1);
 					term_refresh(term, term->pos + 1, term->num + 1, term->pos);
 				} else {
 					// printf("unhandler key: %08x\n", key);
 				}
 				break;
 		} /* end of switch(key) */
+		term_out_end(term);
 	}
 func_end:
+	term_out_end(term); /* every goto func_end is between term_out_begin and term_out_end */
+	term_raw_set(term, old_raw);
 	term_prompt_set(term, old_prompt);
 	MY_FREE(old_prompt);
 	term_prompt_color_set(term, old_color);
 	term->mask = 0;
+	term->suggest = old_suggest;
+	term->highlight = old_highlight;
 	return term->line;
 }
 
-int term_loop(Terminal *term) {
-	int key = 0;
+/* process one key in term_loop, return < 0 if need exit loop.
+ * line changed by typed chars is drawn once after all keys read ahead are processed */
+static int term_key_process(Terminal *term, int key) {
+	int ret = 0, typed = 0;
 	int length = 0, new_pos = 0;
+	char ch = 0;
+	uint64_t trace_start = 0, trace_tab = 0;
+	TermWalk walk;
 
-	term_print_prompt(term);
-	term_refresh(term, 0, 0, 0);
-	while (1) { /* loop once every key press */
-		key = term_getkey(term);
-		switch (key) {
-			/* move */
-			case KEY_LEFT:
-			case KEY_CTRL('B'):
-				if (term->pos > 0) {
-					term_refresh(term, term->pos - 1, term->num, -1);
-				}
-				break;
-			case KEY_RIGHT:
-			case KEY_CTRL('F'):
-				if (term->pos < (int)(term->line_command.used)) {
-					term_refresh(term, term->pos + 1, term->num, -1);
-				}
-				break;
-			case KEY_CTRL('A'): // Move cursor to start of line.
-			case KEY_HOME:
-				term_refresh(term, 0, term->num, -1);
-				break;
-			case KEY_CTRL('E'): // Move cursor to end of line
-			case KEY_END:
+	if (term->trace != NULL) {
+		trace_start = term_time_us();
+	}
+	term_out_begin(term);
+	typed = (key >= ' ' && key <= '~') || key == KEY_BACKSPACE;
+	if (!typed) { /* other keys work on line and suggestion on screen */
+		term_refresh_flush(term);
+	}
+	term->refresh_defer = typed;
+	switch (key) {
+		/* move */
+		case KEY_LEFT:
+		case KEY_CTRL('B'):
+			if (term->pos > 0) {
+				term_refresh(term, term->pos - 1, term->num, -1);
+			}
+			break;
+		case KEY_RIGHT:
+		case KEY_CTRL('F'):
+			if (term->pos < term->num) {
+				term_refresh(term, term->pos + 1, term->num, -1);
+			} else if (term->ghost > 0) { // Accept suggestion
+				term_ghost_accept(term);
+			}
+			break;
+		case KEY_CTRL('A'): // Move cursor to start of line.
+		case KEY_HOME:
+			term_refresh(term, 0, term->num, -1);
+			break;
+		case KEY_CTRL('E'): // Move cursor to end of line
+		case KEY_END:
+			if (term->ghost > 0) { // Accept suggestion
+				term_ghost_accept(term);
+			} else {
 				term_refresh(term, term->num, term->num, -1);
-				break;
-			case KEY_ALT('b'):	// Move back a word.
-			case KEY_ALT('B'):
-			case KEY_ALT(KEY_LEFT):
-			case KEY_CTRL(KEY_LEFT):
-				if (term->pos > 0) {
-					for (new_pos = term->pos; (new_pos > 0) && isdelimiter(*(term->line_command.content + new_pos - 1)); new_pos--);
-					for (; (new_pos > 0) && !isdelimiter(*(term->line_command.content + new_pos - 1)); new_pos--);
-					term_refresh(term, new_pos, term->num, -1);
-				}
-				break;
-			case KEY_ALT('f'):	 // Move forward a word.
-			case KEY_ALT('F'):
-			case KEY_ALT(KEY_RIGHT):
-			case KEY_CTRL(KEY_RIGHT):
-				if (term->pos < term->num) {
-					for (new_pos = term->pos; (new_pos < term->num) && isdelimiter(*(term->line_command.content + new_pos)); new_pos++);
-					for (; (new_pos < term->num) && !isdelimiter(*(term->line_command.content + new_pos)); new_pos++);
-					for (; (new_pos < term->num) && isdelimiter(*(term->line_command.content + new_pos)); new_pos++);
-					term_refresh(term, new_pos, term->num, -1);
-				}
-				break;
+			}
+			break;
+		case KEY_ALT('b'):	// Move back a word.
+		case KEY_ALT('B'):
+		case KEY_ALT(KEY_LEFT):
+		case KEY_CTRL(KEY_LEFT):
+			if (term->pos > 0) {
+				for (new_pos = term->pos; (new_pos > 0) && isdelimiter(term_line_at(term, new_pos - 1)); new_pos--);
+				for (; (new_pos > 0) && !isdelimiter(term_line_at(term, new_pos - 1)); new_pos--);
+				term_refresh(term, new_pos, term->num, -1);
+			}
+			break;
+		case KEY_ALT('f'):	 // Move forward a word.
+		case KEY_ALT('F'):
+		case KEY_ALT(KEY_RIGHT):
+		case KEY_CTRL(KEY_RIGHT):
+			if (term->pos < term->num) {
+				for (new_pos = term->pos; (new_pos < term->num) && isdelimiter(term_line_at(term, new_pos)); new_pos++);
+				for (; (new_pos < term->num) && !isdelimiter(term_line_at(term, new_pos)); new_pos++);
+				for (; (new_pos < term->num) && isdelimiter(term_line_at(term, new_pos)); new_pos++);
+				term_refresh(term, new_pos, term->num, -1);
+			}
+			break;
 
-			/* history */
-			case KEY_UP:
-			case KEY_DOWN:
-				if (key == KEY_UP) {
-					if (term->history_cur == -1) {
-						term->history_cur = term->history_cnt - 1;
-					} else {
-						term->history_cur -= 1;
-					}
+		/* history */
+		case KEY_UP:
+		case KEY_DOWN:
+			if (key == KEY_UP) {
+				if (term->history_cur == -1) {
+					term->history_cur = term->history_cnt - 1;
 				} else {
-					if (term->history_cur + 1 >= term->history_cnt) {
-						term->history_cur = -1;
-					} else {
-						term->history_cur += 1;
-					}
+					term->history_cur -= 1;
 				}
-				if (term->history_cur != -1) {
-					term->line_command.used = 0;
-					term_command_write(term, term->history[term->history_cur], strlen(term->history[term->history_cur]));
-					length = term->line_command.used;
-					term_refresh(term, length, length, 0);
+			} else {
+				if (term->history_cur + 1 >= term->history_cnt) {
+					term->history_cur = -1;
 				} else {
-					term_refresh(term, 0, 0, 0);
+					term->history_cur += 1;
 				}
-				break;
+			}
+			term_edit_erase(term, 0, term->num, 0);
+			if (term->history_cur != -1) {
+				length = strlen(term->history[term->history_cur]);
+				term_edit_insert(term, 0, term->history[term->history_cur], length, 0);
+				term_refresh(term, length, length, 0);
+			} else {
+				term_refresh(term, 0, 0, 0);
+			}
+			break;
 
-			/* complete */
-			case KEY_TAB:		// Autocomplete (same with KEY_CTRL('I'))
-				term->event = E_EVENT_COMPLETE;
-				term_split_args(term);
-				term_walk(term);
-				break;
+		/* complete */
+		case KEY_TAB:		// Autocomplete (same with KEY_CTRL('I'))
+			if (term->trace != NULL) {
+				trace_tab = term_time_us();
+			}
+			term_walk_init(&walk, term, E_EVENT_COMPLETE);
+			term_complete_walk(term, &walk);
+			term_walk_free(&walk);
+			if (term->trace != NULL) {
+				term_trace_add(term, TERM_TRACE_COMPLETE, trace_tab, (uint32_t)term->num);
+			}
+			break;
 
-			/* edit */
-			case KEY_BACKSPACE: // Delete char to left of cursor
-				if (term->pos > 0) {
-					memmove(term->line_command.content + term->pos - 1, term->line_command.content + term->pos, term->line_command.used - term->pos + 1);
-					term_refresh(term, term->pos - 1, term->num - 1, term->pos - 1);
-				}
-				break;
-			case KEY_DELETE: // Delete character under cursor
-			case KEY_CTRL('D'):
-				if (term->pos < (int)(term->line_command.used)) {
-					memmove(term->line_command.content + term->pos, term->line_command.content + term->pos + 1, term->line_command.used - term->pos);
-					term->line_command.used -= 1;
-					term_refresh(term, term->pos, term->num - 1, term->pos);
-				} else if ((0 == term->line_command.used) && (key == KEY_CTRL('D'))) { // If an empty line, EOF
-					term_printf_inner(term, "exit because Ctrl+D\n");
-					goto func_end;
+		/* edit */
+		case KEY_CTRL('_'): // Undo
+			term_edit_apply(term, 0);
+			break;
+		case KEY_ALT('_'): // Redo
+			term_edit_apply(term, 1);
+			break;
+		case KEY_BACKSPACE: // Delete char to left of cursor
+			if (term->pos > 0) {
+				term_edit_erase(term, term->pos - 1, 1, 1);
+				term_refresh(term, term->pos - 1, term->num - 1, term->pos - 1);
+			}
+			break;
+		case KEY_DELETE: // Delete character under cursor
+		case KEY_CTRL('D'):
+			if (term->pos < term->num) {
+				term_edit_erase(term, term->pos, 1, 1);
+				term_refresh(term, term->pos, term->num - 1, term->pos);
+			} else if ((0 == term->num) && (key == KEY_CTRL('D'))) { // If an empty line, EOF
+				term_line_leave(term);
+				term_printf_inner(term, "exit because Ctrl+D\n");
+				ret = -1;
+			}
+			break;
+		case KEY_CR:
+		case KEY_LF:
+			term_line_leave(term);
+			term_printf_inner(term, "\n");
+			term_edit_reset(term);
+			term_walk_init(&walk, term, E_EVENT_EXEC);
+			if (term->num > 0) {
+				if (term_split_args(term, &walk) == 0) {
+					term_walk(term, &walk);
+				} else {
+					term_print_prompt(term);
+					term_refresh(term, 0, 0, 0);
 				}
-				break;
-			case KEY_CR:
-			case KEY_LF:
-				term_printf_inner(term, "\n");
-				if (term->line_command.used > 0) {
-					if (term_split_args(term) == 0) {
-						term->event = E_EVENT_EXEC;
-						term_walk(term);
-					} else {
-						term_print_prompt(term);
-						term_refresh(term, 0, 0, 0);
-					}
+			} else {
+				if (term->multiline && term_split_args(term, &walk) == 0) { /* function need return while in multiline mode */
+					term_walk(term, &walk);
 				} else {
-					if (term->multiline && term_split_args(term) == 0) { /* function need return while in multiline mode */
-						term->event = E_EVENT_EXEC;
-						term_walk(term);
-					} else {
-						term_print_prompt(term);
-						term_refresh(term, 0, 0, 0);
-					}
+					term_print_prompt(term);
+					term_refresh(term, 0, 0, 0);
 				}
-				term->history_cur = -1;
-				break;
-			case KEY_CTRL('C'):
-			case KEY_CTRL('G'):
-				if (term->multiline) {
-					term->multiline = 0;
+			}
+			term_walk_free(&walk);
+			term->history_cur = -1;
+			break;
+		case KEY_CTRL('C'):
+		case KEY_CTRL('G'):
+			term_line_leave(term);
+			term_edit_reset(term);
+			if (term->multiline) {
+				term->multiline = 0;
+				term_printf_inner(term, "%s\n", (key == KEY_CTRL('C')) ? "^C" : "^G");
+				tt_buffer_empty(&(term->prefix));
+				term_print_prompt(term);
+				term_refresh(term, 0, 0, 0);
+			} else {
+				if (term->num > 0) {
 					term_printf_inner(term, "%s\n", (key == KEY_CTRL('C')) ? "^C" : "^G");
-					tt_buffer_empty(&(term->prefix));
 					term_print_prompt(term);
 					term_refresh(term, 0, 0, 0);
 				} else {
-					if (term->num > 0) {
-						term_printf_inner(term, "%s\n", (key == KEY_CTRL('C')) ? "^C" : "^G");
-						term_print_prompt(term);
-						term_refresh(term, 0, 0, 0);
-					} else {
-						term_printf_inner(term, "exit because Ctrl+%s\n", (key == KEY_CTRL('C')) ? "C" : "G");
-						goto func_end;
-					}
+					term_printf_inner(term, "exit because Ctrl+%s\n", (key == KEY_CTRL('C')) ? "C" : "G");
+					ret = -1;
 				}
+			}
+			break;
+		case KEY_CTRL('Z'):
+#if defined(_WIN32)
+			term_line_leave(term);
+			term_printf_inner(term, "exit because Ctrl+Z\n");
+			ret = -1;
+#else
+			if (term->local) { /* never stop the process for remote session */
+				term_line_leave(term);
+				term_out_flush(term);
+				term_raw_set(term, 0);
+				raise(SIGSTOP);
+				term_raw_set(term, 1);
+			}
+#endif
+			break;
+		case KEY_EOF:
+			ret = -1;
+			break;
+		default:
+			if (key >= ' ' && key <= '~') { /* key value may be too large, must not use isprint(key) */
+				ch = (char)key;
+				term_edit_insert(term, term->pos, &ch, 1, 1);
+				term_refresh(term, term->pos + 1, term->num + 1, term->pos);
+			} else {
+				// printf("unhandler key: %08x\n", key);
+			}
+			break;
+	} /* end of switch(key) */
+	term->refresh_defer = 0;
+	if (term->in_pos >= term->in_len) {
+		term_refresh_flush(term);
+	}
+	if (term->exit_flag) {
+		ret = -1;
+	}
+	if (ret < 0) {
+		term_color_set(term, TERM_COLOR_DEFAULT);
+	}
+	if (term->trace != NULL) { /* output is traced by flush of term_out_end */
+		term_trace_add(term, TERM_TRACE_EDIT, trace_start, (uint32_t)key);
+	}
+	term_out_end(term);
+	return ret;
+}
+
+static void term_batch_error(Terminal *term, TermBatch *batch, const char *format, ...) {
+	va_list args;
+
+	batch->failed++;
+	va_start(args, format);
+	if (term->local) { /* keep order with output of handlers */
+		term_out_flush(term);
+		fprintf(stderr, "%s:%d: ", batch->name, batch->start);
+		vfprintf(stderr, format, args);
+	} else {
+		term_printf_inner(term, "%s:%d: ", batch->name, batch->start);
+		term_vprintf_inner(term, format, args);
+	}
+	va_end(args);
+}
+
+/* run one line without '\n', lines end with '\\' or inside quot are joined by term_split_args */
+static void term_batch_line(Terminal *term, TermBatch *batch, const char *line, size_t len) {
+	size_t i = 0;
+	TermWalk walk;
+
+	batch->lineno++;
+	if (len > 0 && line[len - 1] == '\r') {
+		len--;
+	}
+	if (!term->multiline) {
+		for (i = 0; i < len && line[i] == ' '; i++);
+		if (i == len || line[i] == '#') { /* empty line or comment */
+			return;
+		}
+		batch->start = batch->lineno;
+	}
+	term_line_truncate(term, 0);
+	term_line_insert(term, 0, line, len);
+	term->num = len;
+	term->pos = len;
+	term_walk_init(&walk, term, E_EVENT_EXEC);
+	if (term_split_args(term, &walk) == 0) {
+		switch (term_execute_args(term, &walk)) {
+			case E_EXEC_NOT_FOUND: term_batch_error(term, batch, "command not found\n"); break;
+			case E_EXEC_AMBIGUOUS: term_batch_error(term, batch, "ambiguous command, %d commands matched\n", walk.exec_num); break;
+			case E_EXEC_INCOMPLETE: term_batch_error(term, batch, "incomplete command\n"); break;
+			case E_EXEC_INVALID_PIPE: term_batch_error(term, batch, "invalid pipe, %s\n", walk.pipe_error); break;
+			default: ;
+		}
+	}
+	term_walk_free(&walk);
+	term_async_drain(term);
+	if (term->tempbuf.used >= BATCH_FLUSH_SIZE) {
+		term_out_flush(term);
+	}
+}
+
+/* run all complete lines in data, and the last line without '\n' if eof, return size processed */
+static size_t term_batch_lines(Terminal *term, TermBatch *batch, const char *data, size_t len, int eof) {
+	const char *start = data, *end = NULL;
+
+	while (start < data + len && !term->exit_flag) {
+		end = (const char *)memchr(start, '\n', data + len - start);
+		if (end == NULL) {
+			if (!eof) {
 				break;
-			case KEY_CTRL('Z'):
-#if defined(_WIN32)
-				term_printf_inner(term, "exit because Ctrl+Z\n");
-				goto func_end;
-#else
-				raise(SIGSTOP);
+			}
+			end = data + len;
+		}
+		term_batch_line(term, batch, start, end - start);
+		start = end < data + len ? end + 1 : end;
+	}
+	return start - data;
+}
+
+int term_batch_run(Terminal *term, const char *path) {
+	int fd = -1, served = 0;
+	ssize_t rc = 0;
+	size_t done = 0;
+	TTBuffer buf;
+	TermBatch batch;
+#if !defined(_WIN32)
+	struct stat st;
+	void *data = MAP_FAILED;
 #endif
+
+	memset(&batch, 0x00, sizeof(batch));
+	batch.name = strcmp(path, "-") == 0 ? "stdin" : path;
+	fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	tt_buffer_init(&buf);
+	term_own(term, 1);
+	served = ATOMIC_XCHG_INT(&(term->served), 1);
+	term->script = 1;
+	term->multiline = 0;
+	term_out_begin(term);
+#if !defined(_WIN32)
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	if (data != MAP_FAILED) { /* regular file is mapped, no copy */
+		madvise(data, st.st_size, MADV_SEQUENTIAL);
+		term_batch_lines(term, &batch, (const char *)data, st.st_size, 1);
+		munmap(data, st.st_size);
+		goto func_end;
+	}
+#endif
+	while (!term->exit_flag) {
+		if (buf.space < buf.used + BATCH_READ_SIZE + 1) { /* first read, or a very long line */
+			if (0 != tt_buffer_swapto_malloced(&buf, BATCH_READ_SIZE)) {
 				break;
-			default:
-				if (key >= ' ' && key <= '~') { /* key value may be too large, must not use isprint(key) */
-					tt_buffer_swapto_malloced(&(term->line_command), 1);  /* malloc for complete SPACE */
-					memmove(term->line_command.content + term->pos + 1, term->line_command.content + term->pos, term->num - term->pos);
-					*(term->line_command.content + term->pos) = (char)key;
-					term_refresh(term, term->pos + 1, term->num + 1, term->pos);
-				} else {
-					// printf("unhandler key: %08x\n", key);
-				}
-				break;
-		} /* end of switch(key) */
-		if (term->exit_flag) {
+			}
+		}
+		rc = read(fd, buf.content + buf.used, BATCH_READ_SIZE);
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		}
+		if (rc <= 0) {
 			break;
 		}
+		buf.used += rc;
+		done = term_batch_lines(term, &batch, (const char *)buf.content, buf.used, 0);
+		memmove(buf.content, buf.content + done, buf.used - done);
+		buf.used -= done;
+	}
+	term_batch_lines(term, &batch, (const char *)buf.content, buf.used, 1);
+func_end:
+	if (term->multiline && !term->exit_flag) {
+		term_batch_error(term, &batch, "unexpected end of file\n");
+	}
+	term_out_end(term);
+	term->multiline = 0;
+	term->script = 0;
+	term_serve_end(term, served);
+	term_own(term, 0);
+	tt_buffer_free(&buf);
+	if (fd != STDIN_FILENO) {
+		close(fd);
+	}
+	return batch.failed;
+}
+
+/* parse and run line by detached walk, output is sent to sink set in walk */
+static TermExecStatus term_execute_walk(Terminal *term, TermWalk *walk, const char *line, size_t len) {
+	TTBuffer line_buf;
+	TermExecStatus status = E_EXEC_INCOMPLETE; /* quot is not closed or '\\' at end */
+
+	tt_buffer_init(&line_buf);
+	walk->detached = 1;
+	if (tt_buffer_write(&line_buf, line, len) == 0 && term_args_parse(walk, (char *)(line_buf.content)) == ARGS_CLOSED) {
+		status = term_execute_args(term, walk);
+	}
+	term_walk_free(walk);
+	tt_buffer_free(&line_buf);
+	return status;
+}
+
+TermExecStatus term_execute_line(Terminal *term, const char *line, size_t len) {
+	TermWalk walk;
+
+	term_walk_init(&walk, term, E_EVENT_EXEC);
+	return term_execute_walk(term, &walk, line, len);
+}
+
+TermExecStatus term_execute_capture(Terminal *term, const char *line, size_t len, TTBuffer *out) {
+	TermWalk walk;
+
+	term_walk_init(&walk, term, E_EVENT_EXEC);
+	walk.capture = out;
+	return term_execute_walk(term, &walk, line, len);
+}
+
+TermExecStatus term_execute_stream(Terminal *term, const char *line, size_t len, TermOutputCb cb, void *userdata) {
+	TermWalk walk;
+
+	term_walk_init(&walk, term, E_EVENT_EXEC);
+	walk.stream = cb;
+	walk.stream_data = userdata;
+	return term_execute_walk(term, &walk, line, len);
+}
+
+TermExecStatus term_execute_argv(Terminal *term, int argc, const char **argv) {
+	int i = 0;
+	TermWalk walk;
+	TermArg *p_new = NULL, **pp = NULL;
+	TermExecStatus status = E_EXEC_NOT_FOUND;
+
+	term_walk_init(&walk, term, E_EVENT_EXEC);
+	walk.detached = 1;
+	for (i = 0, pp = &(walk.args); i < argc; i++, pp = &(p_new->next)) {
+		p_new = (TermArg *)MY_MALLOC(sizeof(TermArg));
+		if (p_new == NULL) {
+			goto func_end;
+		}
+		p_new->content = MY_STRDUP(argv[i]);
+		p_new->next = NULL;
+		*pp = p_new;
+		if (p_new->content == NULL) {
+			goto func_end;
+		}
 	}
+	status = term_execute_args(term, &walk);
 func_end:
-	term_free_args(term);
+	term_walk_free(&walk);
+	return status;
+}
+
+/* get next key, time from input block read or from call if bytes were read ahead is traced as decode */
+static int term_key_next(Terminal *term) {
+	int key = 0;
+	uint64_t trace_start = 0;
+
+	if (term->trace != NULL) {
+		trace_start = term_time_us();
+	}
+	key = term_getkey(term);
+	if (term->trace != NULL) {
+		trace_start = term->trace_read > trace_start ? term->trace_read : trace_start;
+		term_trace_add(term, TERM_TRACE_DECODE, trace_start, (uint32_t)key);
+	}
+	return key;
+}
+
+int term_loop(Terminal *term) {
+	int key = 0;
+
+	if (term->local && !isatty(STDIN_FILENO)) { /* input is from a file or pipe */
+		return term_batch_run(term, "-");
+	}
+	term_own(term, 1);
+	ATOMIC_STORE_INT(&(term->served), 1);
+	term_raw_set(term, 1);
+	term_out_begin(term);
+	term_print_prompt(term);
+	term_refresh(term, 0, 0, 0);
+	term_out_end(term);
+	while (1) { /* loop once every key press */
+		key = term_key_next(term);
+		if (term_key_process(term, key) < 0) {
+			break;
+		}
+	}
+	term_raw_set(term, 0);
+	term_serve_end(term, 0);
+	term_own(term, 0);
 	return 0;
 }
+
+void term_session_begin(Terminal *term) {
+	term_own(term, 1);
+	ATOMIC_STORE_INT(&(term->served), 1); /* session drains async queue at wakeup until it is destroyed */
+	term_out_begin(term);
+	term_print_prompt(term);
+	term_refresh(term, 0, 0, 0);
+	term_out_end(term);
+	term_own(term, 0);
+}
+
+int term_session_key(Terminal *term) {
+	int ret = 0;
+	term_own(term, 1);
+	do { /* keys read ahead are processed now, transport has no input left to schedule session again */
+		ret = term_key_process(term, term_key_next(term));
+	} while (ret >= 0 && term->in_pos < term->in_len);
+	term_own(term, 0);
+	return ret;
+}
+
+void term_session_drain(Terminal *term) {
+	term_own(term, 1);
+	term_async_drain(term);
+	term_own(term, 0);
+}
 TermNode *term_root_create() {
 	TermNode *root = NULL;
 	root = MY_MALLOC(sizeof(TermNode));
@@ -1696,6 +5054,7 @@ func_end:
 }
 
 void term_root_free(TermNode *root) {
+	ATOMIC_ADD_INT(&term_tree_version, 1);
 	node_free(root);
 }
 
@@ -1706,6 +5065,7 @@ TermNode *term_node_child_add(TermNode *parent, NodeType type, const char *word,
 	if (new_node == NULL || word == NULL) {
 		goto func_end;
 	}
+	ATOMIC_ADD_INT(&term_tree_version, 1);
 	memset(new_node, 0x00, sizeof(TermNode));
 	new_node->type = type;
 	new_node->exec = exec;
@@ -1734,6 +5094,7 @@ int term_node_child_del(TermNode *parent, const char *word) {
 				pre->next = node->next;
 			}
 			node_free(node);
+			ATOMIC_ADD_INT(&term_tree_version, 1);
 			found = 1;
 			break;
 		}
@@ -1752,6 +5113,7 @@ TermNode *term_node_mulsel_add(TermNode *parent, const char *word, uint32_t flag
 		goto func_end;
 	}
 	new_node->flags = flags;
+	ATOMIC_ADD_INT(&term_tree_version, 1);
 func_end:
 	return new_node;
 }
@@ -1763,6 +5125,7 @@ TermNode *term_node_option_add(TermNode *selector, const char *word, const char
 	if (new_node == NULL || word == NULL) {
 		goto func_end;
 	}
+	ATOMIC_ADD_INT(&term_tree_version, 1);
 	memset(new_node, 0x00, sizeof(TermNode));
 	new_node->type = TYPE_KEY;
 	new_node->word = MY_STRDUP(word);
@@ -1792,6 +5155,7 @@ int term_node_option_del(TermNode *selector, const char *word) {
 				pre->next = node->next;
 			}
 			node_free(node);
+			ATOMIC_ADD_INT(&term_tree_version, 1);
 			found = 1;
 			break;
 		}
@@ -1801,37 +5165,465 @@ int term_node_option_del(TermNode *selector, const char *word) {
 }
 
 int term_node_dynamic_option(TermNode *selector, TermDynOptionCb cb_func, void *userdata) {
+	ATOMIC_ADD_INT(&term_tree_version, 1);
 	selector->dyn_option = cb_func;
 	selector->dyn_option_udata = userdata;
 	return 0;
 }
 
+void term_node_flags_set(TermNode *node, uint32_t flags) {
+	ATOMIC_ADD_INT(&term_tree_version, 1);
+	node->flags = flags;
+}
+
+int term_node_jobs_add(TermNode *parent) {
+	TermNode *fg = NULL;
+
+	if (NULL == term_node_child_add(parent, TYPE_KEY, "jobs", "List commands running in background", term_jobs_exec)) {
+		return -1;
+	}
+	fg = term_node_child_add(parent, TYPE_KEY, "fg", "Wait for command in background, Ctrl+C to cancel it", term_fg_exec);
+	if (fg == NULL) {
+		return -1;
+	}
+	if (NULL == term_node_child_add(fg, TYPE_TEXT, "id", "Job id, last one if not set", term_fg_exec)) {
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef TERM_STATS
+static void term_statistics_line(void *userdata, const TermStatistics *stat) {
+	static const char *phase_name[] = {"parse", "walk", "dynoption", "exec"};
+
+	term_printf((Terminal *)userdata, "%-10s %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "  %s\n",
+		phase_name[stat->phase], stat->count, stat->total_us / stat->count, stat->p50_us, stat->p90_us, stat->p99_us, stat->max_us,
+		stat->path != NULL ? stat->path : "*");
+}
+#endif
+
+static void term_statistics_exec(Terminal *term, int argc, const char **argv) {
+#ifdef TERM_STATS
+	term_printf(term, "%-10s %8s %8s %8s %8s %8s %8s  %s\n", "phase", "count", "avg(us)", "p50", "p90", "p99", "max", "command");
+	term_statistics(term, term_statistics_line, term);
+#else
+	term_printf(term, "statistics are not built, rebuild with TERM_STATS.\n");
+#endif
+}
+
+static void term_statistics_reset_exec(Terminal *term, int argc, const char **argv) {
+	term_statistics_reset(term);
+}
+
+/* KEY child of parent with word, added if not found, so built-in commands share it */
+static TermNode *node_key_child(TermNode *parent, const char *word, const char *help) {
+	TermNode *node = NULL;
+
+	for (node = parent->children; node != NULL; node = node->next) {
+		if (node->type == TYPE_KEY && 0 == strcmp(node->word, word)) {
+			return node;
+		}
+	}
+	return term_node_child_add(parent, TYPE_KEY, word, help, NULL);
+}
+
+int term_node_statistics_add(TermNode *parent) {
+	TermNode *node = NULL;
+
+	node = node_key_child(parent, "show", "Show information");
+	if (node != NULL) {
+		node = node_key_child(node, "terminal", "Show information of terminal");
+	}
+	if (node == NULL) {
+		return -1;
+	}
+	node = term_node_child_add(node, TYPE_KEY, "statistics", "Latency of parse, walk, dynamic options and commands", term_statistics_exec);
+	if (node == NULL) {
+		return -1;
+	}
+	if (NULL == term_node_child_add(node, TYPE_KEY, "reset", "Count latency from now", term_statistics_reset_exec)) {
+		return -1;
+	}
+	return 0;
+}
+
+void term_exec_workers_set(Terminal *term, int workers) {
+	if (term->job_threads == NULL && workers > 0) { /* take effect before first job only */
+		term->job_workers = workers;
+	}
+}
+
+int term_exec_cancelled(Terminal *term) {
+	TermWalk *walk = NULL;
+
+	for (walk = term_walk_detached(term); walk != NULL; walk = walk->parent) {
+		if (walk->cancel) {
+			return 1;
+		}
+	}
+	return term_job_current != NULL && ATOMIC_LOAD_INT(&(term_job_current->cancel));
+}
+
 const char *term_getline(Terminal *term, const char *prefix) {
 	return term_getline_inner(term, prefix, 0);
 }
 const char *term_password(Terminal *term, const char *prefix) {
 	return term_getline_inner(term, prefix, 1);
 }
+/* print messages from other threads in one frame, deferred until frame interval passed.
+ * without region, prompt is erased once and redrawn once after messages,
+ * with region, messages are scrolled in above the input line which is pinned at the bottom of screen,
+ * while command executing (fg), there is no prompt, messages are printed only */
+static void term_async_drain(Terminal *term) {
+	int pos_bak = 0, prompt_len = 0, rows = 0, cols = 0, in_region = 0, newline = 0, printed = 0, dropped = 0;
+	int in_exec = (term->event == E_EVENT_EXEC || term->script);
+	size_t len = 0;
+	uint64_t now = 0;
+	TermAsyncMsg *msg = NULL, *head = NULL, *tail = NULL;
+
+	if (term->out_queue.used > 0) { /* transport took output, or woke up owner as writable */
+		term_out_queue_send(term);
+	}
+	if (ATOMIC_LOAD_INT(&(term->async_shed)) > 0) {
+		term->async_dropped += ATOMIC_XCHG_INT(&(term->async_shed), 0);
+	}
+	if (!ATOMIC_LOAD_INT(&(term->async_wake))) {
+		return; /* nothing pushed, or producer will wake up owner after push finished */
+	}
+	if (term->frame_interval > 0 && term->tp.timer != NULL) {
+		now = term_time_ms();
+		if (now < term->frame_last + term->frame_interval) { /* keep async_wake set, producers will not wake up owner again */
+			if (!term->frame_armed) {
+				term->frame_armed = 1;
+				term->tp.timer(term, (int)(term->frame_last + term->frame_interval - now));
+			}
+			return;
+		}
+		term->frame_last = now;
+		term->frame_armed = 0;
+	}
+	ATOMIC_XCHG_INT(&(term->async_wake), 0); /* reset before pop, producers after this will wake again */
+	msg = term_async_pop(term);
+	if (msg == NULL) {
+		return;
+	}
+	term_out_begin(term);
+	term_refresh_flush(term);
+	if (!in_exec) { /* messages in default color, also saved with cursor in region */
+		term_color_set(term, TERM_COLOR_DEFAULT);
+	}
+	term_screen_get(term, &cols, &rows);
+	prompt_len = strlen(term->prompt) + 1;
+	pos_bak = term->pos;
+	in_region = !in_exec && term->region && term->region_pinned && term->region_cols == cols && term->region_screen == rows && rows > term->region_rows;
+	if (in_exec) {
+		newline = 1;
+	} else if (in_region) { /* save cursor, scroll only rows above input line, newest message is always at the bottom of region */
+		term_printf_inner(term, "\0337\033[1;%dr\033[%d;1H", rows - term->region_rows, rows - term->region_rows);
+		newline = 1;
+	} else {
+		term_cursor_move(term, 0, -((term->pos + prompt_len) / cols)); /* to the first row of prompt */
+		term_printf_inner(term, "\r\033[J");
+	}
+	for (; msg != NULL; msg = term_async_pop(term)) {
+		if (term->frame_max > 0 && printed >= term->frame_max) {
+			dropped++;
+		} else if (msg->len > 0) {
+			len = msg->len;
+			if (in_region && newline) {
+				term_out_write(term, "\r\n", 2);
+			}
+			newline = msg->data[len - 1] == '\n';
+			if (in_region && newline) { /* line is ended by next message, bottom row of region is never left empty */
+				len--;
+			}
+			term_out_borrow(term, msg->data, len); /* freed after written */
+			printed++;
+		}
+		msg->next = NULL; /* popped message is not referenced by queue anymore, reuse next */
+		if (tail == NULL) {
+			head = msg;
+		} else {
+			tail->next = msg;
+		}
+		tail = msg;
+	}
+	if (dropped > 0) {
+		if (!in_region && printed > 0 && !newline) {
+			term_printf_inner(term, "\n");
+		}
+		term_printf_inner(term, "%s... %d messages dropped%s", in_region ? "\r\n" : "", dropped, in_region ? "" : "\n");
+		newline = !in_region;
+	}
+	term->async_printed += printed;
+	term->async_dropped += dropped;
+	if (in_region) {
+		term_printf_inner(term, "\033[r\0338"); /* reset scroll region and restore cursor */
+		term_out_flush(term);
+	} else if (in_exec) {
+		if (printed > 0 && !newline) {
+			term_printf_inner(term, "\n");
+		}
+	} else {
+		if (printed > 0 && !newline) {
+			term_printf_inner(term, "\n");
+		}
+		if (term->region) { /* move input line to the bottom of screen, rows above it become region */
+			term_printf_inner(term, "\033[%d;1H", rows - (term->num + prompt_len) / cols);
+		}
+		term_print_prompt(term); /* will set pos = 0 */
+		term_refresh(term, pos_bak, term->num, 0); /* recover input and pos, all output flushed */
+		if (term->region) {
+			term->region_pinned = 1;
+			term->region_rows = (term->num + prompt_len) / cols + 1;
+			term->region_cols = cols;
+			term->region_screen = rows;
+		}
+	}
+	term_out_end(term);
+	term_out_flush(term); /* messages are borrowed, outer batch of term_batch_run would write them after free */
+	for (msg = head; msg != NULL; msg = head) {
+		head = msg->next;
+		MY_FREE(msg);
+	}
+}
+
+void term_pager_set(Terminal *term, int enable) {
+	term->pager = enable;
+}
+
+void term_suggest_set(Terminal *term, int enable) {
+	term->suggest = enable;
+}
+
+void term_highlight_set(Terminal *term, int enable) {
+	term->highlight = enable;
+}
+
+void term_esc_timeout_set(Terminal *term, int ms) {
+	term->esc_timeout = ms >= 0 ? ms : ESC_TIMEOUT;
+}
+
+void term_async_frame_set(Terminal *term, int interval_ms, int frame_max) {
+	term->frame_interval = interval_ms > 0 ? interval_ms : 0;
+	term->frame_max = frame_max > 0 ? frame_max : 0;
+}
+
+void term_async_region_set(Terminal *term, int enable) {
+	term->region = enable;
+	term->region_pinned = 0;
+}
+
+void term_output_limit_set(Terminal *term, size_t high_water, int policy) {
+	term->out_high = high_water > 0 ? high_water : OUT_QUEUE_HIGH;
+	term->out_policy = policy;
+}
+
+void term_output_counters(Terminal *term, size_t *queued, uint64_t *dropped) {
+	if (queued != NULL) {
+		*queued = (size_t)ATOMIC_LOAD_INT(&(term->out_queued));
+	}
+	if (dropped != NULL) {
+		*dropped = term->out_dropped;
+	}
+}
+
+int term_trace_set(Terminal *term, int events) {
+	TermTraceEvent *trace = NULL;
+
+	if (events > 0) {
+		trace = (TermTraceEvent *)MY_MALLOC(sizeof(TermTraceEvent) * events);
+		if (trace == NULL) {
+			return -1;
+		}
+	}
+	if (term->trace != NULL) {
+		MY_FREE(term->trace);
+	}
+	term->trace = trace;
+	term->trace_size = events > 0 ? events : 0;
+	term->trace_next = 0;
+	term->trace_seq = 0;
+	term->trace_echo = 0;
+	return 0;
+}
+
+int term_trace_events(Terminal *term, TermTraceEvent *events, int max) {
+	int i = 0, num = 0;
+	uint64_t first = 0;
+
+	if (term->trace == NULL) {
+		return 0;
+	}
+	num = term->trace_next < (uint64_t)term->trace_size ? (int)term->trace_next : term->trace_size;
+	num = num < max ? num : max;
+	first = term->trace_next - num;
+	for (i = 0; i < num; i++) {
+		events[i] = term->trace[(first + i) % term->trace_size];
+	}
+	return num;
+}
+
+int term_trace_dump(Terminal *term, TTBuffer *out) {
+	int i = 0, num = 0, ret = 0;
+	TermTraceEvent *events = NULL;
+	const TermTraceEvent *ev = NULL;
+	static const char *phase_name[] = {"input", "decode", "edit", "refresh", "complete", "output", "echo"};
+	static const char *arg_name[] = {"bytes", "key", "key", "length", "length", "bytes", "bytes"};
+
+	if (term->trace_size > 0) {
+		events = (TermTraceEvent *)MY_MALLOC(sizeof(TermTraceEvent) * term->trace_size);
+		if (events == NULL) {
+			return -1;
+		}
+		num = term_trace_events(term, events, term->trace_size);
+	}
+	ret |= tt_buffer_printf(out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (i = 0; i < num; i++) {
+		ev = &(events[i]);
+		ret |= tt_buffer_printf(out, "%s\n{\"name\":\"%s\",\"cat\":\"terminal\",", i > 0 ? "," : "", phase_name[ev->phase]);
+		if (ev->phase == TERM_TRACE_INPUT) { /* instant event */
+			ret |= tt_buffer_printf(out, "\"ph\":\"i\",\"s\":\"t\",\"ts\":%" PRIu64 ",", ev->ts_us);
+		} else {
+			ret |= tt_buffer_printf(out, "\"ph\":\"X\",\"ts\":%" PRIu64 ",\"dur\":%u,", ev->ts_us, (unsigned int)ev->dur_us);
+		}
+		/* echo spans overlap phases of next input block, so they are put on a track of their own */
+		ret |= tt_buffer_printf(out, "\"pid\":1,\"tid\":%d,\"args\":{\"seq\":%u,\"%s\":%u}}",
+			ev->phase == TERM_TRACE_ECHO ? 2 : 1, (unsigned int)ev->seq, arg_name[ev->phase], (unsigned int)ev->arg);
+	}
+	ret |= tt_buffer_printf(out, "\n]}\n");
+	if (events != NULL) {
+		MY_FREE(events);
+	}
+	return ret < 0 ? -1 : num;
+}
+
+#ifdef TERM_STATS
+static void term_stat_fill(TermStatistics *stat, TermStatPhase phase, const char *path, const TermStatHist *hist) {
+	int i = 0, p = 0;
+	uint64_t seen = 0, bound = 0;
+	static const int pct[] = {50, 90, 99};
+	uint64_t *out[] = {&(stat->p50_us), &(stat->p90_us), &(stat->p99_us)};
+
+	memset(stat, 0x00, sizeof(TermStatistics));
+	stat->phase = phase;
+	stat->path = path;
+	stat->count = hist->count;
+	stat->total_us = hist->total_us;
+	stat->max_us = hist->max_us;
+	for (i = 0; i < STAT_BUCKETS && p < 3; i++) {
+		seen += hist->buckets[i];
+		for (; p < 3 && seen * 100 >= hist->count * pct[p]; p++) {
+			bound = term_stat_bucket_max(i);
+			*out[p] = bound < hist->max_us ? bound : hist->max_us;
+		}
+	}
+}
+
+/* phases first, then commands of each phase, longest total first */
+static int term_stat_cmp(const void *a, const void *b) {
+	const TermStatistics *sa = (const TermStatistics *)a, *sb = (const TermStatistics *)b;
+
+	if ((sa->path == NULL) != (sb->path == NULL)) {
+		return sa->path == NULL ? -1 : 1;
+	}
+	if (sa->phase != sb->phase) {
+		return sa->phase < sb->phase ? -1 : 1;
+	}
+	if (sa->total_us != sb->total_us) {
+		return sa->total_us > sb->total_us ? -1 : 1;
+	}
+	return 0;
+}
+#endif
+
+int term_statistics(Terminal *term, void (*cb)(void *userdata, const TermStatistics *stat), void *userdata) {
+#ifdef TERM_STATS
+	int i = 0, num = 0, max = TERM_STAT_PHASES;
+	TermStatPath *p_cur = NULL;
+	TermStatistics *stats = NULL;
+
+	/* copied under lock, cb may print and wait transport */
+	pthread_mutex_lock(&(term->stat_lock));
+	for (p_cur = term->stat_paths; p_cur != NULL; p_cur = p_cur->next) {
+		max++;
+	}
+	stats = (TermStatistics *)MY_MALLOC(sizeof(TermStatistics) * max);
+	if (stats != NULL) {
+		for (i = 0; i < TERM_STAT_PHASES; i++) {
+			if (term->stat_phase[i].count > 0) {
+				term_stat_fill(&(stats[num++]), (TermStatPhase)i, NULL, &(term->stat_phase[i]));
+			}
+		}
+		for (p_cur = term->stat_paths; p_cur != NULL; p_cur = p_cur->next) {
+			if (p_cur->hist.count > 0) {
+				term_stat_fill(&(stats[num++]), p_cur->phase, p_cur->path, &(p_cur->hist));
+			}
+		}
+	}
+	pthread_mutex_unlock(&(term->stat_lock));
+	if (stats == NULL) {
+		return -1;
+	}
+	qsort(stats, num, sizeof(TermStatistics), term_stat_cmp);
+	for (i = 0; i < num; i++) {
+		cb(userdata, &(stats[i]));
+	}
+	MY_FREE(stats);
+	return num;
+#else
+	return 0;
+#endif
+}
+
+void term_statistics_reset(Terminal *term) {
+#ifdef TERM_STATS
+	TermStatPath *p_cur = NULL;
+
+	pthread_mutex_lock(&(term->stat_lock));
+	memset(term->stat_phase, 0x00, sizeof(term->stat_phase));
+	for (p_cur = term->stat_paths; p_cur != NULL; p_cur = p_cur->next) {
+		memset(&(p_cur->hist), 0x00, sizeof(TermStatHist));
+	}
+	pthread_mutex_unlock(&(term->stat_lock));
+#endif
+}
+
+void term_async_counters(Terminal *term, uint64_t *printed, uint64_t *dropped) {
+	if (printed != NULL) {
+		*printed = term->async_printed;
+	}
+	if (dropped != NULL) {
+		*dropped = term->async_dropped;
+	}
+}
+
 int term_vprintf(Terminal *term, const char *format, va_list args) {
-	int i = 0, rc = 0, pos_bak = 0;
+	int rc = 0;
+	TermWalk *walk = NULL;
 
 	if (term == NULL) {
 		rc = vprintf(format, args);
 		goto func_end;
 	}
+	if ((walk = term_walk_detached(term)) != NULL) { /* handler run by term_execute_* */
+		rc = term_walk_vprintf(walk, format, args);
+		goto func_end;
+	}
+	if (!ATOMIC_LOAD_INT(&(term->served))) { /* before term_loop or after it returned, nobody would drain queue */
+		rc = term_direct_vprintf(term, format, args);
+		goto func_end;
+	}
+	if (!term_is_owner(term)) { /* other thread never touch terminal state, owner will print it */
+		rc = term_async_vprintf(term, format, args);
+		goto func_end;
+	}
 	if (term->event == E_EVENT_EXEC) {
 		rc = term_vprintf_inner(term, format, args); /* between command exec, just print */
 		goto func_end;
 	}
-	pos_bak = term->pos;
-	term_cursor_move(term, -(term->num + strlen(term->prompt) + 1), 0);
-	for (i = 0; i < term->num + strlen(term->prompt) + 1; i++) {
-		term_printf_inner(term, " ");
-	}
-	term_cursor_move(term, -(term->num + strlen(term->prompt) + 1), 0);
-	rc = term_vprintf_inner(term, format, args);
-	term_print_prompt(term); /* will set pos = 0 */
-	term_refresh(term, pos_bak, term->num, 0); /* recover input and pos */
+	rc = term_async_vprintf(term, format, args);
+	term_async_drain(term);
 func_end:
 	return rc;
 }
@@ -1844,3 +5636,34 @@ int term_printf(Terminal *term, const char *format, ...) {
 	va_end(args);
 	return rc;
 }
+
+int term_write_buffer(Terminal *term, TTBuffer *buf) {
+	int rc = (int)buf->used;
+	TermWalk *walk = NULL;
+
+	if (term == NULL) {
+		rc = fwrite(buf->content, 1, buf->used, stdout) == buf->used ? rc : -1;
+	} else if ((walk = term_walk_detached(term)) != NULL) { /* handler run by term_execute_* */
+		if (walk->capture != NULL && walk->filters == NULL && walk->capture->used == 0 && buf->is_malloced == 1 && !walk->cancel) {
+			tt_buffer_free(walk->capture); /* hand content over to capture */
+			*(walk->capture) = *buf;
+			tt_buffer_init(buf);
+		} else if (walk->capture == NULL && walk->filters == NULL && !walk->cancel && buf->used > 0) {
+			term_walk_flush(walk); /* written in order, buf itself is not copied into out */
+			term_walk_emit(walk, buf->content, buf->used);
+		} else if (buf->used > 0) {
+			term_walk_write(walk, buf->content, buf->used);
+		}
+	} else if (!ATOMIC_LOAD_INT(&(term->served))) { /* before term_loop or after it returned, nobody would drain queue */
+		rc = term_direct_write(term, buf->content, buf->used);
+	} else if (!term_is_owner(term)) { /* other thread never touch terminal state, owner will print it */
+		rc = term_async_write(term, buf->content, buf->used);
+	} else if (term->event == E_EVENT_EXEC) {
+		term_out_own(term, buf);
+	} else {
+		rc = term_async_write(term, buf->content, buf->used);
+		term_async_drain(term);
+	}
+	tt_buffer_free(buf);
+	return rc;
+}
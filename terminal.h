@@ -3,8 +3,11 @@
 
 #include <stdint.h>
 #include <stdarg.h>
+#include <stddef.h>
 #if defined(_WIN32)
 #define ssize_t size_t
+#else
+#include <sys/types.h>
 #endif
 #include "tt_buffer.h"
 
@@ -31,14 +34,14 @@ extern "C" {
 #define TERM_FGCOLOR_BRIGHT_WHITE    97
 
 #define TERM_BGCOLOR_DEFAULT         0
-#define TERM_BGCOLOR_BLACK           (40 << 9)
-#define TERM_BGCOLOR_RED             (41 << 9)
-#define TERM_BGCOLOR_GREEN           (42 << 9)
-#define TERM_BGCOLOR_YELLOW          (43 << 9)
-#define TERM_BGCOLOR_BLUE            (44 << 9)
-#define TERM_BGCOLOR_MAGENTA         (45 << 9)
-#define TERM_BGCOLOR_CYAN            (46 << 9)
-#define TERM_BGCOLOR_WHITE           (47 << 9)
+#define TERM_BGCOLOR_BLACK           (40 << 8)
+#define TERM_BGCOLOR_RED             (41 << 8)
+#define TERM_BGCOLOR_GREEN           (42 << 8)
+#define TERM_BGCOLOR_YELLOW          (43 << 8)
+#define TERM_BGCOLOR_BLUE            (44 << 8)
+#define TERM_BGCOLOR_MAGENTA         (45 << 8)
+#define TERM_BGCOLOR_CYAN            (46 << 8)
+#define TERM_BGCOLOR_WHITE           (47 << 8)
 #define TERM_BGCOLOR_BRIGHT_BLACK    (100 << 8)
 #define TERM_BGCOLOR_BRIGHT_RED      (101 << 8)
 #define TERM_BGCOLOR_BRIGHT_GREEN    (102 << 8)
@@ -52,9 +55,13 @@ extern "C" {
 #define TERM_STYLE_UNDERSCORE        0x020000
 #define TERM_STYLE_BLINKING          0x040000
 #define TERM_STYLE_INVERSE           0x080000
-#define TERM_COLOR_DEFAULT           TERM_FGCOLOR_DEFAULT | TERM_BGCOLOR_DEFAULT
+#define TERM_COLOR_DEFAULT           (TERM_FGCOLOR_DEFAULT | TERM_BGCOLOR_DEFAULT)
 
 #define MULSEL_OPTIONAL              (1 << 0)
+#define EXEC_ASYNC                   (1 << 1) /* exec runs on worker thread of terminal, prompt returns immediately */
+
+#define TERM_OUT_WAIT                0 /* owner waits transport at most 5 seconds, then output is dropped */
+#define TERM_OUT_DROP                1 /* output is dropped at once */
 
 typedef enum TermEvent {
 	E_EVENT_NONE,
@@ -63,6 +70,54 @@ typedef enum TermEvent {
 	E_EVENT_EXEC
 } TermEvent;
 
+/* result of term_execute_line and term_execute_argv */
+typedef enum TermExecStatus {
+	E_EXEC_DONE = 0,
+	E_EXEC_NOT_FOUND,
+	E_EXEC_AMBIGUOUS, /* more than one command matched, none executed */
+	E_EXEC_INCOMPLETE, /* prefix of commands, or quot is not closed */
+	E_EXEC_INVALID_PIPE, /* filter after '|' is unknown or pattern is invalid */
+} TermExecStatus;
+
+/* phases timed by statistics, see term_statistics */
+typedef enum TermStatPhase {
+	TERM_STAT_PARSE, /* split line into args */
+	TERM_STAT_WALK, /* match args with tree, include TERM_STAT_DYN_OPTION */
+	TERM_STAT_DYN_OPTION, /* callback of term_node_dynamic_option, per selector */
+	TERM_STAT_EXEC, /* handler, per command */
+	TERM_STAT_PHASES
+} TermStatPhase;
+
+typedef struct TermStatistics {
+	TermStatPhase phase;
+	const char *path; /* command as "sleep sec <duration>" or word of selector, NULL for all of phase */
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t p50_us; /* percentiles are upper bound of histogram bucket, at most 1/8 above */
+	uint64_t p90_us;
+	uint64_t p99_us;
+} TermStatistics;
+
+/* phases of input traced by term_trace_set */
+typedef enum TermTracePhase {
+	TERM_TRACE_INPUT, /* input block read, dur is 0, arg is bytes */
+	TERM_TRACE_DECODE, /* bytes into key, from block read or call, include wait of ESC sequence, arg is key */
+	TERM_TRACE_EDIT, /* key processed, include refresh, completion and commands of Enter, arg is key */
+	TERM_TRACE_REFRESH, /* line drawn into output, arg is length of line */
+	TERM_TRACE_COMPLETE, /* TAB walked and listed, arg is length of line */
+	TERM_TRACE_OUTPUT, /* output flushed to transport, arg is bytes */
+	TERM_TRACE_ECHO, /* from input block read to first output flushed after it, arg is bytes */
+} TermTracePhase;
+
+typedef struct TermTraceEvent {
+	uint64_t ts_us; /* start in monotonic us */
+	uint32_t dur_us;
+	uint32_t phase; /* TermTracePhase */
+	uint32_t seq; /* input block which event belongs to, counted from 1 */
+	uint32_t arg;
+} TermTraceEvent;
+
 typedef enum NodeType {
 	TYPE_UNSET = 0,
 	TYPE_KEY,
@@ -76,6 +131,28 @@ typedef struct Terminal Terminal;
 
 typedef void (* TermExec)(struct Terminal *term, int argc, const char **argv);
 typedef void (* TermDynOptionCb)(void *userdata, char ***word, char ***help, int *num);
+/* receive output of handlers while they are running, handler is blocked until it returns, return < 0 to cancel */
+typedef int (* TermOutputCb)(void *userdata, const void *buf, size_t len);
+
+typedef struct TermIOVec {
+	const void *base;
+	size_t len;
+} TermIOVec;
+
+/* input and output of Terminal, get transport_data by term_transport_data.
+ * write and writev may take less than count, or return < 0 with errno EAGAIN if they would block, rest is queued */
+typedef struct TermTransport {
+	ssize_t (*read)(struct Terminal *term, void *buf, size_t count); /* block until input, return < 0 if input closed */
+	ssize_t (*write)(struct Terminal *term, const void *buf, size_t count);
+	ssize_t (*writev)(struct Terminal *term, const TermIOVec *iov, int iovcnt); /* optional, NULL if not supported */
+	void (*winsize)(struct Terminal *term, int *cols, int *rows); /* optional, use 80x24 if NULL */
+	int (*raw_mode)(struct Terminal *term, int enable); /* optional, turn off echo and line buffering of input */
+	void (*wakeup)(struct Terminal *term); /* optional, called by other thread to make blocked read return 0 */
+	void (*timer)(struct Terminal *term, int ms); /* optional, make read return 0 after ms, async frames are disabled if NULL */
+	/* optional, wait at most ms until write would not block, return > 0 if writable.
+	 * read should return 0 once writable while output is queued, queue is sent by next write if NULL */
+	int (*writable)(struct Terminal *term, int ms);
+} TermTransport;
 
 
 extern TermNode *term_root_create();
@@ -87,17 +164,44 @@ extern TermNode *term_node_mulsel_add(TermNode *parent, const char *word, uint32
 extern TermNode *term_node_option_add(TermNode *selector, const char *word, const char *help);
 extern int term_node_option_del(TermNode *selector, const char *word);
 
+/* cb_func is called once per walk by the walking thread, may be called by several threads at once */
 extern int term_node_dynamic_option(TermNode *selector, TermDynOptionCb cb_func, void *userdata);
+extern void term_node_flags_set(TermNode *node, uint32_t flags); /* MULSEL_OPTIONAL, EXEC_ASYNC */
+extern int term_node_jobs_add(TermNode *parent); /* add "jobs" and "fg [id]" for EXEC_ASYNC commands */
+extern int term_node_statistics_add(TermNode *parent); /* add "show terminal statistics [reset]", "show" is shared */
 
 extern void term_root_free(TermNode *root);
 
 extern int term_create(Terminal **_term, const char *prompt, TermNode *root, const char *init_content);
+extern int term_create_transport(Terminal **_term, const char *prompt, TermNode *root, const TermTransport *transport, void *transport_data);
+extern void *term_transport_data(Terminal *term);
 extern void term_destroy(Terminal *term);
 
 extern int term_root_set(Terminal *term, TermNode *root);
 extern void term_exit(Terminal *term);
-extern int term_loop(Terminal *term);
+extern int term_loop(Terminal *term); /* run term_batch_run(term, "-") if STDIN is not a terminal */
+/* run commands line by line from file, "-" for STDIN, without prompt, cursor and color,
+ * errors are reported with line number, return count of failed lines or < 0 if open failed */
+extern int term_batch_run(Terminal *term, const char *path);
+/* parse and run one command without edit, echo, history and prompt, output of handlers is collected without color
+ * and written after handlers returned, printed by owner if term_loop is running on another thread.
+ * root is only read while walking, so several threads may call them at once on terminals sharing one root */
+extern TermExecStatus term_execute_line(Terminal *term, const char *line, size_t len);
+extern TermExecStatus term_execute_argv(Terminal *term, int argc, const char **argv);
+/* same as term_execute_line, output of handlers printed by term_printf is appended to out */
+extern TermExecStatus term_execute_capture(Terminal *term, const char *line, size_t len, TTBuffer *out);
+/* same as term_execute_line, output of handlers is passed to cb in chunks, term_exec_cancelled return 1 if cb < 0 */
+extern TermExecStatus term_execute_stream(Terminal *term, const char *line, size_t len, TermOutputCb cb, void *userdata);
 extern void term_color_set(Terminal *term, unsigned int color);
+/* output of command longer than screen stops at --More--, q cancels the command.
+ * default on for term_create, off for term_create_transport as the handler blocks in read until a key is answered */
+extern void term_pager_set(Terminal *term, int enable);
+/* show rest of most recent history starting with typed line, accepted by Right or Ctrl+E, default on */
+extern void term_suggest_set(Terminal *term, int enable);
+/* color words of typed line by command tree: keywords, options, text and unknown words, default on */
+extern void term_highlight_set(Terminal *term, int enable);
+/* ms to wait rest of escape sequence after ESC, ESC is a single key if nothing read, default 50 */
+extern void term_esc_timeout_set(Terminal *term, int ms);
 extern int term_prompt_set(Terminal *term, const char *prompt);
 extern void term_prompt_color_set(Terminal *term, unsigned int color);
 extern void term_userdata_set(Terminal *term, void *userdata);
@@ -106,6 +210,37 @@ extern const char *term_getline(Terminal *term, const char *prefix);
 extern const char *term_password(Terminal *term, const char *prefix);
 extern int term_vprintf(Terminal *term, const char *format, va_list args);
 extern int term_printf(Terminal *term, const char *format, ...);
+/* print content of buf, buf is emptied and its content released by terminal,
+ * content malloced by buf is handed over and written by writev without copy while a command runs */
+extern int term_write_buffer(Terminal *term, TTBuffer *buf);
+
+/* workers for EXEC_ASYNC commands, started at first async command, default 2 */
+extern void term_exec_workers_set(Terminal *term, int workers);
+/* polled by exec, return 1 if cancelled by Ctrl+C in fg, term_destroy, or callback of term_execute_stream */
+extern int term_exec_cancelled(Terminal *term);
+
+/* messages printed by other threads are coalesced and printed at most once every interval_ms,
+ * at most frame_max messages are printed in one frame and the others are dropped, 0 for no limit */
+extern void term_async_frame_set(Terminal *term, int interval_ms, int frame_max);
+/* print messages from other threads into the scroll region above input line, prompt is not redrawn */
+extern void term_async_region_set(Terminal *term, int enable);
+extern void term_async_counters(Terminal *term, uint64_t *printed, uint64_t *dropped);
+/* output not taken by transport is queued, once more than high_water bytes are queued,
+ * messages from other threads are dropped and owner waits or drops output by policy, default 1 MB and TERM_OUT_WAIT */
+extern void term_output_limit_set(Terminal *term, size_t high_water, int policy);
+/* bytes queued for transport, and bytes dropped by output limit */
+extern void term_output_counters(Terminal *term, size_t *queued, uint64_t *dropped);
+/* latency of phases, and of each command and selector, counted only if built with TERM_STATS (cmake -DTERM_STATS=ON).
+ * cb is called once per entry after counters are copied, path is valid until term_destroy, return count of entries */
+extern int term_statistics(Terminal *term, void (*cb)(void *userdata, const TermStatistics *stat), void *userdata);
+extern void term_statistics_reset(Terminal *term);
+/* keep last events of input, keys and output of owner in a ring, 0 to stop and free it, each phase checks a pointer if stopped.
+ * trace functions are called by owner, such as handlers, or while term_loop is not running */
+extern int term_trace_set(Terminal *term, int events);
+/* copy events in ring oldest first, return count copied */
+extern int term_trace_events(Terminal *term, TermTraceEvent *events, int max);
+/* append events in Chrome trace format, open by chrome://tracing or Perfetto, return count of events or < 0 */
+extern int term_trace_dump(Terminal *term, TTBuffer *out);
 
 #ifdef __cplusplus
 }
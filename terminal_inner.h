@@ -0,0 +1,30 @@
+#ifndef __TERMINAL_INNER_H__
+#define __TERMINAL_INNER_H__
+
+/* private interface between terminal.c and term_server.c, not part of the public api */
+
+#if defined(_WIN32)
+#include "w32_pthread.h"
+#else
+#include <pthread.h>
+#endif
+#ifndef __TERMINAL_H__
+#include "terminal.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* print prompt, call once before first term_session_key */
+extern void term_session_begin(Terminal *term);
+/* read and process keys of one input block, return < 0 if session should be closed */
+extern int term_session_key(Terminal *term);
+/* print messages from other threads, call after transport wakeup */
+extern void term_session_drain(Terminal *term);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -13,6 +13,12 @@
 #include <pthread.h>
 #endif
 #include "terminal.h"
+#if !defined(_WIN32)
+#include "term_server.h"
+#endif
+#ifdef WATCH_RAM
+#include "tt_malloc_debug.h"
+#endif
 
 static void *thread_func(void *userdata) {
 	int i = 0;
@@ -24,14 +30,14 @@ static void *thread_func(void *userdata) {
 	return NULL;
 }
 static void cmd_print(Terminal *term, int argc, const char **argv) {
-	printf("%s\n", argv[1]);
+	term_printf(term, "%s\n", argv[1]);
 }
 static void cmd_sleep(Terminal *term, int argc, const char **argv) {
-	printf("sleeping \"%s\" sec\n", argv[2]);
+	term_printf(term, "sleeping \"%s\" sec\n", argv[2]);
 	sleep(atoi(argv[2]));
 }
 static void cmd_sleepms(Terminal *term, int argc, const char **argv) {
-	printf("sleeping \"%s\" ms\n", argv[2]);
+	term_printf(term, "sleeping \"%s\" ms\n", argv[2]);
 	usleep(atoi(argv[2]) * 1000);
 }
 static void cmd_setprompt(Terminal *term, int argc, const char **argv) {
@@ -52,7 +58,7 @@ static void cmd_setprompt(Terminal *term, int argc, const char **argv) {
 			term_prompt_set(term, argv[2]);
 			break;
 		} else {
-			printf("invalid password \"%s\" for user \"%s\", mismatch with \"123\"\n", pwd, usr_dup);
+			term_printf(term, "invalid password \"%s\" for user \"%s\", mismatch with \"123\"\n", pwd, usr_dup);
 		}
 	}
 func_end:
@@ -60,6 +66,19 @@ func_end:
 		free(usr_dup);
 	}
 }
+static void cmd_countdown(Terminal *term, int argc, const char **argv) {
+	int i = 0;
+	for (i = atoi(argv[1]); i > 0 && !term_exec_cancelled(term); i--) {
+		term_printf(term, "countdown %d\n", i);
+		sleep(1);
+	}
+}
+static void cmd_seq(Terminal *term, int argc, const char **argv) {
+	int i = 0, count = atoi(argv[1]);
+	for (i = 1; i <= count && !term_exec_cancelled(term); i++) {
+		term_printf(term, "line %d\n", i);
+	}
+}
 static void cmd_printasync(Terminal *term, int argc, const char **argv) {
 	static pthread_t task_id;
 	pthread_create(&task_id, NULL, thread_func, term);
@@ -68,19 +87,55 @@ static void cmd_printasync(Terminal *term, int argc, const char **argv) {
 static void cmd_test2(Terminal *term, int argc, const char **argv) {
 	int i = 0;
 	for (i = 0; i < argc; i++) {
-		printf("%s argv[%d]: %s\n", __func__, i, argv[i]);
+		term_printf(term, "%s argv[%d]: %s\n", __func__, i, argv[i]);
 	}
 }
 static void cmd_test3(Terminal *term, int argc, const char **argv) {
 	int i = 0;
 	for (i = 0; i < argc; i++) {
-		printf("%s argv[%d]: %s\n", __func__, i, argv[i]);
+		term_printf(term, "%s argv[%d]: %s\n", __func__, i, argv[i]);
 	}
 }
 static void cmd_exit(Terminal *term, int argc, const char **argv) {
-	printf("userdata \"%s\"\n", (char *)term_userdata_get(term));
+	term_printf(term, "userdata \"%s\"\n", (char *)term_userdata_get(term));
 	term_exit(term);
 }
+static void cmd_trace_start(Terminal *term, int argc, const char **argv) {
+	term_trace_set(term, 65536);
+}
+static void cmd_trace_stop(Terminal *term, int argc, const char **argv) {
+	term_trace_set(term, 0);
+}
+static void cmd_trace_dump(Terminal *term, int argc, const char **argv) {
+	int num = 0;
+	FILE *fp = NULL;
+	TTBuffer out;
+
+	tt_buffer_init(&out);
+	num = term_trace_dump(term, &out);
+	fp = fopen(argv[2], "w");
+	if (num < 0 || fp == NULL) {
+		term_printf(term, "dump into \"%s\" failed\n", argv[2]);
+	} else {
+		fwrite(out.content, 1, out.used, fp);
+		term_printf(term, "%d events written into \"%s\", open it by chrome://tracing\n", num, argv[2]);
+	}
+	if (fp != NULL) {
+		fclose(fp);
+	}
+	tt_buffer_free(&out);
+}
+#ifdef WATCH_RAM
+static void memory_line(void *userdata, const char *line) {
+	term_printf((Terminal *)userdata, "%s\n", line);
+}
+static void cmd_memory(Terminal *term, int argc, const char **argv) {
+	tt_malloc_report(memory_line, term);
+}
+static void cmd_memory_reset(Terminal *term, int argc, const char **argv) {
+	tt_malloc_reset();
+}
+#endif
 static void cmd_dyn_child(void *userdata, char ***word, char ***help, int *num) {
 	int i = 0;
 	*num = 3;
@@ -97,7 +152,7 @@ static void cmd_dyn_child(void *userdata, char ***word, char ***help, int *num)
 	}
 #endif
 }
-int main() {
+int main(int argc, char *argv[]) {
 	Terminal *term;
 	TermNode *root = NULL;
 	root = term_root_create();
@@ -115,6 +170,16 @@ int main() {
 
 	term_node_child_add(root, TYPE_KEY, "printasync", "Print in endline mode", cmd_printasync);
 
+	TermNode *seqnode = NULL;
+	seqnode = term_node_child_add(root, TYPE_KEY, "seq", "Print numbered lines, try with pager and | include", NULL);
+	/**/term_node_child_add(seqnode, TYPE_TEXT, "count", "Count of lines", cmd_seq);
+
+	TermNode *countdownnode = NULL;
+	countdownnode = term_node_child_add(root, TYPE_KEY, "countdown", "Countdown in background", NULL);
+	/**/term_node_flags_set(term_node_child_add(countdownnode, TYPE_TEXT, "seconds", "Seconds to count", cmd_countdown), EXEC_ASYNC);
+	term_node_jobs_add(root);
+	term_node_statistics_add(root);
+
 	TermNode *testselnode = NULL, *selnode = NULL;
 	testselnode = term_node_child_add(root, TYPE_KEY, "testsel", "help for testsel", NULL);
 	selnode = term_node_select_add(testselnode, "sel1", NULL);
@@ -140,8 +205,37 @@ int main() {
 	/**/promptnode = term_node_child_add(setnode, TYPE_KEY, "prompt", "Change prompt", NULL);
 	/**//**/term_node_child_add(promptnode, TYPE_TEXT, "content", "Prompt content", cmd_setprompt);
 
+	TermNode *tracenode = NULL, *dumpnode = NULL;
+	tracenode = term_node_child_add(root, TYPE_KEY, "trace", "Trace latency of keys", NULL);
+	/**/term_node_child_add(tracenode, TYPE_KEY, "start", "Keep last 65536 events", cmd_trace_start);
+	/**/term_node_child_add(tracenode, TYPE_KEY, "stop", "Stop and drop events", cmd_trace_stop);
+	/**/dumpnode = term_node_child_add(tracenode, TYPE_KEY, "dump", "Write events in Chrome trace format", NULL);
+	/**//**/term_node_child_add(dumpnode, TYPE_TEXT, "file", "File name", cmd_trace_dump);
+
+#ifdef WATCH_RAM
+	TermNode *memorynode = NULL;
+	memorynode = term_node_child_add(root, TYPE_KEY, "memory", "Allocations per call site since reset", cmd_memory);
+	/**/term_node_child_add(memorynode, TYPE_KEY, "reset", "Count allocations from now", cmd_memory_reset);
+#endif
+
 	term_node_child_add(root, TYPE_KEY, "exit", "Exit", cmd_exit);
 
+#if !defined(_WIN32)
+	if (argc > 1) { /* server mode: testapp unix:/tmp/demo.sock or testapp tcp:2323 */
+		TermServer *server = NULL;
+		if (0 != term_server_create(&server, argv[1], "Demo$", root, 4/*workers*/, TERM_SERVER_TELNET)) {
+			printf("listen on \"%s\" failed\n", argv[1]);
+			term_root_free(root);
+			return 1;
+		}
+		term_server_userdata_set(server, "hello");
+		printf("listen on \"%s\", press Ctrl+D to stop\n", argv[1]);
+		while (getchar() != EOF);
+		term_server_destroy(server);
+		term_root_free(root);
+		return 0;
+	}
+#endif
 	term_create(&term, "Demo$", root, "print aa\\ bb\\'\\ncc\\\"\\\\\n"/*init_content*/);
 	// term_init(&term, "Demo$", root, NULL);
 	term_userdata_set(term, "hello");
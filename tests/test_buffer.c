@@ -0,0 +1,95 @@
+/* unit tests of TTBuffer, tt_buffer.c is included so tt_buffer_format_bound can be called.
+ * exit status is the count of failed checks */
+#include <stdint.h>
+#include "../tt_buffer.c"
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		test_failed++; \
+	} \
+} while (0)
+
+static int test_failed;
+
+static int test_bound(const char *format, ...) {
+	int bound = 0;
+	va_list args;
+
+	va_start(args, format);
+	bound = tt_buffer_format_bound(format, args);
+	va_end(args);
+	return bound;
+}
+
+/* bound is never below what vsnprintf writes, and formats it can not estimate return -1 */
+static void test_format_bound(void) {
+	char out[512];
+
+	CHECK(test_bound("abc%%") == 4);
+	CHECK(test_bound("%s", "hello") == 5);
+	CHECK(test_bound("%.3s", "hello") == 3);
+	CHECK(test_bound("%8s", "hi") == 8);
+	CHECK(test_bound("%s", (char *)NULL) == 6);
+	CHECK(test_bound("%c%c", 'a', 'b') == 2);
+	CHECK(test_bound("%d", INT_MIN) >= snprintf(out, sizeof(out), "%d", INT_MIN));
+	CHECK(test_bound("%lld", (long long)INT64_MIN) >= snprintf(out, sizeof(out), "%lld", (long long)INT64_MIN));
+	CHECK(test_bound("%llo", (unsigned long long)UINT64_MAX) >= snprintf(out, sizeof(out), "%llo", (unsigned long long)UINT64_MAX));
+	CHECK(test_bound("%.5d", -42) >= snprintf(out, sizeof(out), "%.5d", -42));
+	CHECK(test_bound("%.30d", -42) >= snprintf(out, sizeof(out), "%.30d", -42)); /* sign before precision digits */
+	CHECK(test_bound("%#.30x", 42) >= snprintf(out, sizeof(out), "%#.30x", 42)); /* 0x before precision digits */
+	CHECK(test_bound("%.*d", 40, -1) >= snprintf(out, sizeof(out), "%.*d", 40, -1));
+	CHECK(test_bound("%*d", -10, 1) >= snprintf(out, sizeof(out), "%*d", -10, 1)); /* negative width is left aligned */
+	CHECK(test_bound("%*d", INT_MIN, 1) == -1); /* too long, not negated */
+	CHECK(test_bound("%f", 1e300) >= snprintf(out, sizeof(out), "%f", 1e300));
+	CHECK(test_bound("%p", (void *)out) >= snprintf(out, sizeof(out), "%p", (void *)out));
+	CHECK(test_bound("%jd", (intmax_t)1) == -1);
+	CHECK(test_bound("%ls", L"wide") == -1);
+	CHECK(test_bound("%n", (int *)NULL) == -1);
+}
+
+/* content formatted into reserved space is the same as by snprintf */
+static void test_printf(void) {
+	int rc = 0;
+	char expect[512];
+	char storage[16];
+	TTBuffer buf;
+
+	tt_buffer_init_inline(&buf, storage, sizeof(storage));
+	rc = tt_buffer_printf(&buf, "%s=%.30d|%-6x|%c", "key", -7, 255, '!');
+	snprintf(expect, sizeof(expect), "%s=%.30d|%-6x|%c", "key", -7, 255, '!');
+	CHECK(rc == (int)strlen(expect) && buf.used == strlen(expect));
+	CHECK(strcmp((char *)buf.content, expect) == 0);
+	CHECK(buf.is_malloced == 1); /* longer than storage, moved to heap */
+	rc = tt_buffer_printf(&buf, "%*s%ld", 20, "x", LONG_MIN);
+	snprintf(expect + strlen(expect), sizeof(expect) - strlen(expect), "%*s%ld", 20, "x", LONG_MIN);
+	CHECK(strcmp((char *)buf.content, expect) == 0);
+	tt_buffer_free(&buf);
+
+	tt_buffer_init(&buf);
+	tt_buffer_put_int(&buf, LONG_MIN);
+	tt_buffer_putc(&buf, ' ');
+	tt_buffer_put_csi(&buf, 94, 'm');
+	snprintf(expect, sizeof(expect), "%ld \033[94m", LONG_MIN);
+	CHECK(strcmp((char *)buf.content, expect) == 0);
+	tt_buffer_free(&buf);
+}
+
+/* hooks are set once before first allocation, later calls are rejected */
+static void test_allocator(void) {
+	TTBuffer buf;
+
+	CHECK(tt_buffer_allocator_set(NULL, NULL, NULL) == 0);
+	tt_buffer_init(&buf);
+	tt_buffer_write(&buf, "x", 1);
+	CHECK(tt_buffer_allocator_set(NULL, NULL, NULL) == -1);
+	tt_buffer_free(&buf);
+}
+
+int main(int argc, char *argv[]) {
+	test_allocator(); /* before any buffer allocates */
+	test_format_bound();
+	test_printf();
+	printf("%s: %d checks failed\n", argv[0], test_failed);
+	return test_failed != 0;
+}
@@ -0,0 +1,321 @@
+/* unit tests of line editing internals, terminal.c is included so static functions can be called.
+ * input is replayed from chunks by a transport without tty, an empty chunk is a pause longer than ESC timeout.
+ * exit status is the count of failed checks */
+#include "../terminal.c"
+
+#define TEST_ESC_MS        5 /* ESC timeout of terminal under test */
+#define TEST_PAUSE_MS      30 /* pause of empty chunk, longer than TEST_ESC_MS */
+#define TEST_CHUNKS        8
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		test_failed++; \
+	} \
+} while (0)
+
+static int test_failed;
+static const char *test_chunks[TEST_CHUNKS]; /* input replayed by test_read, NULL after last */
+static int test_chunk_next;
+static const void *test_handed; /* content handed to term_write_buffer by cmd_buffer */
+static int test_handed_written; /* transport was given test_handed itself */
+
+static ssize_t test_read(Terminal *term, void *buf, size_t count) {
+	size_t len = 0;
+	const char *chunk = test_chunk_next < TEST_CHUNKS ? test_chunks[test_chunk_next] : NULL;
+
+	if (chunk == NULL) {
+		return -1;
+	}
+	test_chunk_next++;
+	if (chunk[0] == '\0') { /* pause, timer of terminal is due meanwhile */
+		usleep(TEST_PAUSE_MS * 1000);
+		return 0;
+	}
+	len = strlen(chunk) < count ? strlen(chunk) : count;
+	memcpy(buf, chunk, len);
+	return len;
+}
+static ssize_t test_write(Terminal *term, const void *buf, size_t count) {
+	test_handed_written |= (test_handed != NULL && buf == test_handed);
+	return count;
+}
+static ssize_t test_writev(Terminal *term, const TermIOVec *iov, int iovcnt) {
+	int i = 0;
+	ssize_t count = 0;
+
+	for (i = 0; i < iovcnt; i++) {
+		test_handed_written |= (test_handed != NULL && iov[i].base == test_handed);
+		count += iov[i].len;
+	}
+	return count;
+}
+static void test_winsize(Terminal *term, int *cols, int *rows) {
+	*cols = 80;
+	*rows = 24;
+}
+static void test_timer(Terminal *term, int ms) {
+	/* test_read returns 0 after each pause, nothing to arm */
+}
+
+/* replay chunks from the next read on, input read ahead before is dropped */
+static void test_input(Terminal *term, const char *c0, const char *c1, const char *c2) {
+	memset(test_chunks, 0x00, sizeof(test_chunks));
+	test_chunks[0] = c0;
+	test_chunks[1] = c1;
+	test_chunks[2] = c2;
+	test_chunk_next = 0;
+	term->in_pos = 0;
+	term->in_len = 0;
+}
+
+static void cmd_lines(Terminal *term, int argc, const char **argv) {
+	term_printf(term, "alpha\nbeta\ngamma\nalphabet\ndelta\n");
+}
+
+static void cmd_buffer(Terminal *term, int argc, const char **argv) {
+	TTBuffer buf;
+
+	tt_buffer_init(&buf);
+	tt_buffer_printf(&buf, "%s\n", "content built by handler");
+	test_handed = buf.content;
+	term_write_buffer(term, &buf);
+}
+
+static Terminal *test_term_create(TermNode *root) {
+	Terminal *term = NULL;
+	TermTransport tp;
+
+	memset(&tp, 0x00, sizeof(tp));
+	tp.read = test_read;
+	tp.write = test_write;
+	tp.writev = test_writev;
+	tp.winsize = test_winsize;
+	tp.timer = test_timer;
+	if (0 != term_create_transport(&term, "test$", root, &tp, NULL)) {
+		return NULL;
+	}
+	term_esc_timeout_set(term, TEST_ESC_MS);
+	return term;
+}
+
+/* CSI and SS3 sequences by table, split reads, and ESC alone or broken sequence after timeout */
+static void test_decoder(Terminal *term) {
+	int i = 0;
+	struct {
+		const char *chunks[3];
+		int keys[2]; /* second key is 0 if none expected */
+	} cases[] = {
+		{{"\033[A"}, {KEY_UP}},
+		{{"\033OP"}, {KEY_FUN(1)}},
+		{{"\033[3~"}, {KEY_DELETE}},
+		{{"\033[24~"}, {KEY_FUN(12)}},
+		{{"\033[1;5C"}, {KEY_CTRL(KEY_RIGHT)}},
+		{{"\033[1;3D"}, {KEY_ALT(KEY_LEFT)}},
+		{{"\033[13u"}, {KEY_CR}},
+		{{"\033[", "B"}, {KEY_DOWN}}, /* rest of sequence in next read, before timeout */
+		{{"\033x"}, {KEY_ALT('x')}},
+		{{"\x7f"}, {KEY_BACKSPACE}},
+		{{"\033[?1u", "a"}, {-1, 'a'}}, /* private sequence is consumed and dropped */
+		{{"\033[1\r"}, {-1, KEY_CR}}, /* control char breaks sequence and is the next key */
+		{{"\033", "", "a"}, {KEY_ESC, 'a'}},
+		{{"\033[", "", "A"}, {-1, 'A'}},
+	};
+
+	for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+		test_input(term, cases[i].chunks[0], cases[i].chunks[1], cases[i].chunks[2]);
+		CHECK(term_getkey(term) == cases[i].keys[0]);
+		if (cases[i].keys[1] != 0) {
+			CHECK(term_getkey(term) == cases[i].keys[1]);
+		}
+		CHECK(term_getkey(term) == KEY_EOF);
+	}
+}
+
+/* content around the gap is kept while the gap moves and grows */
+static void test_gap_buffer(Terminal *term) {
+	int i = 0;
+	char big[300];
+
+	term_line_truncate(term, 0);
+	term_line_insert(term, 0, "helloworld", 10);
+	term_line_insert(term, 5, " ", 1);
+	CHECK(strcmp(term_line_join(term), "hello world") == 0);
+	term_line_gap_move(term, 2); /* chars after gap are read from tail */
+	CHECK(term_line_at(term, 1) == 'e' && term_line_at(term, 6) == 'w' && term_line_at(term, 10) == 'd');
+	term_line_erase(term, 0, 6);
+	CHECK(strcmp(term_line_join(term), "world") == 0);
+	for (i = 0; i < (int)sizeof(big); i++) {
+		big[i] = 'a' + i % 26;
+	}
+	term_line_insert(term, 2, big, sizeof(big)); /* space grows with content after gap */
+	CHECK(term->line_command.used + term->line_tail == sizeof(big) + 5);
+	term_line_join(term);
+	CHECK(memcmp(term->line_command.content, "wo", 2) == 0);
+	CHECK(memcmp(term->line_command.content + 2, big, sizeof(big)) == 0);
+	CHECK(strcmp((char *)(term->line_command.content) + 2 + sizeof(big), "rld") == 0);
+	term_line_gap_move(term, 1);
+	term_line_truncate(term, 4);
+	CHECK(strcmp(term_line_join(term), "woab") == 0);
+	term_line_truncate(term, 0);
+	CHECK(strcmp(term_line_join(term), "") == 0);
+}
+
+static void test_type(Terminal *term, const char *keys) {
+	for (; *keys != '\0'; keys++) {
+		term_key_process(term, *keys);
+	}
+}
+
+/* typed words are separate edits, backspaces merge, journal is trimmed to UNDO_BUDGET */
+static void test_undo(Terminal *term) {
+	int i = 0;
+
+	term_edit_reset(term);
+	term_refresh(term, 0, 0, 0);
+	test_type(term, "hello world");
+	CHECK(strcmp(term_line_join(term), "hello world") == 0);
+	term_key_process(term, KEY_CTRL('_'));
+	CHECK(strcmp(term_line_join(term), "hello ") == 0);
+	term_key_process(term, KEY_CTRL('_'));
+	CHECK(strcmp(term_line_join(term), "") == 0);
+	term_key_process(term, KEY_ALT('_'));
+	term_key_process(term, KEY_ALT('_'));
+	CHECK(strcmp(term_line_join(term), "hello world") == 0);
+	term_key_process(term, KEY_BACKSPACE);
+	term_key_process(term, KEY_BACKSPACE);
+	term_key_process(term, KEY_BACKSPACE);
+	CHECK(strcmp(term_line_join(term), "hello wo") == 0);
+	term_key_process(term, KEY_CTRL('_'));
+	CHECK(strcmp(term_line_join(term), "hello world") == 0);
+	test_type(term, "!"); /* redo is dropped by new edit */
+	term_key_process(term, KEY_ALT('_'));
+	CHECK(strcmp(term_line_join(term), "hello world!") == 0);
+
+	term_edit_reset(term);
+	term_refresh(term, 0, 0, 0);
+	for (i = 0; i < UNDO_BUDGET + 4096; i++) {
+		term_key_process(term, 'x');
+	}
+	CHECK(term->num == UNDO_BUDGET + 4096);
+	CHECK(term->edit_bytes <= UNDO_BUDGET);
+	for (i = 0; i < 16; i++) {
+		term_key_process(term, KEY_CTRL('_'));
+	}
+	CHECK(term->num > 0 && term->num < UNDO_BUDGET + 4096); /* oldest chars are not in journal anymore */
+	term_edit_reset(term);
+	CHECK(term->edit_bytes == 0);
+	term_refresh(term, 0, 0, 0);
+}
+
+static TermHistNode *test_hist_child(TermHistNode *node, const char *label) {
+	for (node = node->children; node != NULL && strcmp(node->label, label) != 0; node = node->next);
+	return node;
+}
+
+/* edges are split by insert, merged again when delete leaves a node with one child and no entry */
+static void test_history_trie(Terminal *term) {
+	TermHistNode *root = &(term->history_index), *node = NULL;
+
+	term_history_index_add(term, "show run", 0);
+	term_history_index_add(term, "show ver", 1);
+	term_history_index_add(term, "show", 2);
+	node = test_hist_child(root, "show");
+	CHECK(node != NULL && node->count == 3 && node->best == 2);
+	CHECK(node != NULL && test_hist_child(node, " ") != NULL && test_hist_child(node, " ")->count == 2);
+
+	term_history_index_del(term, "show rx"); /* not in tree, nothing is changed */
+	term_history_index_del(term, "shop");
+	CHECK(node->count == 3 && test_hist_child(node, " ")->count == 2);
+
+	term_history_index_del(term, "show run");
+	node = test_hist_child(root, "show");
+	CHECK(node != NULL && node->count == 2 && test_hist_child(node, " ver") != NULL); /* " " and "ver" merged */
+	term_history_index_del(term, "show");
+	CHECK(test_hist_child(root, "show ver") != NULL); /* no entry ends at "show" anymore */
+	term_history_index_del(term, "show ver");
+	CHECK(root->children == NULL);
+}
+
+/* output of handler through filters after '|' */
+static void test_filters(Terminal *term) {
+	int i = 0;
+	TTBuffer out;
+	struct {
+		const char *line;
+		TermExecStatus status;
+		const char *out;
+	} cases[] = {
+		{"lines | include alpha", E_EXEC_DONE, "alpha\nalphabet\n"},
+		{"lines | exclude alpha", E_EXEC_DONE, "beta\ngamma\ndelta\n"},
+		{"lines | begin gamma", E_EXEC_DONE, "gamma\nalphabet\ndelta\n"},
+		{"lines | count", E_EXEC_DONE, "Count: 5 lines\n"},
+		{"lines | include ^a | count", E_EXEC_DONE, "Count: 2 lines\n"},
+		{"lines | begin beta | exclude ta$", E_EXEC_DONE, "gamma\nalphabet\n"},
+		{"lines | unknown x", E_EXEC_INVALID_PIPE, ""},
+		{"lines | count x", E_EXEC_INVALID_PIPE, ""},
+	};
+
+	for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); i++) {
+		tt_buffer_init(&out);
+		CHECK(term_execute_capture(term, cases[i].line, strlen(cases[i].line), &out) == cases[i].status);
+		CHECK(out.used == strlen(cases[i].out) && (out.used == 0 || memcmp(out.content, cases[i].out, out.used) == 0));
+		tt_buffer_free(&out);
+	}
+}
+
+/* content of handler's TTBuffer reaches transport or capture without copy */
+static void test_write_buffer(Terminal *term) {
+	int fd = -1;
+	char path[] = "/tmp/test_terminal_XXXXXX";
+	TTBuffer out;
+
+	term_own(term, 1); /* as term_loop, handler runs unbatched */
+	ATOMIC_STORE_INT(&(term->served), 1);
+	term_edit_reset(term);
+	term_refresh(term, 0, 0, 0);
+	test_handed_written = 0;
+	test_type(term, "buffer");
+	term_key_process(term, KEY_CR);
+	CHECK(test_handed_written);
+	ATOMIC_STORE_INT(&(term->served), 0);
+	term_own(term, 0);
+
+	fd = mkstemp(path); /* script is run batched, content is an owned segment written by writev */
+	CHECK(fd >= 0 && write(fd, "buffer\nlines\n", 13) == 13);
+	close(fd);
+	test_handed_written = 0;
+	CHECK(term_batch_run(term, path) == 0);
+	CHECK(test_handed_written);
+	unlink(path);
+
+	tt_buffer_init(&out); /* empty capture takes content over */
+	CHECK(term_execute_capture(term, "buffer", 6, &out) == E_EXEC_DONE);
+	CHECK(out.content == test_handed && strcmp((char *)(out.content), "content built by handler\n") == 0);
+	tt_buffer_free(&out);
+	test_handed = NULL;
+}
+
+int main(int argc, char *argv[]) {
+	TermNode *root = NULL;
+	Terminal *term = NULL;
+
+	root = term_root_create();
+	term_node_child_add(root, TYPE_KEY, "lines", "Print some lines", cmd_lines);
+	term_node_child_add(root, TYPE_KEY, "buffer", "Print a TTBuffer", cmd_buffer);
+	term = test_term_create(root);
+	if (term == NULL) {
+		printf("terminal not created\n");
+		return 1;
+	}
+	test_decoder(term);
+	test_gap_buffer(term);
+	test_undo(term);
+	test_history_trie(term);
+	test_filters(term);
+	test_write_buffer(term);
+	term_destroy(term);
+	term_root_free(root);
+	printf("%s: %d checks failed\n", argv[0], test_failed);
+	return test_failed != 0;
+}
@@ -0,0 +1,193 @@
+/* throughput of term_execute_line from 1 to N threads, every thread has its own terminal on one shared root.
+ * usage: term_bench [threads] [ms]
+ * threads is the most threads measured, default count of online CPUs, ms is time of each round, default 1000.
+ * walks only read the tree, so while threads <= CPUs the speedup is expected to be near threads,
+ * about 0.8 to 0.9 per thread on an idle machine. exit status is 1 if a command failed or if a count
+ * within the CPUs scaled below BENCH_SCALE_MIN per thread; counts above the CPUs are printed only */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "terminal.h"
+
+#define BENCH_GROUPS       32 /* top level commands, each with a selector and text argument */
+#define BENCH_SCALE_MIN    0.5 /* least speedup per thread accepted while threads <= CPUs */
+
+typedef struct BenchRound {
+	TermNode *root;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int ready; /* threads created their terminal */
+	int go; /* set after all threads ready */
+	int stop; /* accessed with __atomic, tools build on linux only */
+} BenchRound;
+
+typedef struct BenchThread {
+	pthread_t tid;
+	BenchRound *round;
+	int index;
+	uint64_t calls;
+	int failed;
+} BenchThread;
+
+/* lines walked, keywords, options of selectors and quoted text */
+static const char *bench_lines[] = {
+	"group7 set mode fast 42",
+	"group12 show all",
+	"group3 set mode slow \"quoted text\"",
+	"group25 show status",
+	"group19 set level 3 abc",
+	"group30 show status",
+};
+
+static ssize_t bench_read(Terminal *term, void *buf, size_t count) {
+	return -1;
+}
+static ssize_t bench_write(Terminal *term, const void *buf, size_t count) {
+	return count;
+}
+
+static void cmd_show(Terminal *term, int argc, const char **argv) {
+	term_printf(term, "ok %s %s\n", argv[0], argv[argc - 1]);
+}
+static void cmd_set(Terminal *term, int argc, const char **argv) {
+	term_printf(term, "ok %s = %s\n", argv[2], argv[argc - 1]);
+}
+
+static TermNode *bench_tree(void) {
+	int i = 0;
+	char word[32];
+	TermNode *root = NULL, *group = NULL, *node = NULL, *sel = NULL;
+
+	root = term_root_create();
+	for (i = 0; i < BENCH_GROUPS; i++) {
+		snprintf(word, sizeof(word), "group%d", i);
+		group = term_node_child_add(root, TYPE_KEY, word, "Group of commands", NULL);
+		node = term_node_child_add(group, TYPE_KEY, "show", "Show", NULL);
+		/**/sel = term_node_select_add(node, "what", cmd_show);
+		/**//**/term_node_option_add(sel, "all", "Everything");
+		/**//**/term_node_option_add(sel, "status", "Status only");
+		node = term_node_child_add(group, TYPE_KEY, "set", "Set", NULL);
+		/**/sel = term_node_select_add(node, "name", NULL);
+		/**//**/term_node_option_add(sel, "mode", "Mode");
+		/**//**/term_node_option_add(sel, "level", "Level");
+		/**//**/node = term_node_child_add(sel, TYPE_TEXT, "value", "Value", NULL);
+		/**//**//**/term_node_child_add(node, TYPE_TEXT, "extra", "Extra value", cmd_set);
+	}
+	return root;
+}
+
+static uint64_t bench_time_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void *bench_thread(void *arg) {
+	int i = 0;
+	BenchThread *bt = (BenchThread *)arg;
+	BenchRound *round = bt->round;
+	const char *line = NULL;
+	Terminal *term = NULL;
+	TermTransport tp;
+
+	memset(&tp, 0x00, sizeof(tp));
+	tp.read = bench_read;
+	tp.write = bench_write;
+	if (0 != term_create_transport(&term, "bench$", round->root, &tp, NULL)) {
+		bt->failed = 1;
+	}
+	pthread_mutex_lock(&(round->lock));
+	round->ready++;
+	pthread_cond_broadcast(&(round->cond));
+	while (!round->go) {
+		pthread_cond_wait(&(round->cond), &(round->lock));
+	}
+	pthread_mutex_unlock(&(round->lock));
+	for (i = bt->index; term != NULL && !__atomic_load_n(&(round->stop), __ATOMIC_RELAXED); i++) {
+		line = bench_lines[i % (sizeof(bench_lines) / sizeof(bench_lines[0]))];
+		if (E_EXEC_DONE != term_execute_line(term, line, strlen(line))) {
+			bt->failed = 1;
+		}
+		bt->calls++;
+	}
+	if (term != NULL) {
+		term_destroy(term);
+	}
+	return NULL;
+}
+
+/* run threads for ms, return calls per second of all threads, < 0 if any command failed */
+static double bench_round(TermNode *root, int threads, int ms) {
+	int i = 0, failed = 0;
+	uint64_t calls = 0, start = 0, elapsed = 0;
+	BenchRound round;
+	BenchThread *bts = NULL;
+
+	memset(&round, 0x00, sizeof(round));
+	round.root = root;
+	pthread_mutex_init(&(round.lock), NULL);
+	pthread_cond_init(&(round.cond), NULL);
+	bts = (BenchThread *)calloc(threads, sizeof(BenchThread));
+	for (i = 0; i < threads; i++) {
+		bts[i].round = &round;
+		bts[i].index = i;
+		pthread_create(&(bts[i].tid), NULL, bench_thread, &(bts[i]));
+	}
+	pthread_mutex_lock(&(round.lock));
+	while (round.ready < threads) {
+		pthread_cond_wait(&(round.cond), &(round.lock));
+	}
+	round.go = 1;
+	start = bench_time_us();
+	pthread_cond_broadcast(&(round.cond));
+	pthread_mutex_unlock(&(round.lock));
+	usleep(ms * 1000);
+	__atomic_store_n(&(round.stop), 1, __ATOMIC_RELAXED);
+	for (i = 0; i < threads; i++) {
+		pthread_join(bts[i].tid, NULL);
+		calls += bts[i].calls;
+		failed |= bts[i].failed;
+	}
+	elapsed = bench_time_us() - start;
+	free(bts);
+	pthread_cond_destroy(&(round.cond));
+	pthread_mutex_destroy(&(round.lock));
+	return failed ? -1.0 : (double)calls * 1000000 / elapsed;
+}
+
+int main(int argc, char *argv[]) {
+	int threads = 0, ms = 0, n = 0, cpus = 0, ret = 0;
+	double rate = 0, base = 0, speedup = 0;
+	TermNode *root = NULL;
+
+	cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	cpus = cpus > 0 ? cpus : 1;
+	threads = argc > 1 ? atoi(argv[1]) : cpus;
+	threads = threads > 0 ? threads : 1;
+	ms = argc > 2 ? atoi(argv[2]) : 1000;
+	root = bench_tree();
+	printf("%d CPUs online, expected speedup near threads while threads <= CPUs, at least %.1fx per thread\n",
+		cpus, BENCH_SCALE_MIN);
+	printf("%7s %12s %12s %8s\n", "threads", "calls/s", "per thread", "speedup");
+	for (n = 1; n <= threads; n = n < threads && n * 2 > threads ? threads : n * 2) {
+		rate = bench_round(root, n, ms);
+		if (rate < 0) {
+			printf("command failed with %d threads\n", n);
+			ret = 1;
+			break;
+		}
+		base = n == 1 ? rate : base;
+		speedup = rate / base;
+		printf("%7d %12.0f %12.0f %7.2fx%s\n", n, rate, rate / n, speedup,
+			n > cpus ? " (more threads than CPUs)" : (speedup < n * BENCH_SCALE_MIN ? " (below expected)" : ""));
+		if (n <= cpus && speedup < n * BENCH_SCALE_MIN) {
+			ret = 1;
+		}
+	}
+	term_root_free(root);
+	return ret;
+}
@@ -0,0 +1,298 @@
+/* drive many sessions against term_server, some of them wait at the prompt of term_getline meanwhile.
+ * usage: term_load [sessions] [blocked] [address]
+ * without address, a server with "seq" and "set prompt" like testapp is started in this process with 4 workers,
+ * exit status is 0 only if every session got its output before timeout */
+#define _GNU_SOURCE /* memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "terminal.h"
+#include "term_server.h"
+
+#define LOAD_WORKERS       4
+#define LOAD_TIMEOUT       10000 /* ms for all sessions */
+#define LOAD_RECV_SIZE     8192
+
+typedef struct LoadStep {
+	const char *expect; /* wait until it is received, NULL for end of steps */
+	const char *send; /* sent after expect, NULL to stop until released */
+} LoadStep;
+
+typedef struct LoadSession {
+	int fd;
+	const LoadStep *steps;
+	int step;
+	int stopped; /* waiting for release at a step without send */
+	int done;
+	char recv[LOAD_RECV_SIZE]; /* received after last matched expect */
+	size_t used;
+	uint64_t start;
+	uint64_t end;
+} LoadSession;
+
+/* command run to the end by other sessions */
+static const LoadStep load_seq[] = {
+	{"Demo$", "seq 3\r"},
+	{"line 3", NULL},
+	{NULL, NULL},
+};
+/* handler waits for input at "user:", released after all seq sessions are done */
+static const LoadStep load_ask[] = {
+	{"Demo$", "set prompt X\r"},
+	{"user:", NULL},
+	{"", "load\r"},
+	{"password:", "123\r"},
+	{"X", NULL},
+	{NULL, NULL},
+};
+
+static uint64_t load_time_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void cmd_seq(Terminal *term, int argc, const char **argv) {
+	int i = 0, count = atoi(argv[1]);
+	for (i = 1; i <= count && !term_exec_cancelled(term); i++) {
+		term_printf(term, "line %d\n", i);
+	}
+}
+static void cmd_setprompt(Terminal *term, int argc, const char **argv) {
+	if (term_getline(term, "user:") == NULL) {
+		return;
+	}
+	if (term_password(term, "password:") != NULL) {
+		term_prompt_set(term, argv[2]);
+	}
+}
+
+static TermNode *load_tree(void) {
+	TermNode *root = NULL, *node = NULL;
+
+	root = term_root_create();
+	node = term_node_child_add(root, TYPE_KEY, "seq", "Print numbered lines", NULL);
+	/**/term_node_child_add(node, TYPE_TEXT, "count", "Count of lines", cmd_seq);
+	node = term_node_child_add(root, TYPE_KEY, "set", "Set", NULL);
+	/**/node = term_node_child_add(node, TYPE_KEY, "prompt", "Set prompt after login", NULL);
+	/**//**/term_node_child_add(node, TYPE_TEXT, "prompt", "New prompt", cmd_setprompt);
+	return root;
+}
+
+/* address is "unix:/path" or "tcp:port" or "tcp:host:port" as term_server_create */
+static int load_connect(const char *address) {
+	int fd = -1;
+	char *host = NULL, *port = NULL, *sep = NULL;
+	struct sockaddr_un sun;
+	struct addrinfo hints, *res = NULL, *cur = NULL;
+
+	if (0 == strncmp(address, "unix:", 5)) {
+		memset(&sun, 0x00, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, address + 5, sizeof(sun.sun_path) - 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd >= 0 && connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	} else if (0 == strncmp(address, "tcp:", 4)) {
+		host = strdup(address + 4);
+		sep = strrchr(host, ':');
+		if (sep != NULL) {
+			*sep = '\0';
+			port = sep + 1;
+		} else {
+			port = host;
+		}
+		memset(&hints, 0x00, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (0 == getaddrinfo(sep != NULL ? host : "127.0.0.1", port, &hints, &res)) {
+			for (cur = res; cur != NULL && fd < 0; cur = cur->ai_next) {
+				fd = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
+				if (fd >= 0 && connect(fd, cur->ai_addr, cur->ai_addrlen) < 0) {
+					close(fd);
+					fd = -1;
+				}
+			}
+			freeaddrinfo(res);
+		}
+		free(host);
+	}
+	return fd;
+}
+
+/* match expected output and send input after it, until a step without send or the end */
+static void load_advance(LoadSession *ls) {
+	char *found = NULL;
+	const LoadStep *step = NULL;
+
+	ls->stopped = 0;
+	while (!ls->done && !ls->stopped) {
+		step = &(ls->steps[ls->step]);
+		found = memmem(ls->recv, ls->used, step->expect, strlen(step->expect));
+		if (found == NULL) {
+			return;
+		}
+		ls->used -= found + strlen(step->expect) - ls->recv;
+		memmove(ls->recv, found + strlen(step->expect), ls->used);
+		if (step->send != NULL && send(ls->fd, step->send, strlen(step->send), MSG_NOSIGNAL) < 0) {
+			return;
+		}
+		ls->step++;
+		ls->stopped = step->send == NULL;
+		if (ls->steps[ls->step].expect == NULL) {
+			ls->done = 1;
+			ls->end = load_time_ms();
+		}
+	}
+}
+
+/* read all sessions until each of them is done or stopped, return count not finished */
+static int load_run(LoadSession *sessions, int num, uint64_t deadline) {
+	int i = 0, left = 0, rc = 0, timeout = 0;
+	uint64_t now = 0;
+	struct pollfd *pfds = NULL;
+
+	pfds = (struct pollfd *)malloc(sizeof(struct pollfd) * num);
+	while (1) {
+		left = 0;
+		for (i = 0; i < num; i++) {
+			pfds[i].fd = sessions[i].fd;
+			pfds[i].events = POLLIN;
+			pfds[i].revents = 0;
+			if (sessions[i].done || sessions[i].stopped) {
+				pfds[i].fd = -1;
+			} else {
+				left++;
+			}
+		}
+		now = load_time_ms();
+		if (left == 0 || now >= deadline) {
+			break;
+		}
+		timeout = (int)(deadline - now);
+		if (poll(pfds, num, timeout) < 0 && errno != EINTR) {
+			break;
+		}
+		for (i = 0; i < num; i++) {
+			if (pfds[i].fd < 0 || pfds[i].revents == 0) {
+				continue;
+			}
+			if (sessions[i].used == sizeof(sessions[i].recv)) { /* expected output is at the end */
+				sessions[i].used = sizeof(sessions[i].recv) / 2;
+				memmove(sessions[i].recv, sessions[i].recv + sizeof(sessions[i].recv) / 2, sessions[i].used);
+			}
+			rc = recv(sessions[i].fd, sessions[i].recv + sessions[i].used, sizeof(sessions[i].recv) - sessions[i].used, 0);
+			if (rc <= 0) { /* closed by server, counted as not finished */
+				close(sessions[i].fd);
+				sessions[i].fd = -1;
+				sessions[i].done = 1;
+				sessions[i].end = 0;
+				continue;
+			}
+			sessions[i].used += rc;
+			load_advance(&(sessions[i]));
+		}
+	}
+	free(pfds);
+	return left;
+}
+
+int main(int argc, char *argv[]) {
+	int i = 0, num = 0, blocked = 0, total = 0, ok = 0, ret = 1;
+	char address[64];
+	uint64_t start = 0, latency = 0, latency_max = 0, latency_sum = 0;
+	TermNode *root = NULL;
+	TermServer *server = NULL;
+	LoadSession *sessions = NULL;
+
+	num = argc > 1 ? atoi(argv[1]) : 200;
+	blocked = argc > 2 ? atoi(argv[2]) : LOAD_WORKERS * 2;
+	if (argc > 3) {
+		snprintf(address, sizeof(address), "%s", argv[3]);
+	} else {
+		snprintf(address, sizeof(address), "unix:/tmp/term_load.%d.sock", (int)getpid());
+		root = load_tree();
+		if (0 != term_server_create(&server, address, "Demo$", root, LOAD_WORKERS, TERM_SERVER_TELNET)) {
+			printf("listen on \"%s\" failed\n", address);
+			goto func_end;
+		}
+	}
+	sessions = (LoadSession *)calloc(blocked + num, sizeof(LoadSession));
+	if (sessions == NULL) {
+		goto func_end;
+	}
+	total = blocked + num;
+	for (i = 0; i < total; i++) {
+		sessions[i].steps = i < blocked ? load_ask : load_seq;
+		sessions[i].fd = load_connect(address);
+		if (sessions[i].fd < 0) {
+			printf("connect session %d to \"%s\" failed: %s\n", i, address, strerror(errno));
+			total = i;
+			goto func_end;
+		}
+	}
+
+	/* handlers of blocked sessions wait for input at "user:" before others start */
+	load_run(sessions, blocked, load_time_ms() + LOAD_TIMEOUT);
+	for (i = 0; i < blocked; i++) {
+		if (!sessions[i].stopped) {
+			printf("blocked session %d not at \"user:\"\n", i);
+			goto func_end;
+		}
+	}
+	start = load_time_ms();
+	for (i = blocked; i < total; i++) {
+		sessions[i].start = start;
+	}
+	load_run(sessions + blocked, num, start + LOAD_TIMEOUT);
+	for (i = blocked; i < total; i++) {
+		if (sessions[i].done && sessions[i].end > 0) {
+			latency = sessions[i].end - sessions[i].start;
+			latency_max = latency > latency_max ? latency : latency_max;
+			latency_sum += latency;
+			ok++;
+		}
+	}
+	printf("%d sessions with %d waiting for input: %d done, latency avg %.1f ms, max %" PRIu64 " ms\n",
+		num, blocked, ok, ok > 0 ? (double)latency_sum / ok : 0.0, latency_max);
+
+	/* answer handlers waiting for input, they must finish too */
+	for (i = 0; i < blocked; i++) {
+		load_advance(&(sessions[i]));
+	}
+	load_run(sessions, blocked, load_time_ms() + LOAD_TIMEOUT);
+	for (i = 0; i < blocked; i++) {
+		if (!sessions[i].done || sessions[i].end == 0) {
+			printf("blocked session %d not finished after input\n", i);
+			ok = -1;
+		}
+	}
+	ret = ok == num ? 0 : 1;
+func_end:
+	for (i = 0; i < total; i++) {
+		if (sessions[i].fd >= 0) {
+			close(sessions[i].fd);
+		}
+	}
+	if (sessions != NULL) {
+		free(sessions);
+	}
+	if (server != NULL) {
+		term_server_destroy(server);
+	}
+	if (root != NULL) {
+		term_root_free(root);
+	}
+	return ret;
+}
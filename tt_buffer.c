@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <limits.h>
 #ifndef __TT_BUFFER_H__
 #include "tt_buffer.h"
 #endif
@@ -12,16 +13,47 @@
 #define MY_FREE(x) my_free((x), __FILE__, __LINE__)
 #define MY_REALLOC(x, y) my_realloc((x), (y), __FILE__, __LINE__)
 #else
-#define MY_MALLOC(x) malloc((x))
-#define MY_FREE(x) free((x))
-#define MY_REALLOC(x, y) realloc((x), (y))
+#define MY_MALLOC(x) tt_alloc((x))
+#define MY_FREE(x) tt_release((x))
+#define MY_REALLOC(x, y) tt_resize((x), (y))
 #endif
 
 #ifndef INIT_BUFFER_SPACE
-/* init space is 1024 bytes */
-#define INIT_BUFFER_SPACE 1024
+/* init space is 64 bytes, short contents are kept in storage of caller by tt_buffer_init_inline */
+#define INIT_BUFFER_SPACE 64
 #endif
 
+static int tt_alloc_started; /* set by first allocation or allocator_set, hooks never change after it */
+
+static void *tt_malloc_default(size_t size) {
+	if (!tt_alloc_started) { /* written only until first allocation, later calls only read */
+		tt_alloc_started = 1;
+	}
+	return malloc(size);
+}
+
+static void *tt_realloc_default(void *ptr, size_t size) {
+	if (!tt_alloc_started) {
+		tt_alloc_started = 1;
+	}
+	return realloc(ptr, size);
+}
+
+static void *(*tt_alloc)(size_t) = tt_malloc_default;
+static void *(*tt_resize)(void *, size_t) = tt_realloc_default;
+static void (*tt_release)(void *) = free;
+
+int tt_buffer_allocator_set(void *(*alloc)(size_t), void *(*resize)(void *, size_t), void (*release)(void *)) {
+	if (tt_alloc_started) { /* content of buffers may be freed by other functions than allocated it */
+		return -1;
+	}
+	tt_alloc_started = 1;
+	tt_alloc = alloc != NULL ? alloc : malloc;
+	tt_resize = resize != NULL ? resize : realloc;
+	tt_release = release != NULL ? release : free;
+	return 0;
+}
+
 int tt_buffer_init(TTBuffer *buffer) {
 	if (buffer == NULL) {
 		return -1;
@@ -33,11 +65,25 @@ int tt_buffer_init(TTBuffer *buffer) {
 	return 0;
 }
 
+int tt_buffer_init_inline(TTBuffer *buffer, void *storage, size_t size) {
+	if (buffer == NULL || storage == NULL || size == 0) {
+		return -1;
+	}
+	buffer->content = (unsigned char *)storage;
+	buffer->content[0] = '\0';
+	buffer->used = 0;
+	buffer->space = size;
+	buffer->is_malloced = TT_BUFFER_INLINE;
+	return 0;
+}
+
 int tt_buffer_free(TTBuffer *buffer) {
 	if (buffer == NULL) {
 		return -1;
 	}
-	if (buffer->is_malloced) {
+	if (buffer->is_malloced == TT_BUFFER_INLINE) {
+		buffer->is_malloced = 0;
+	} else if (buffer->is_malloced) {
 		buffer->is_malloced = 0;
 		if (buffer->content != NULL) {
 			MY_FREE(buffer->content);
@@ -57,46 +103,77 @@ int tt_buffer_empty(TTBuffer *buffer) {
 	return 0;
 }
 
-int tt_buffer_swapto_malloced(TTBuffer *buffer, size_t content_len) {
-	unsigned char *buf_bak = NULL;
-	if (!(buffer->is_malloced)) {
-		/* malloc size INIT_BUFFER_SPACE */
-		buffer->space = INIT_BUFFER_SPACE;
-		while (buffer->used + content_len + 1 > buffer->space) {
-			buffer->space <<= 1;
+/* move content to heap if it is not there, space is doubled until content_len more bytes and '\0' fit,
+ * content after used is kept by realloc */
+static int tt_buffer_grow(TTBuffer *buffer, size_t content_len, int to_heap) {
+	unsigned char *content = NULL;
+	size_t space = buffer->space;
+
+	if (buffer->is_malloced == 1) {
+		if (buffer->used + content_len + 1 <= space) {
+			return 0;
 		}
-		buffer->is_malloced = 1;
-		if (buffer->used) {
-			buf_bak = buffer->content;
-			buffer->content = (unsigned char *)MY_MALLOC(buffer->space);
-			if (buffer->content == NULL) {
-				printf("ERROR: malloc failed at %s %d\n", __FILE__, __LINE__);
-				buffer->content = buf_bak;
-				buffer->is_malloced = 0;
-				buffer->space = 0;
-				return -1;
-			}
-			memcpy(buffer->content, buf_bak, buffer->used);
-			*(buffer->content + buffer->used) = '\0'; /* must be end with '\0' for compatible with string */
-		} else {
-			buffer->content = (unsigned char *)MY_MALLOC(buffer->space);
-			if (buffer->content == NULL) {
-				printf("ERROR: malloc failed at %s %d\n", __FILE__, __LINE__);
-				tt_buffer_init(buffer);
-				return -1;
-			}
+		while (buffer->used + content_len + 1 > space) {
+			space <<= 1;
+		}
+		content = (unsigned char *)MY_REALLOC(buffer->content, space);
+		if (content == NULL) {
+			printf("ERROR: realloc failed at %s %d\n", __FILE__, __LINE__);
+			return -1;
 		}
 	} else {
-		while (buffer->used + content_len + 1 > buffer->space) {
-			buffer->space <<= 1;
+		if (!to_heap && buffer->is_malloced == TT_BUFFER_INLINE && buffer->used + content_len + 1 <= space) {
+			return 0; /* still fit in storage of caller */
 		}
-		buffer->content = (unsigned char *)MY_REALLOC(buffer->content, buffer->space);
-		if (buffer->content == NULL) {
-			printf("ERROR: realloc failed at %s %d\n", __FILE__, __LINE__);
-			tt_buffer_init(buffer);
+		space = space > INIT_BUFFER_SPACE ? space : INIT_BUFFER_SPACE;
+		while (buffer->used + content_len + 1 > space) {
+			space <<= 1;
+		}
+		content = (unsigned char *)MY_MALLOC(space);
+		if (content == NULL) {
+			printf("ERROR: malloc failed at %s %d\n", __FILE__, __LINE__);
 			return -1;
 		}
+		if (buffer->used) {
+			memcpy(content, buffer->content, buffer->used);
+		}
+		content[buffer->used] = '\0'; /* must be end with '\0' for compatible with string */
+		buffer->is_malloced = 1;
+	}
+	buffer->content = content;
+	buffer->space = space;
+	return 0;
+}
+
+int tt_buffer_swapto_malloced(TTBuffer *buffer, size_t content_len) {
+	return tt_buffer_grow(buffer, content_len, 1);
+}
+
+int tt_buffer_reserve(TTBuffer *buffer, size_t content_len) {
+	if (buffer == NULL) {
+		return -1;
 	}
+	return tt_buffer_grow(buffer, content_len, 0);
+}
+
+int tt_buffer_shrink(TTBuffer *buffer) {
+	unsigned char *content = NULL;
+
+	if (buffer == NULL) {
+		return -1;
+	}
+	if (buffer->is_malloced != 1 || buffer->used + 1 >= buffer->space) {
+		return 0;
+	}
+	if (buffer->used == 0) {
+		return tt_buffer_free(buffer);
+	}
+	content = (unsigned char *)MY_REALLOC(buffer->content, buffer->used + 1);
+	if (content == NULL) { /* content is kept in larger space */
+		return 0;
+	}
+	buffer->content = content;
+	buffer->space = buffer->used + 1;
 	return 0;
 }
 /*
@@ -151,57 +228,141 @@ DDD
 ret: 5
 E
 */
+/* upper bound of length formatted, args are consumed, return -1 if format has conversions not estimated */
+static int tt_buffer_format_bound(const char *format, va_list args) {
+	const char *p = NULL, *str = NULL;
+	size_t bound = 0, len = 0, width = 0;
+	int prec = 0, lmod = 0, value = 0;
+
+	for (p = format; *p != '\0'; p++) {
+		if (*p != '%') {
+			bound++;
+			continue;
+		}
+		p++;
+		if (*p == '%') {
+			bound++;
+			continue;
+		}
+		for (; *p != '\0' && strchr("-+ #0", *p) != NULL; p++);
+		width = 0;
+		if (*p == '*') {
+			value = va_arg(args, int);
+			value = value < -INT_MAX ? -INT_MAX : value; /* -INT_MIN overflows, such a width is too long anyway */
+			width = value < 0 ? -value : value;
+			p++;
+		}
+		for (; *p >= '0' && *p <= '9'; p++) {
+			width = width * 10 + (*p - '0');
+		}
+		prec = -1;
+		if (*p == '.') {
+			p++;
+			prec = 0;
+			if (*p == '*') {
+				prec = va_arg(args, int);
+				prec = prec < 0 ? -1 : prec;
+				p++;
+			}
+			for (; *p >= '0' && *p <= '9'; p++) {
+				prec = prec * 10 + (*p - '0');
+			}
+		}
+		lmod = 0;
+		for (; *p != '\0' && strchr("hlzjt", *p) != NULL; p++) {
+			lmod = (lmod == 'l' && *p == 'l') ? 'L' : *p; /* 'L' for ll */
+		}
+		switch (*p) {
+		case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+			if (lmod == 'L') {
+				(void)va_arg(args, long long);
+			} else if (lmod == 'l') {
+				(void)va_arg(args, long);
+			} else if (lmod == 'z') {
+				(void)va_arg(args, size_t);
+			} else if (lmod == 'j' || lmod == 't') {
+				return -1;
+			} else {
+				(void)va_arg(args, int);
+			}
+			len = prec > 22 ? prec + 2 : 24; /* octal of 64 bits and sign, or precision digits after sign or 0x */
+			break;
+		case 'c':
+			if (lmod != 0) {
+				return -1;
+			}
+			(void)va_arg(args, int);
+			len = 1;
+			break;
+		case 's':
+			if (lmod != 0) {
+				return -1;
+			}
+			str = va_arg(args, const char *);
+			str = str != NULL ? str : "(null)";
+			for (len = 0; (prec < 0 || len < (size_t)prec) && str[len] != '\0'; len++);
+			break;
+		case 'p':
+			(void)va_arg(args, void *);
+			len = 24;
+			break;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+			if (lmod != 0 && lmod != 'l') {
+				return -1;
+			}
+			(void)va_arg(args, double);
+			len = 320 + (prec < 0 ? 6 : prec); /* digits of DBL_MAX in %f */
+			break;
+		default:
+			return -1;
+		}
+		bound += len > width ? len : width;
+		if (bound >= INT_MAX) { /* too long to reserve, left to vsnprintf */
+			return -1;
+		}
+	}
+	return (int)bound;
+}
+
+/* space is reserved by length estimated from args, so content is formatted once,
+ * formatted again only if format is not estimated and space was short */
 int tt_buffer_vprintf(TTBuffer *buffer, const char *format, va_list args) {
-	int rc = 0;
-	va_list args_bk;
-	va_copy(args_bk, args);
+	int rc = 0, bound = 0;
+	va_list args_bk, args_start;
+
 	if (buffer == NULL || format == NULL) {
 		return -1;
 	}
-	if (!(buffer->is_malloced)) {
-		if (0 != tt_buffer_swapto_malloced(buffer, 0)) {
-			return -1;
-		}
+	va_copy(args_start, args); /* args is consumed by first vsnprintf */
+	va_copy(args_bk, args);
+	bound = tt_buffer_format_bound(format, args_bk);
+	va_end(args_bk);
+	if (0 != tt_buffer_reserve(buffer, bound > 0 ? bound : 0)) {
+		rc = -1;
+		goto func_end;
 	}
 
 	*(buffer->content + buffer->space - 1) = '\0';
-#ifdef _WIN32
-	/* windows */
-	rc = vsprintf_s((char *)buffer->content + buffer->used, buffer->space - buffer->used, format, args);
-	if (rc < 0) {
-		do {
-			buffer->space <<= 1;
-			buffer->content = (unsigned char *)MY_REALLOC(buffer->content, buffer->space);
-			if (buffer->content == NULL) {
-				printf("ERROR: realloc failed at %s %d\n", __FILE__, __LINE__);
-				tt_buffer_init(buffer);
-				return -1;
-			}
-			va_copy(args, args_bk);
-			rc = vsnprintf((char *)buffer->content + buffer->used, buffer->space - buffer->used, format, args);
-			*(buffer->content + buffer->space - 1) = '\0';
-		} while (rc < 0);
-	}
-#else
-	/* linux */
 	rc = vsnprintf((char *)buffer->content + buffer->used, buffer->space - buffer->used, format, args);
-	if (buffer->used + (size_t)rc + 1 > buffer->space) { /* need space size is rc + 1('\0') */
-		/* need space large then free space, realloc and rewrite */
-		while (buffer->used + (size_t)rc + 1 > buffer->space) {
-			buffer->space <<= 1;
+	while (rc < 0 || buffer->used + (size_t)rc + 1 > buffer->space) { /* need space size is rc + 1('\0') */
+#ifndef _WIN32
+		if (rc < 0) { /* output error, windows returns -1 if space is short */
+			goto func_end;
 		}
-		buffer->content = (unsigned char *)MY_REALLOC(buffer->content, buffer->space);
-		if (buffer->content == NULL) {
-			printf("ERROR: realloc failed at %s %d\n", __FILE__, __LINE__);
-			tt_buffer_init(buffer);
-			return -1;
+#endif
+		/* need space large then free space, realloc and rewrite */
+		if (0 != tt_buffer_reserve(buffer, rc < 0 ? buffer->space - buffer->used : (size_t)rc)) {
+			rc = -1;
+			goto func_end;
 		}
-		va_copy(args, args_bk);
-		rc = vsnprintf((char *)buffer->content + buffer->used, buffer->space - buffer->used, format, args);
+		va_copy(args_bk, args_start);
+		rc = vsnprintf((char *)buffer->content + buffer->used, buffer->space - buffer->used, format, args_bk);
+		va_end(args_bk);
 		*(buffer->content + buffer->space - 1) = '\0';
 	}
-#endif
 	buffer->used += rc;
+func_end:
+	va_end(args_start);
 	return rc;
 }
 
@@ -221,22 +382,8 @@ int tt_buffer_write(TTBuffer *buffer, const void *content, size_t content_len) {
 	if (buffer == NULL || content == NULL) {
 		return -1;
 	}
-	if (!(buffer->is_malloced)) {
-		if (0 != tt_buffer_swapto_malloced(buffer, content_len)) {
-			return -1;
-		}
-	}
-	/* need space large then free space, realloc and rewrite */
-	if (buffer->used + content_len + 1 > buffer->space) {
-		while (buffer->used + content_len + 1 > buffer->space) {
-			buffer->space <<= 1;
-		}
-		buffer->content = (unsigned char *)MY_REALLOC(buffer->content, buffer->space);
-		if (buffer->content == NULL) {
-			printf("ERROR: realloc failed at %s %d\n", __FILE__, __LINE__);
-			tt_buffer_init(buffer);
-			return -1;
-		}
+	if (0 != tt_buffer_reserve(buffer, content_len)) {
+		return -1;
 	}
 	memcpy(buffer->content + buffer->used, content, content_len);
 	buffer->used += content_len;
@@ -244,6 +391,42 @@ int tt_buffer_write(TTBuffer *buffer, const void *content, size_t content_len) {
 	return 0;
 }
 
+int tt_buffer_putc(TTBuffer *buffer, char ch) {
+	if (buffer == NULL || 0 != tt_buffer_reserve(buffer, 1)) {
+		return -1;
+	}
+	buffer->content[buffer->used++] = (unsigned char)ch;
+	buffer->content[buffer->used] = '\0';
+	return 0;
+}
+
+int tt_buffer_put_int(TTBuffer *buffer, long value) {
+	char digits[24];
+	int len = sizeof(digits);
+	unsigned long mag = value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+
+	do {
+		digits[--len] = (char)('0' + mag % 10);
+		mag /= 10;
+	} while (mag > 0);
+	if (value < 0) {
+		digits[--len] = '-';
+	}
+	return tt_buffer_write(buffer, digits + len, sizeof(digits) - len);
+}
+
+int tt_buffer_put_csi(TTBuffer *buffer, int param, char final) {
+	if (buffer == NULL || 0 != tt_buffer_reserve(buffer, 24)) {
+		return -1;
+	}
+	buffer->content[buffer->used++] = '\033';
+	buffer->content[buffer->used++] = '[';
+	if (param >= 0 && tt_buffer_put_int(buffer, param) != 0) {
+		return -1;
+	}
+	return tt_buffer_putc(buffer, final);
+}
+
 int tt_buffer_no_copy(TTBuffer *buffer, void *content, size_t used, size_t space, int is_malloced) {
 	int ret = 0;
 	if (buffer == NULL || content == NULL) {
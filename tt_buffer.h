@@ -2,6 +2,7 @@
 #define __TT_BUFFER_H__
 
 #include <stdarg.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -11,13 +12,26 @@ typedef struct TTBuffer {
 	unsigned char *content; /* point to content */
 	size_t used; /* size of used space */
 	size_t space; /* size of malloc space */
-	int is_malloced; /* mark content is malloced or not */
+	int is_malloced; /* mark content is malloced or not, TT_BUFFER_INLINE if content is storage of caller */
 } TTBuffer;
 
+#define TT_BUFFER_INLINE 2
+
+
 extern int tt_buffer_init(TTBuffer *buffer);
 extern int tt_buffer_free(TTBuffer *buffer);
 extern int tt_buffer_empty(TTBuffer *buffer);
 extern int tt_buffer_swapto_malloced(TTBuffer *buffer, size_t content_len);
+/* write into storage of caller (stack or struct) until it is full, then content is moved to heap,
+ * storage must be valid until tt_buffer_free */
+extern int tt_buffer_init_inline(TTBuffer *buffer, void *storage, size_t size);
+/* make space for content_len more bytes and '\0' after them */
+extern int tt_buffer_reserve(TTBuffer *buffer, size_t content_len);
+/* release space not used, content is freed if empty */
+extern int tt_buffer_shrink(TTBuffer *buffer);
+/* functions of all allocations, NULL for malloc, realloc and free. hooks are global and not locked, so it is
+ * called once at start before any buffer allocates and before threads are created, return -1 if called later */
+extern int tt_buffer_allocator_set(void *(*alloc)(size_t), void *(*resize)(void *, size_t), void (*release)(void *));
 extern int tt_buffer_vprintf(TTBuffer *buffer, const char *format, va_list args);
 #if defined(_WIN32)
 extern int tt_buffer_printf(TTBuffer *buffer, const char *format, ...);
@@ -25,6 +39,11 @@ extern int tt_buffer_printf(TTBuffer *buffer, const char *format, ...);
 extern int tt_buffer_printf(TTBuffer *buffer, const char *format, ...) __attribute__((format(printf, 2, 3)));
 #endif
 extern int tt_buffer_write(TTBuffer *buffer, const void *content, size_t content_len);
+/* append without format, for short output written often */
+extern int tt_buffer_putc(TTBuffer *buffer, char ch);
+extern int tt_buffer_put_int(TTBuffer *buffer, long value);
+/* append ESC [ param final, param is omitted if < 0 */
+extern int tt_buffer_put_csi(TTBuffer *buffer, int param, char final);
 extern int tt_buffer_no_copy(TTBuffer *buffer, void *content, size_t used, size_t space, int is_malloced);
 
 #ifdef __cplusplus
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#ifndef __TT_MALLOC_DEBUG_H__
+#include "tt_malloc_debug.h"
+#endif
+
+/* first call of my_malloc may come from any thread, so lock is initialized statically */
+#if defined(_WIN32)
+static SRWLOCK watch_lock = SRWLOCK_INIT;
+#define WATCH_LOCK() AcquireSRWLockExclusive(&watch_lock)
+#define WATCH_UNLOCK() ReleaseSRWLockExclusive(&watch_lock)
+#else
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+#define WATCH_LOCK() pthread_mutex_lock(&watch_lock)
+#define WATCH_UNLOCK() pthread_mutex_unlock(&watch_lock)
+#endif
+
+#define WATCH_SITES        1024 /* slots of call site table, power of 2, sites beyond it are counted as "other" */
+#define WATCH_LINE_SIZE    256
+
+typedef struct TTMallocSite {
+	const char *file; /* __FILE__ of caller, compared by pointer */
+	int line;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t bytes;
+	size_t live;
+	size_t peak;
+} TTMallocSite;
+
+/* put before each block, so free finds size and site of block, union keeps block aligned as malloc does */
+typedef union TTMallocHead {
+	struct {
+		size_t size;
+		TTMallocSite *site;
+	} h;
+	long double align_ld;
+	void *align_p;
+	uint64_t align_u64;
+} TTMallocHead;
+
+static TTMallocSite watch_sites[WATCH_SITES];
+static TTMallocSite watch_other = {"other", 0, 0, 0, 0, 0, 0};
+static TTMallocTotals watch_totals;
+
+static TTMallocSite *watch_site_get(const char *file, int line) {
+	size_t i = 0, pos = 0;
+	pos = (((uintptr_t)file >> 3) * 31 + (unsigned int)line) & (WATCH_SITES - 1);
+	for (i = 0; i < WATCH_SITES; i++, pos = (pos + 1) & (WATCH_SITES - 1)) {
+		if (watch_sites[pos].file == file && watch_sites[pos].line == line) {
+			return &(watch_sites[pos]);
+		}
+		if (watch_sites[pos].file == NULL) {
+			watch_sites[pos].file = file;
+			watch_sites[pos].line = line;
+			return &(watch_sites[pos]);
+		}
+	}
+	return &watch_other;
+}
+
+/* called with watch_lock held */
+static void watch_add(TTMallocHead *head, size_t size, const char *file, int line) {
+	TTMallocSite *site = watch_site_get(file, line);
+	head->h.size = size;
+	head->h.site = site;
+	site->allocs++;
+	site->bytes += size;
+	site->live += size;
+	if (site->live > site->peak) {
+		site->peak = site->live;
+	}
+	watch_totals.allocs++;
+	watch_totals.bytes += size;
+	watch_totals.live += size;
+	if (watch_totals.live > watch_totals.peak) {
+		watch_totals.peak = watch_totals.live;
+	}
+}
+
+/* called with watch_lock held, block is charged to site which allocated it */
+static void watch_del(TTMallocHead *head) {
+	TTMallocSite *site = head->h.site;
+	site->frees++;
+	site->live -= head->h.size;
+	watch_totals.frees++;
+	watch_totals.live -= head->h.size;
+}
+
+void *my_malloc(size_t size, const char *file, int line) {
+	TTMallocHead *head = NULL;
+	if (size > SIZE_MAX - sizeof(TTMallocHead)) {
+		return NULL;
+	}
+	head = (TTMallocHead *)malloc(sizeof(TTMallocHead) + size);
+	if (head == NULL) {
+		return NULL;
+	}
+	WATCH_LOCK();
+	watch_add(head, size, file, line);
+	WATCH_UNLOCK();
+	return head + 1;
+}
+
+void my_free(void *ptr, const char *file, int line) {
+	TTMallocHead *head = NULL;
+	if (ptr == NULL) {
+		return;
+	}
+	head = (TTMallocHead *)ptr - 1;
+	WATCH_LOCK();
+	watch_del(head);
+	WATCH_UNLOCK();
+	free(head);
+}
+
+/* counted as free of old block by its site and allocation of new size by caller,
+ * so growth of buffers shows up at the line which grows them */
+void *my_realloc(void *ptr, size_t size, const char *file, int line) {
+	TTMallocHead *head = NULL, *old = NULL;
+	TTMallocHead save;
+	if (ptr == NULL) {
+		return my_malloc(size, file, line);
+	}
+	if (size > SIZE_MAX - sizeof(TTMallocHead)) {
+		return NULL;
+	}
+	old = (TTMallocHead *)ptr - 1;
+	save = *old;
+	head = (TTMallocHead *)realloc(old, sizeof(TTMallocHead) + size);
+	if (head == NULL) {
+		return NULL; /* old block is untouched */
+	}
+	WATCH_LOCK();
+	watch_del(&save);
+	watch_add(head, size, file, line);
+	WATCH_UNLOCK();
+	return head + 1;
+}
+
+char *my_strdup(const char *str, const char *file, int line) {
+	size_t len = strlen(str);
+	char *dup = (char *)my_malloc(len + 1, file, line);
+	if (dup != NULL) {
+		memcpy(dup, str, len + 1);
+	}
+	return dup;
+}
+
+void tt_malloc_totals(TTMallocTotals *totals) {
+	WATCH_LOCK();
+	*totals = watch_totals;
+	WATCH_UNLOCK();
+}
+
+static void watch_site_reset(TTMallocSite *site) {
+	site->allocs = 0;
+	site->frees = 0;
+	site->bytes = 0;
+	site->peak = site->live;
+}
+
+void tt_malloc_reset(void) {
+	int i = 0;
+	WATCH_LOCK();
+	for (i = 0; i < WATCH_SITES; i++) {
+		if (watch_sites[i].file != NULL) {
+			watch_site_reset(&(watch_sites[i]));
+		}
+	}
+	watch_site_reset(&watch_other);
+	watch_totals.allocs = 0;
+	watch_totals.frees = 0;
+	watch_totals.bytes = 0;
+	watch_totals.peak = watch_totals.live;
+	WATCH_UNLOCK();
+}
+
+static int watch_site_cmp(const void *a, const void *b) {
+	const TTMallocSite *sa = (const TTMallocSite *)a, *sb = (const TTMallocSite *)b;
+	if (sa->bytes != sb->bytes) {
+		return sa->bytes < sb->bytes ? 1 : -1;
+	}
+	return sa->allocs < sb->allocs ? 1 : (sa->allocs > sb->allocs ? -1 : 0);
+}
+
+void tt_malloc_report(void (*print)(void *userdata, const char *line), void *userdata) {
+	int i = 0, num = 0;
+	const char *name = NULL;
+	char line[WATCH_LINE_SIZE];
+	TTMallocTotals totals;
+	TTMallocSite *sites = NULL;
+
+	/* copied under lock and printed after it, print may allocate */
+	sites = (TTMallocSite *)malloc(sizeof(TTMallocSite) * (WATCH_SITES + 1));
+	if (sites == NULL) {
+		return;
+	}
+	WATCH_LOCK();
+	for (i = 0; i < WATCH_SITES; i++) {
+		if (watch_sites[i].file != NULL && (watch_sites[i].allocs != 0 || watch_sites[i].frees != 0)) {
+			sites[num++] = watch_sites[i];
+		}
+	}
+	if (watch_other.allocs != 0 || watch_other.frees != 0) {
+		sites[num++] = watch_other;
+	}
+	totals = watch_totals;
+	WATCH_UNLOCK();
+	qsort(sites, num, sizeof(TTMallocSite), watch_site_cmp);
+
+	snprintf(line, sizeof(line), "%-28s %10s %10s %12s %10s %10s", "site", "allocs", "frees", "bytes", "live", "peak");
+	print(userdata, line);
+	for (i = 0; i < num; i++) {
+		name = strrchr(sites[i].file, '/');
+		name = name != NULL ? name + 1 : sites[i].file;
+		snprintf(line, sizeof(line), "%20.20s:%-7d %10" PRIu64 " %10" PRIu64 " %12" PRIu64 " %10zu %10zu",
+				name, sites[i].line, sites[i].allocs, sites[i].frees, sites[i].bytes, sites[i].live, sites[i].peak);
+		print(userdata, line);
+	}
+	snprintf(line, sizeof(line), "%-28s %10" PRIu64 " %10" PRIu64 " %12" PRIu64 " %10zu %10zu",
+			"total", totals.allocs, totals.frees, totals.bytes, totals.live, totals.peak);
+	print(userdata, line);
+	free(sites);
+}
@@ -0,0 +1,37 @@
+#ifndef __TT_MALLOC_DEBUG_H__
+#define __TT_MALLOC_DEBUG_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* allocation profiler, built with -DWATCH_RAM (cmake -DWATCH_RAM=ON), MY_MALLOC of terminal.c, term_server.c
+ * and tt_buffer.c pass file and line here, allocations, bytes and peak of live bytes are counted per call site.
+ * blocks must be freed by my_free or my_realloc, memory from plain malloc is not accepted */
+extern void *my_malloc(size_t size, const char *file, int line);
+extern void *my_realloc(void *ptr, size_t size, const char *file, int line);
+extern void my_free(void *ptr, const char *file, int line);
+extern char *my_strdup(const char *str, const char *file, int line);
+
+typedef struct TTMallocTotals {
+	uint64_t allocs; /* realloc is counted as one free and one alloc */
+	uint64_t frees;
+	uint64_t bytes; /* bytes requested by allocs */
+	size_t live; /* bytes not freed yet */
+	size_t peak; /* max of live */
+} TTMallocTotals;
+
+extern void tt_malloc_totals(TTMallocTotals *totals);
+/* counters and peak start again from now, live blocks are kept, e.g. reset before a key and report after it */
+extern void tt_malloc_reset(void);
+/* print one line per call site ordered by bytes, lines have no '\n', sites without allocation since reset are skipped */
+extern void tt_malloc_report(void (*print)(void *userdata, const char *line), void *userdata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -4,33 +4,57 @@
 #if _WIN32
 
 #include <windows.h>
+#include <stdlib.h>
 #include <process.h>
 #include <time.h>
-typedef struct pthread_t {
-    void *handle;
+typedef struct w32thread_start {
     void *(*func)(void* arg);
     void *arg;
     void *ret;
+    volatile LONG refs; /* thread and joiner, freed by the last one, pthread_t may be freed by its own thread after detach */
+} w32thread_start;
+
+typedef struct pthread_t {
+    void *handle;
+    w32thread_start *start;
 } pthread_t;
 
 typedef CRITICAL_SECTION pthread_mutex_t;
 
+static inline void win32thread_release(w32thread_start *start) {
+    if (InterlockedDecrement(&(start->refs)) == 0) {
+        free(start);
+    }
+}
+
 static inline DWORD WINAPI win32thread_worker(void *arg) {
-    pthread_t *h = arg;
-    h->ret = h->func(h->arg);
+    w32thread_start *start = arg;
+    start->ret = start->func(start->arg);
+    win32thread_release(start);
     return 0;
 }
 
 static inline int pthread_create(pthread_t *thread, const void *unused_attr,
                                     void *(*start_routine)(void*), void *arg) {
-    thread->func   = start_routine;
-    thread->arg    = arg;
+    w32thread_start *start = malloc(sizeof(w32thread_start));
+    if (start == NULL) {
+        return 1;
+    }
+    start->func = start_routine;
+    start->arg = arg;
+    start->ret = NULL;
+    start->refs = 2;
+    thread->start = start;
 #if 0
-    thread->handle = (void*)CreateThread(NULL, 0, win32thread_worker, thread, 0, NULL);
+    thread->handle = (void*)CreateThread(NULL, 0, win32thread_worker, start, 0, NULL);
 #else
-    thread->handle = (void*)_beginthreadex(NULL, 0, win32thread_worker, thread, 0, NULL);
+    thread->handle = (void*)_beginthreadex(NULL, 0, win32thread_worker, start, 0, NULL);
 #endif
-    return !thread->handle;
+    if (!thread->handle) {
+        free(start);
+        return 1;
+    }
+    return 0;
 }
 
 static inline int pthread_join(pthread_t thread, void **value_ptr) {
@@ -42,8 +66,15 @@ static inline int pthread_join(pthread_t thread, void **value_ptr) {
             return EDEADLK;
     }
     if (value_ptr)
-        *value_ptr = thread.ret;
+        *value_ptr = thread.start->ret;
+    CloseHandle(thread.handle);
+    win32thread_release(thread.start);
+    return 0;
+}
+
+static inline int pthread_detach(pthread_t thread) {
     CloseHandle(thread.handle);
+    win32thread_release(thread.start);
     return 0;
 }
 
@@ -67,6 +98,31 @@ static inline int pthread_mutex_unlock(pthread_mutex_t *m) {
     return 0;
 }
 
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static inline int pthread_cond_init(pthread_cond_t *c, void* attr) {
+    InitializeConditionVariable(c);
+    return 0;
+}
+
+static inline int pthread_cond_destroy(pthread_cond_t *c) {
+    return 0;
+}
+
+static inline int pthread_cond_wait(pthread_cond_t *c, pthread_mutex_t *m) {
+    return !SleepConditionVariableCS(c, m, INFINITE);
+}
+
+static inline int pthread_cond_signal(pthread_cond_t *c) {
+    WakeConditionVariable(c);
+    return 0;
+}
+
+static inline int pthread_cond_broadcast(pthread_cond_t *c) {
+    WakeAllConditionVariable(c);
+    return 0;
+}
+
 #endif /* _WIN32 */
 
 #endif